@@ -0,0 +1,152 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Compares the time to hash a tree of files on a cold page cache when the files are read in different orders:
+//   table     - sorted by path, as the manifest lists them
+//   directory - files of a directory next to each other
+//   inode     - by inode number
+//   physical  - by the disk offset of the first extent (FIEMAP)
+// Each order runs without and with readahead hints for the next kReadaheadFilesCount files, as the checker does.
+// The files are written in a shuffled order, so their place on the disk doesn't follow their paths.
+// Cold runs are only possible on Linux; use a directory on the disk you care about, tmpfs has no cold cache.
+// Usage: resources_manager_bench_check_order [files_count] [directory]
+
+#include "bench_common.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <numeric>
+#include <random>
+#include <common.hpp>
+#include <file_stat.hpp>
+
+namespace {
+constexpr size_t kDefaultFilesCount = 2000;
+constexpr size_t kDirectoriesCount = 50;
+constexpr uint64_t kMinFileSize = 16 * 1024;
+constexpr uint64_t kMaxFileSize = 1024 * 1024;
+constexpr size_t kReadaheadFilesCount = 8;
+
+struct test_file_t {
+  std::filesystem::path path;
+  uint64_t size;
+};
+
+std::vector<test_file_t> write_test_files(const std::filesystem::path &directory, size_t count) {
+  std::mt19937_64 rng(0);
+  std::uniform_int_distribution<uint64_t> size_distribution(kMinFileSize, kMaxFileSize);
+  std::vector<test_file_t> files;
+  for (size_t i = 0; i < count; ++i) {
+    auto name = "dir" + std::to_string(i % kDirectoriesCount) + "/file" + std::to_string(i) + ".bin";
+    files.push_back({directory / name, size_distribution(rng)});
+  }
+  std::sort(files.begin(), files.end(), [](auto &a, auto &b) { return a.path < b.path; });
+
+  auto creation_order = files;
+  std::shuffle(creation_order.begin(), creation_order.end(), rng);
+  std::vector<uint64_t> content(kMaxFileSize / sizeof(uint64_t));
+  for (auto &file : creation_order) {
+    std::filesystem::create_directories(file.path.parent_path());
+    for (auto &value : content)
+      value = rng();
+    std::ofstream stream(file.path, std::ios::out | std::ios::binary | std::ios::trunc);
+    stream.write(reinterpret_cast<const char *>(content.data()), static_cast<std::streamsize>(file.size));
+    if (!stream)
+      throw std::runtime_error("Could not write " + file.path.string());
+  }
+  return files;
+}
+
+bool evict_from_page_cache(const std::filesystem::path &path) {
+#if defined(__linux__)
+  auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  fdatasync(fd);
+  auto ret = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+  ::close(fd);
+  return ret;
+#else
+  (void) path;
+  return false;
+#endif
+}
+
+const char *get_order_name(common::read_order_t order) {
+  switch (order) {
+  case common::read_order_t::kTable: return "table";
+  case common::read_order_t::kDirectory: return "directory";
+  case common::read_order_t::kInode: return "inode";
+  case common::read_order_t::kPhysical: return "physical";
+  }
+  return "unknown";
+}
+
+void measure(const std::vector<test_file_t> &files, common::read_order_t order, bool readahead) {
+  for (auto &file : files) {
+    if (!evict_from_page_cache(file.path)) {
+      std::cout << "Can't evict " << file.path << " from the page cache, cold runs are not possible" << std::endl;
+      std::exit(1);
+    }
+  }
+
+  bench::stopwatch stopwatch;
+  std::vector<common::read_item_t> items;
+  for (size_t i = 0; i < files.size(); ++i) {
+    auto stat = common::get_file_stat(files[i].path);
+    items.push_back({i, files[i].path, stat.has_value() ? stat->file_id : 0});
+  }
+  auto used_order = common::sort_for_reading(items, order);
+  auto sort_elapsed = stopwatch.elapsed_ms();
+  size_t hinted_count = 0;
+  uint64_t hash = 0;
+  for (size_t i = 0; i < items.size(); ++i) {
+    for (; readahead && hinted_count < std::min(items.size(), i + 1 + kReadaheadFilesCount); ++hinted_count)
+      common::hint_file_read(items[hinted_count].path, files[items[hinted_count].index].size);
+    hash ^= common::get_file_hash(items[i].path, common::hash_algorithm_t::kXxh3);
+  }
+  auto elapsed = stopwatch.elapsed_ms();
+  std::cout << std::left << std::setw(10) << get_order_name(order) << std::setw(10)
+            << (readahead ? "hinted" : "plain") << std::right << std::fixed << std::setprecision(2)
+            << std::setw(10) << elapsed << " ms  (sorting " << sort_elapsed << " ms, used "
+            << get_order_name(used_order) << ", " << std::hex << hash << std::dec << ")" << std::endl;
+}
+}
+
+int main(int argc, char *argv[]) {
+  auto files_count = argc > 1 ? static_cast<size_t>(std::stoull(argv[1])) : kDefaultFilesCount;
+  std::filesystem::path directory = argc > 2 ? argv[2] : "check_order";
+
+  std::cout << "Writing " << files_count << " files to " << directory << std::endl;
+  auto files = write_test_files(directory, files_count);
+  uint64_t total_size = std::accumulate(files.begin(), files.end(), uint64_t(0), [](uint64_t sum, auto &file) {
+    return sum + file.size;
+  });
+  std::cout << "Reading " << bench::to_mb(total_size) << " MB per run" << std::endl;
+  for (auto order : {common::read_order_t::kTable, common::read_order_t::kDirectory, common::read_order_t::kInode,
+                     common::read_order_t::kPhysical}) {
+    measure(files, order, false);
+    measure(files, order, true);
+  }
+  std::filesystem::remove_all(directory);
+  return 0;
+}
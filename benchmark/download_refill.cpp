@@ -0,0 +1,318 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Downloads a tree of files of mixed sizes from a local CDN stand-in that serves every connection at
+// kConnectionBytesPerSecond after kFirstByteDelay, like a far away server does. Mostly small files with a few large
+// ones among them: when every transfer of a batch has to end before the next batch starts, the large ones hold
+// their batch's slots idle for most of the run. The ideal time is what the slots would take if none of them ever
+// waited, or the largest file alone, whichever is longer.
+//   fixed    - kFixedJobsCount parallel transfers
+//   adaptive - 1 to 32 parallel transfers, as many as the link takes
+// Usage: resources_manager_bench_download_refill [files_count] [directory]
+
+// winsock2.h has to come before windows.h, which bench_common.hpp includes
+#if WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "bench_common.hpp"
+
+#include <iostream>
+#include <atomic>
+#include <iomanip>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <common.hpp>
+#include <binary_manifest.hpp>
+#include <resources_manager.h>
+
+namespace {
+constexpr size_t kDefaultFilesCount = 300;
+constexpr size_t kDirectoriesCount = 10;
+constexpr size_t kFixedJobsCount = 5;
+constexpr uint64_t kConnectionBytesPerSecond = 4 * 1024 * 1024;
+constexpr std::chrono::milliseconds kFirstByteDelay(30);
+constexpr size_t kSendChunkSize = 16 * 1024;
+
+#if WIN32
+using socket_t = SOCKET;
+constexpr socket_t kInvalidSocket = INVALID_SOCKET;
+
+void close_socket(socket_t socket) {
+  closesocket(socket);
+}
+#else
+using socket_t = int;
+constexpr socket_t kInvalidSocket = -1;
+
+void close_socket(socket_t socket) {
+  ::close(socket);
+}
+#endif
+
+bool send_all(socket_t socket, const char *data, size_t size) {
+  while (size != 0) {
+    auto sent = send(socket, data, static_cast<int>(std::min<size_t>(size, INT32_MAX)), 0);
+    if (sent <= 0)
+      return false;
+    data += sent;
+    size -= static_cast<size_t>(sent);
+  }
+  return true;
+}
+
+// HTTP/1.1 server of files kept in memory, one thread per connection. Only what the client asks for is
+// implemented: GET and HEAD of a path, keep-alive, 404 for anything unknown
+class cdn_stand_in {
+  const std::unordered_map<std::string, std::string> &files;
+  socket_t listener = kInvalidSocket;
+  uint16_t port = 0;
+  std::thread acceptor;
+  std::mutex connections_mtx;
+  std::vector<socket_t> connections;
+  std::vector<std::thread> connection_threads;
+  std::atomic_size_t accepted_count = 0;
+
+  void serve(socket_t socket) {
+    std::string buffer;
+    char data[4096];
+    while (true) {
+      auto headers_end = buffer.find("\r\n\r\n");
+      if (headers_end == std::string::npos) {
+        auto received = recv(socket, data, static_cast<int>(sizeof(data)), 0);
+        if (received <= 0)
+          return;
+        buffer.append(data, static_cast<size_t>(received));
+        continue;
+      }
+      auto request_line = buffer.substr(0, buffer.find("\r\n"));
+      buffer.erase(0, headers_end + 4);
+      auto method_end = request_line.find(' ');
+      auto path_end = request_line.find(' ', method_end + 1);
+      if (method_end == std::string::npos || path_end == std::string::npos)
+        return;
+      auto method = request_line.substr(0, method_end);
+      auto path = request_line.substr(method_end + 2, path_end - method_end - 2); // without the leading slash
+
+      std::this_thread::sleep_for(kFirstByteDelay);
+      auto file = files.find(path);
+      if (file == files.end()) {
+        std::string response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        if (!send_all(socket, response.data(), response.size()))
+          return;
+        continue;
+      }
+      auto &content = file->second;
+      auto response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(content.size()) + "\r\n\r\n";
+      if (!send_all(socket, response.data(), response.size()))
+        return;
+      if (method == "HEAD")
+        continue;
+      auto start = std::chrono::steady_clock::now();
+      for (size_t offset = 0; offset < content.size(); offset += kSendChunkSize) {
+        auto size = std::min(kSendChunkSize, content.size() - offset);
+        if (!send_all(socket, content.data() + offset, size))
+          return;
+        auto due = std::chrono::duration<double>(static_cast<double>(offset + size) / kConnectionBytesPerSecond);
+        std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(due));
+      }
+    }
+  }
+
+public:
+  explicit cdn_stand_in(const std::unordered_map<std::string, std::string> &files) : files(files) {
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == kInvalidSocket)
+      throw std::runtime_error("Could not create a socket");
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t address_size = sizeof(address);
+    if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+        || listen(listener, SOMAXCONN) != 0
+        || getsockname(listener, reinterpret_cast<sockaddr *>(&address), &address_size) != 0) {
+      close_socket(listener);
+      throw std::runtime_error("Could not listen on the loopback interface");
+    }
+    port = ntohs(address.sin_port);
+    acceptor = std::thread([this]() {
+      while (true) {
+        auto connection = accept(listener, nullptr, nullptr);
+        if (connection == kInvalidSocket)
+          return; // the listener is closed
+        ++accepted_count;
+        std::scoped_lock lock(connections_mtx);
+        connections.push_back(connection);
+        connection_threads.emplace_back([this, connection]() { serve(connection); });
+      }
+    });
+  }
+
+  ~cdn_stand_in() {
+#if WIN32
+    closesocket(listener);
+#else
+    shutdown(listener, SHUT_RDWR); // close() alone doesn't wake up accept() on Linux
+    ::close(listener);
+#endif
+    acceptor.join();
+    std::scoped_lock lock(connections_mtx);
+    for (auto connection : connections) {
+#if WIN32
+      shutdown(connection, SD_BOTH);
+#else
+      shutdown(connection, SHUT_RDWR);
+#endif
+    }
+    for (auto &thread : connection_threads)
+      thread.join();
+    for (auto connection : connections)
+      close_socket(connection);
+  }
+
+  std::string get_url() const {
+    return "http://127.0.0.1:" + std::to_string(port);
+  }
+
+  size_t get_accepted_count() const {
+    return accepted_count;
+  }
+};
+
+// Mostly small files, some medium ones and a few large ones
+uint64_t get_file_size(std::mt19937_64 &rng) {
+  auto kind = std::uniform_int_distribution<int>(0, 99)(rng);
+  if (kind < 80)
+    return std::uniform_int_distribution<uint64_t>(4 * 1024, 128 * 1024)(rng);
+  if (kind < 97)
+    return std::uniform_int_distribution<uint64_t>(256 * 1024, 2 * 1024 * 1024)(rng);
+  return std::uniform_int_distribution<uint64_t>(8 * 1024 * 1024, 16 * 1024 * 1024)(rng);
+}
+
+// Writes the files and their manifest to `directory` and returns them with the manifest, by URL path
+std::unordered_map<std::string, std::string> write_cdn_files(const std::filesystem::path &directory, size_t count) {
+  std::mt19937_64 rng(0);
+  std::unordered_map<std::string, std::string> files;
+  common::binary_manifest::writer manifest;
+  for (size_t i = 0; i < count; ++i) {
+    auto name = "dir" + std::to_string(i % kDirectoriesCount) + "/file" + std::to_string(i) + ".bin";
+    std::string content(get_file_size(rng), '\0');
+    for (auto &value : content)
+      value = static_cast<char>(rng());
+    auto path = directory / name;
+    create_directories(path.parent_path());
+    common::write_file(path, content);
+
+    common::binary_manifest::entry_view_t entry;
+    entry.relative_path = name;
+    entry.size = content.size();
+    entry.hash_algorithm = common::kDefaultHashAlgorithm;
+    entry.hash = common::get_file_hash(path, entry.hash_algorithm);
+    manifest.add(entry);
+    files.emplace(name, std::move(content));
+  }
+  files.emplace(common::binary_manifest::kFilename, manifest.serialize());
+  return files;
+}
+
+bool wait_for(rm_tree *tree) {
+  while (rm_tree_fetching_updates(tree) || rm_tree_checking(tree) || rm_tree_downloading(tree))
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  if (!rm_tree_has_worker_errors(tree))
+    return true;
+  char error[4096] = {};
+  rm_tree_get_worker_error_str(tree, error, sizeof(error));
+  std::cout << "  failed: " << error << std::endl;
+  return false;
+}
+
+void measure(const char *mode, const cdn_stand_in &cdn, const std::filesystem::path &directory,
+             size_t min_jobs_count, size_t max_jobs_count, uint64_t total_size, uint64_t largest_size) {
+  remove_all(directory);
+  create_directories(directory);
+  auto tree = rm_tree_create(directory.string().c_str());
+  rm_tree_add_cdn(tree, rm_cdn_create(cdn.get_url().c_str()));
+  rm_tree_set_download_concurrency(tree, min_jobs_count, max_jobs_count);
+  rm_tree_fetch_updates(tree);
+  if (wait_for(tree)) {
+    rm_tree_check(tree);
+    if (wait_for(tree)) {
+      auto accepted_count = cdn.get_accepted_count();
+      bench::stopwatch stopwatch;
+      rm_tree_download(tree);
+      if (wait_for(tree)) {
+        auto elapsed = stopwatch.elapsed_ms();
+        auto jobs_count = rm_tree_get_download_concurrency(tree);
+        auto ideal = 1000.0 * std::max(static_cast<double>(total_size) / static_cast<double>(jobs_count),
+                                       static_cast<double>(largest_size)) / kConnectionBytesPerSecond;
+        std::cout << std::left << std::setw(10) << mode << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(10) << elapsed << " ms" << std::setw(10)
+                  << bench::to_mb(total_size) / (elapsed / 1000.0) << " MB/s  " << std::setw(3) << jobs_count
+                  << " jobs at the end, ideal for them " << ideal << " ms, "
+                  << cdn.get_accepted_count() - accepted_count << " connections opened" << std::endl;
+      }
+    }
+  }
+  rm_tree_destroy(tree);
+}
+}
+
+int main(int argc, char *argv[]) {
+  size_t files_count = argc > 1 ? std::stoull(argv[1]) : kDefaultFilesCount;
+  std::filesystem::path directory = argc > 2 ? argv[2] : "download_refill";
+#if WIN32
+  WSADATA wsa_data;
+  WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#endif
+
+  auto files = write_cdn_files(directory / "cdn", files_count);
+  uint64_t total_size = 0;
+  uint64_t largest_size = 0;
+  for (auto &[path, content] : files) {
+    if (path == common::binary_manifest::kFilename)
+      continue;
+    total_size += content.size();
+    largest_size = std::max<uint64_t>(largest_size, content.size());
+  }
+  std::cout << "Serving " << files_count << " files, " << bench::to_mb(total_size) << " MB, the largest is "
+            << bench::to_mb(largest_size) << " MB, " << bench::to_mb(kConnectionBytesPerSecond)
+            << " MB/s per connection" << std::endl;
+  {
+    cdn_stand_in cdn(files);
+    measure("fixed", cdn, directory / "dst", kFixedJobsCount, kFixedJobsCount, total_size, largest_size);
+    measure("adaptive", cdn, directory / "dst", 1, 32, total_size, largest_size);
+  }
+  std::filesystem::remove_all(directory);
+#if WIN32
+  WSACleanup();
+#endif
+  return 0;
+}
@@ -0,0 +1,105 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Compares content hash throughput over in-memory buffers, so only CPU cost is measured:
+//   fnv      - common::get_fnv_hash, the legacy byte-at-a-time hash
+//   xxh3     - XXH3 dispatched to the widest vector unit of this CPU
+//   portable - XXH3 of the compile-time target, what the dispatcher falls back to
+//   chunked  - dispatched XXH3 through common::content_hasher in 16KB chunks, as downloads feed it
+//   blocks   - xxh3-blocks with the blocks hashed on a common::thread_pool of all cores, as the checker does
+// Usage: resources_manager_bench_hash_throughput [buffer_size...]
+
+#include "bench_common.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include <content_hash.hpp>
+#include <thread_pool.hpp>
+
+namespace {
+constexpr size_t kChunkSize = 16 * 1024;
+constexpr size_t kMinMeasuredBytes = 512 * 1024 * 1024; // small buffers are hashed repeatedly up to this amount
+
+template <typename Fn>
+void measure(const char *mode, const std::vector<uint8_t> &buffer, Fn fn) {
+  auto rounds = std::max<size_t>(1, kMinMeasuredBytes / buffer.size());
+  uint64_t sink = 0;
+  bench::stopwatch stopwatch;
+  for (size_t i = 0; i < rounds; ++i) {
+    sink += fn(buffer.data(), buffer.size());
+  }
+  auto elapsed = stopwatch.elapsed_ms();
+  auto gb_per_second = static_cast<double>(buffer.size()) * static_cast<double>(rounds) / (elapsed * 1e6);
+  std::cout << std::left << std::setw(10) << mode << std::right << std::setw(12) << buffer.size()
+            << std::fixed << std::setprecision(2) << std::setw(10) << gb_per_second << " GB/s"
+            << "  (" << std::hex << sink << std::dec << ")" << std::endl;
+}
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<size_t> sizes;
+  for (auto i = 1; i < argc; ++i)
+    sizes.push_back(std::stoull(argv[i]));
+  if (sizes.empty())
+    sizes = {64, 4 * 1024, 64 * 1024, 1024 * 1024, 64 * 1024 * 1024};
+
+  std::cout << "xxh3 dispatched to " << XXH3_dispatch_target() << std::endl;
+  common::thread_pool pool;
+  std::cout << "blocks hashed on " << pool.size() << " threads" << std::endl;
+  std::mt19937_64 rng(0);
+  for (auto size : sizes) {
+    std::vector<uint8_t> buffer(size);
+    for (auto &byte : buffer)
+      byte = static_cast<uint8_t>(rng());
+    measure("fnv", buffer, [](const uint8_t *data, size_t size) {
+      return static_cast<uint64_t>(common::get_fnv_hash(data, size));
+    });
+    measure("xxh3", buffer, [](const uint8_t *data, size_t size) {
+      return common::get_hash(common::hash_algorithm_t::kXxh3, data, size);
+    });
+    measure("portable", buffer, [](const uint8_t *data, size_t size) {
+      return static_cast<uint64_t>(XXH3_64bits(data, size));
+    });
+    measure("chunked", buffer, [](const uint8_t *data, size_t size) {
+      common::content_hasher hasher(common::hash_algorithm_t::kXxh3);
+      for (size_t offset = 0; offset < size; offset += kChunkSize)
+        hasher.update(data + offset, std::min(kChunkSize, size - offset));
+      return hasher.digest();
+    });
+    measure("blocks", buffer, [&pool](const uint8_t *data, size_t size) {
+      std::vector<std::future<uint64_t>> blocks;
+      for (size_t offset = 0; offset < size; offset += common::kHashBlockSize) {
+        blocks.push_back(pool.submit([data, size, offset]() {
+          auto block_size = std::min(common::kHashBlockSize, size - offset);
+          return static_cast<uint64_t>(XXH3_64bits_dispatch(data + offset, block_size));
+        }));
+      }
+      std::vector<uint64_t> block_hashes;
+      for (auto &block : blocks)
+        block_hashes.push_back(pool.wait(block));
+      return common::combine_block_hashes(block_hashes.data(), block_hashes.size());
+    });
+  }
+  return 0;
+}
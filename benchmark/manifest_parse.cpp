@@ -0,0 +1,263 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Compares manifest loading strategies over synthetic manifests:
+//   dom    - whole document in a std::string, nlohmann DOM, rm_entry per element (the old fetcher path)
+//   stream - 16KB chunks (CURL_MAX_WRITE_SIZE) pushed into rm_manifest_parser
+//   binary - rm_files_data.bin viewed in place
+//   vector - binary, but entries kept as std::vector<rm_entry> like the tree did before rm_entry_table
+//   zst    - zstd-compressed binary, decompressed and parsed on one thread
+//   shards - the same split into one zstd-compressed shard per core, each decompressed and parsed on its own thread
+// Every other mode fills rm_entry_table, its own footprint is reported next to the peak RSS.
+// Usage: resources_manager_bench_manifest_parse [entries_count...]
+
+#include "pch.h"
+#include "rm_manifest_parser.h"
+#include "rm_entry_table.h"
+#include "bench_common.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <common.hpp>
+
+namespace {
+constexpr size_t kChunkSize = 16 * 1024;
+
+std::filesystem::path get_manifest_path(size_t entries_count, bool binary) {
+  auto filename = "rm_bench_manifest_" + std::to_string(entries_count) + (binary ? ".bin" : ".json");
+  return std::filesystem::temp_directory_path() / filename;
+}
+
+std::filesystem::path get_compressed_manifest_path(size_t entries_count, std::optional<size_t> shard = std::nullopt) {
+  auto filename = "rm_bench_manifest_" + std::to_string(entries_count);
+  if (shard.has_value())
+    filename += ".shard." + std::to_string(*shard);
+  return std::filesystem::temp_directory_path() / (filename + ".bin.zst");
+}
+
+size_t get_shards_count() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void write_compressed(const std::filesystem::path &path, const std::string &data) {
+  std::string compressed(ZSTD_compressBound(data.size()), '\0');
+  auto ret = ZSTD_compress(compressed.data(), compressed.size(), data.data(), data.size(), 3);
+  if (ZSTD_isError(ret))
+    throw std::runtime_error(ZSTD_getErrorName(ret));
+  compressed.resize(ret);
+  common::write_file(path, compressed);
+}
+
+void generate_compressed(size_t entries_count) {
+  auto data = common::read_file(get_manifest_path(entries_count, true));
+  write_compressed(get_compressed_manifest_path(entries_count), data);
+  common::binary_manifest::view view;
+  view.open(data.data(), data.size());
+  auto shards_count = get_shards_count();
+  for (size_t i = 0; i < shards_count; ++i) {
+    common::binary_manifest::writer shard;
+    for (auto j = view.size() * i / shards_count; j < view.size() * (i + 1) / shards_count; ++j) {
+      shard.add(view.at(j));
+    }
+    write_compressed(get_compressed_manifest_path(entries_count, i), shard.serialize());
+  }
+}
+
+void remove_compressed(size_t entries_count) {
+  remove(get_compressed_manifest_path(entries_count));
+  for (size_t i = 0; i < get_shards_count(); ++i) {
+    remove(get_compressed_manifest_path(entries_count, i));
+  }
+}
+
+rm_entry_table parse_compressed(const std::filesystem::path &path) {
+  auto compressed = common::read_file(path);
+  std::string data;
+  common::stream_decompressor decompressor;
+  decompressor.decompress(compressed.data(), compressed.size(), [&](const char *chunk, size_t size) {
+    data.append(chunk, size);
+  });
+  decompressor.finish();
+  common::binary_manifest::view view;
+  if (!view.open(data.data(), data.size()))
+    throw std::runtime_error("Generated binary manifest is invalid");
+  rm_entry_table ret;
+  ret.reserve(view.size(), data.size());
+  for (size_t i = 0; i < view.size(); ++i) {
+    ret.add(view.at(i));
+  }
+  return ret;
+}
+
+void generate(size_t entries_count) {
+  std::mt19937_64 rng(entries_count);
+  common::binary_manifest::writer binary;
+  std::ofstream json_file;
+  json_file.open(get_manifest_path(entries_count, false), std::ios::out | std::ios::binary);
+  json_file << '[';
+  for (size_t i = 0; i < entries_count; ++i) {
+    auto path = "resources\\models\\pack_" + std::to_string(i / 256) + "\\object_" + std::to_string(i) + ".dff";
+    common::binary_manifest::entry_view_t entry;
+    entry.size = rng() % (64 * 1024 * 1024);
+    entry.hash = rng();
+    entry.hash_algorithm = common::hash_algorithm_t::kXxh3;
+    entry.compressed = i % 4 == 0;
+    if (entry.compressed) {
+      entry.compressed_size = entry.size / 2;
+      entry.compressed_hash = rng();
+    }
+    auto escaped_path = path;
+    for (size_t pos = 0; (pos = escaped_path.find('\\', pos)) != std::string::npos; pos += 2)
+      escaped_path.insert(pos, 1, '\\');
+    json_file << (i == 0 ? "" : ",") << R"({"p":")" << escaped_path << R"(","s":)" << entry.size
+              << R"(,"h":)" << entry.hash << R"(,"a":1,"c":)" << (entry.compressed ? "true" : "false");
+    if (entry.compressed)
+      json_file << R"(,"cs":)" << entry.compressed_size << R"(,"ch":)" << entry.compressed_hash;
+    json_file << '}';
+    std::replace(path.begin(), path.end(), '\\', '/');
+    entry.relative_path = path;
+    binary.add(entry);
+  }
+  json_file << ']';
+  binary.write(get_manifest_path(entries_count, true));
+}
+
+template <typename Fn>
+void read_chunks(const std::filesystem::path &path, Fn fn) {
+  std::ifstream file;
+  file.open(path, std::ios::in | std::ios::binary);
+  auto buffer = std::make_unique<char[]>(kChunkSize);
+  while (true) {
+    file.read(buffer.get(), kChunkSize);
+    auto bytes_read = file.gcount();
+    if (bytes_read <= 0)
+      break;
+    fn(buffer.get(), static_cast<size_t>(bytes_read));
+  }
+}
+
+int run(const std::string &mode, size_t entries_count) {
+  rm_entry_table items;
+  std::vector<rm_entry> legacy_items;
+  bench::stopwatch stopwatch;
+  if (mode == "dom") {
+    std::string data;
+    read_chunks(get_manifest_path(entries_count, false), [&](const char *chunk, size_t size) {
+      data.append(chunk, size);
+    });
+    auto data_json = nlohmann::json::parse(data);
+    for (auto &entry : data_json) {
+      items.add(rm_entry(entry));
+    }
+  } else if (mode == "stream") {
+    rm_manifest_parser parser([&](rm_entry &&entry) {
+      items.add(entry);
+    });
+    read_chunks(get_manifest_path(entries_count, false), [&](const char *chunk, size_t size) {
+      parser.feed(chunk, size);
+    });
+    parser.finish();
+  } else if (mode == "binary" || mode == "vector") {
+    std::string data;
+    data.reserve(file_size(get_manifest_path(entries_count, true)));
+    read_chunks(get_manifest_path(entries_count, true), [&](const char *chunk, size_t size) {
+      data.append(chunk, size);
+    });
+    common::binary_manifest::view view;
+    if (!view.open(data.data(), data.size()))
+      throw std::runtime_error("Generated binary manifest is invalid");
+    if (mode == "binary") {
+      items.reserve(view.size(), data.size());
+      for (size_t i = 0; i < view.size(); ++i) {
+        items.add(view.at(i));
+      }
+    } else {
+      legacy_items.reserve(view.size());
+      for (size_t i = 0; i < view.size(); ++i) {
+        legacy_items.emplace_back(view.at(i));
+      }
+    }
+  } else if (mode == "zst") {
+    items = parse_compressed(get_compressed_manifest_path(entries_count));
+    items.sort();
+  } else if (mode == "shards") {
+    std::vector<std::future<rm_entry_table>> shards;
+    for (size_t i = 0; i < get_shards_count(); ++i) {
+      shards.emplace_back(std::async(std::launch::async, parse_compressed, get_compressed_manifest_path(entries_count, i)));
+    }
+    for (auto &shard : shards) {
+      auto table = shard.get();
+      for (rm_entry_table::id_t id = 0; id < table.size(); ++id) {
+        items.add(table.at(id));
+      }
+    }
+    items.sort();
+  } else {
+    std::cerr << "Unknown mode: " << mode << std::endl;
+    return 1;
+  }
+  auto elapsed = stopwatch.elapsed_ms();
+  auto parsed_count = mode == "vector" ? legacy_items.size() : items.size();
+  if (parsed_count != entries_count) {
+    std::cerr << "Parsed " << parsed_count << " entries instead of " << entries_count << std::endl;
+    return 1;
+  }
+
+  std::cout << std::left << std::setw(8) << mode << std::right << std::setw(10) << entries_count
+            << std::fixed << std::setprecision(1) << std::setw(12) << elapsed << " ms"
+            << std::setw(12) << bench::to_mb(bench::get_peak_rss()) << " MB peak RSS";
+  if (mode != "vector")
+    std::cout << std::setw(10) << static_cast<double>(items.get_memory_usage()) / static_cast<double>(entries_count)
+              << " B/entry in table";
+  std::cout << std::endl;
+  return 0;
+}
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 4 && std::string(argv[1]) == "run")
+    return run(argv[2], std::stoull(argv[3]));
+  if (argc == 3 && std::string(argv[1]) == "generate") {
+    generate(std::stoull(argv[2]));
+    generate_compressed(std::stoull(argv[2]));
+    return 0;
+  }
+
+  std::vector<size_t> counts;
+  for (auto i = 1; i < argc; ++i)
+    counts.push_back(std::stoull(argv[i]));
+  if (counts.empty())
+    counts = {100000, 1000000};
+
+  auto ret = 0;
+  for (auto entries_count : counts) {
+    ret |= bench::run_self(argv[0], "generate " + std::to_string(entries_count));
+    std::cout << "json: " << bench::to_mb(file_size(get_manifest_path(entries_count, false))) << " MB, binary: "
+              << bench::to_mb(file_size(get_manifest_path(entries_count, true))) << " MB" << std::endl;
+    for (auto mode : {"dom", "stream", "binary", "vector", "zst", "shards"})
+      ret |= bench::run_self(argv[0], std::string("run ") + mode + " " + std::to_string(entries_count));
+    remove(get_manifest_path(entries_count, false));
+    remove(get_manifest_path(entries_count, true));
+    remove_compressed(entries_count);
+  }
+  return ret;
+}
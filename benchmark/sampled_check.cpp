@@ -0,0 +1,123 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Compares the I/O of sampled file verification on a cold and a warm page cache:
+//   seek  - std::ifstream seekg + read of kCheckXBytes at every kCheckEveryXBytes, as sampling used to be done
+//   paged - the kSampleWindowSize windows of common::get_file_sample_windows, prefetched at once and read with
+//           positional reads, as common::get_file_hash does now
+// The cold runs evict the file from the page cache first, which is only possible on Linux; elsewhere they are
+// skipped. Use a file on the disk you care about, tmpfs has no cold cache at all.
+// Usage: resources_manager_bench_sampled_check [file_size_mb] [file_path]
+
+#include "bench_common.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <common.hpp>
+
+namespace {
+constexpr size_t kDefaultFileSizeMb = 1024;
+
+void write_test_file(const std::filesystem::path &path, uint64_t size) {
+  std::mt19937_64 rng(0);
+  std::vector<uint64_t> chunk(1024 * 1024 / sizeof(uint64_t));
+  std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  for (uint64_t written = 0; written < size; written += chunk.size() * sizeof(uint64_t)) {
+    for (auto &value : chunk)
+      value = rng();
+    auto piece_size = std::min<uint64_t>(size - written, chunk.size() * sizeof(uint64_t));
+    file.write(reinterpret_cast<const char *>(chunk.data()), static_cast<std::streamsize>(piece_size));
+  }
+  if (!file)
+    throw std::runtime_error("Could not write " + path.string());
+}
+
+bool evict_from_page_cache(const std::filesystem::path &path) {
+#if defined(__linux__)
+  auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  fdatasync(fd);
+  auto ret = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+  ::close(fd);
+  return ret;
+#else
+  (void) path;
+  return false;
+#endif
+}
+
+uint64_t hash_seek(const std::filesystem::path &path, uint64_t file_size, uint64_t &hashed_bytes) {
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  common::content_hasher hasher(common::hash_algorithm_t::kFnv);
+  char sample[common::kCheckXBytes];
+  for (uint64_t offset = 0; offset + common::kCheckXBytes <= file_size; offset += common::kCheckEveryXBytes) {
+    file.seekg(static_cast<std::streamoff>(offset));
+    file.read(sample, sizeof(sample));
+    hasher.update(sample, sizeof(sample));
+    hashed_bytes += sizeof(sample);
+  }
+  return hasher.digest();
+}
+
+uint64_t hash_paged(const std::filesystem::path &path, uint64_t file_size, uint64_t &hashed_bytes) {
+  auto windows = common::get_file_sample_windows(common::hash_algorithm_t::kXxh3, file_size);
+  common::positional_file_reader reader(path);
+  reader.prefetch(windows);
+  common::content_hasher hasher(common::hash_algorithm_t::kXxh3);
+  for (auto &window : windows) {
+    hashed_bytes += reader.read(window.offset, window.size, [&](const uint8_t *data, size_t size) {
+      hasher.update(data, size);
+    });
+  }
+  return hasher.digest();
+}
+
+template <typename Fn>
+void measure(const char *mode, const char *cache, const std::filesystem::path &path, uint64_t file_size, Fn fn) {
+  uint64_t hashed_bytes = 0;
+  bench::stopwatch stopwatch;
+  auto hash = fn(path, file_size, hashed_bytes);
+  auto elapsed = stopwatch.elapsed_ms();
+  std::cout << std::left << std::setw(8) << mode << std::setw(6) << cache << std::right << std::fixed
+            << std::setprecision(2) << std::setw(10) << elapsed << " ms" << std::setw(12) << hashed_bytes
+            << " bytes hashed  (" << std::hex << hash << std::dec << ")" << std::endl;
+}
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t file_size = (argc > 1 ? std::stoull(argv[1]) : kDefaultFileSizeMb) * 1024 * 1024;
+  std::filesystem::path path = argc > 2 ? argv[2] : "sampled_check.bin";
+
+  std::cout << "Writing " << bench::to_mb(file_size) << " MB to " << path << std::endl;
+  write_test_file(path, file_size);
+  for (auto [mode, fn] : {std::pair{"seek", &hash_seek}, std::pair{"paged", &hash_paged}}) {
+    if (evict_from_page_cache(path))
+      measure(mode, "cold", path, file_size, fn);
+    else
+      std::cout << mode << ": can't evict the file from the page cache, skipping the cold run" << std::endl;
+    measure(mode, "warm", path, file_size, fn);
+  }
+  std::filesystem::remove(path);
+  return 0;
+}
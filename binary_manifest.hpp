@@ -0,0 +1,407 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include "content_hash.hpp"
+
+// Compact binary twin of rm_files_data.json.
+// Layout: header_t, then header_t::entries_count records of header_t::entry_size bytes, then a string table
+// with all relative paths ('/'-separated, not null-terminated), then header_t::directories_count directory
+// records, then header_t::blocks_count block digests of kXxh3Blocks entries. All integers are little-endian.
+// Readers must honour header_t::header_size and header_t::entry_size, so new fields can be appended to header_t
+// and entry_t without a version bump. Headers of 32 bytes predate the directory section, headers of 48 bytes the
+// block section, entries of 40 bytes predate 64-bit hashes and only have FNV ones, entries of 56 bytes have no
+// block digests.
+//
+// Entries are sorted by path, so every directory subtree is a contiguous range of entries. Directories are stored
+// in pre-order, the root ("") first, each with a Merkle digest over its children: files contribute their name,
+// size and hash, subdirectories their name and digest. Equal digests mean equal subtrees.
+namespace common::binary_manifest {
+constexpr const char *kFilename = "rm_files_data.bin";
+constexpr uint32_t kMagic = 0x4D424D52; // "RMBM"
+constexpr uint16_t kVersion = 1;
+
+enum entry_flags_t : uint32_t {
+  kEntryCompressed = 1 << 0,
+  kEntryHashAlgorithmMask = 0xFF << 8, // hash_algorithm_t of both hashes
+};
+constexpr uint32_t kEntryHashAlgorithmShift = 8;
+
+struct header_t {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint32_t entries_count;
+  uint32_t entry_size;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+  uint64_t directories_offset;
+  uint32_t directories_count;
+  uint32_t directory_size;
+  uint64_t blocks_offset;
+  uint64_t blocks_count;
+};
+static_assert(sizeof(header_t) == 64);
+constexpr size_t kMinHeaderSize = 32;
+
+struct entry_t {
+  uint64_t size;
+  uint64_t compressed_size;
+  uint32_t path_offset;
+  uint32_t path_size;
+  uint32_t fnv_hash; // low 32 bits of hash, for readers of 40-byte entries
+  uint32_t compressed_fnv_hash;
+  uint32_t flags;
+  uint32_t reserved;
+  uint64_t hash;
+  uint64_t compressed_hash;
+  uint32_t first_block;
+  uint32_t blocks_count; // digests of the uncompressed content's blocks, 0 if not published
+};
+static_assert(sizeof(entry_t) == 64);
+constexpr size_t kMinEntrySize = 40;
+
+struct directory_t {
+  uint64_t digest;
+  uint32_t path_offset; // directory paths are prefixes of their entries' paths and point into the string table
+  uint32_t path_size;
+  uint32_t first_entry;
+  uint32_t entries_count; // the whole subtree
+};
+static_assert(sizeof(directory_t) == 24);
+
+// Little-endian 64-bit digests that don't have to be aligned
+struct block_hashes_view_t {
+  const uint8_t *data = nullptr;
+  size_t count = 0;
+
+  block_hashes_view_t() = default;
+  block_hashes_view_t(const void *data, size_t count) : data(reinterpret_cast<const uint8_t *>(data)), count(count) {}
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  uint64_t operator[](size_t index) const {
+    uint64_t ret = 0;
+    for (size_t i = 0; i < sizeof(ret); ++i)
+      ret |= static_cast<uint64_t>(data[index * sizeof(ret) + i]) << (i * 8);
+    return ret;
+  }
+};
+
+// Non-owning entry, valid as long as the underlying manifest buffer is alive
+struct entry_view_t {
+  std::string_view relative_path;
+  uint64_t size = 0;
+  uint64_t hash = 0;
+  hash_algorithm_t hash_algorithm = hash_algorithm_t::kFnv;
+  block_hashes_view_t block_hashes; // kXxh3Blocks entries only, optional even for them
+
+  bool compressed = false;
+  uint64_t compressed_size = 0;
+  uint64_t compressed_hash = 0;
+};
+
+struct directory_view_t {
+  std::string_view relative_path; // "" for the root
+  uint64_t digest = 0;
+  uint32_t first_entry = 0;
+  uint32_t entries_count = 0;
+};
+
+// FNV-1a 64, used for directory digests and anything else that needs to be combined the same way
+constexpr uint64_t kDigestSeed = 0xcbf29ce484222325ULL;
+
+inline uint64_t digest_append(uint64_t digest, const void *data, size_t size) {
+  auto bytes = reinterpret_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    digest ^= bytes[i];
+    digest *= 0x100000001b3ULL;
+  }
+  return digest;
+}
+
+inline uint64_t get_entry_digest(const entry_view_t &entry) {
+  auto ret = digest_append(kDigestSeed, &entry.size, sizeof(entry.size));
+  ret = digest_append(ret, &entry.hash_algorithm, sizeof(entry.hash_algorithm));
+  return digest_append(ret, &entry.hash, sizeof(entry.hash));
+}
+
+// Builds pre-order directory records over `count` entries sorted by path.
+// get_path(i) returns the '/'-separated path of entry i, get_leaf_digest(i) whatever describes the file itself,
+// e.g. get_entry_digest for manifests or a stat fingerprint for local files. Returned paths point into get_path's
+// storage.
+template <typename GetPath, typename GetLeafDigest>
+std::vector<directory_view_t> build_directories(size_t count, GetPath get_path, GetLeafDigest get_leaf_digest) {
+  struct open_directory_t {
+    size_t index;
+    uint64_t digest;
+  };
+  std::vector<directory_view_t> ret;
+  std::vector<open_directory_t> stack;
+  auto open = [&](std::string_view path, size_t first_entry) {
+    directory_view_t directory;
+    directory.relative_path = path;
+    directory.first_entry = static_cast<uint32_t>(first_entry);
+    stack.push_back({ret.size(), kDigestSeed});
+    ret.push_back(directory);
+  };
+  auto close = [&](size_t end_entry) {
+    auto closed = stack.back();
+    stack.pop_back();
+    auto &directory = ret[closed.index];
+    directory.digest = closed.digest;
+    directory.entries_count = static_cast<uint32_t>(end_entry - directory.first_entry);
+    if (!stack.empty()) {
+      auto name = directory.relative_path.substr(directory.relative_path.rfind('/') + 1);
+      auto &parent = stack.back().digest;
+      parent = digest_append(parent, name.data(), name.size());
+      parent = digest_append(parent, "/", 1);
+      parent = digest_append(parent, &directory.digest, sizeof(directory.digest));
+    }
+  };
+  auto is_inside = [](std::string_view path, std::string_view directory) {
+    return directory.empty() || (path.size() > directory.size() && path[directory.size()] == '/'
+        && path.substr(0, directory.size()) == directory);
+  };
+
+  open({}, 0);
+  for (size_t i = 0; i < count; ++i) {
+    std::string_view path = get_path(i);
+    auto separator = path.rfind('/');
+    auto directory_path = separator == std::string_view::npos ? std::string_view{} : path.substr(0, separator);
+    while (!is_inside(path, ret[stack.back().index].relative_path))
+      close(i);
+    // open every missing level down to the entry's directory
+    while (ret[stack.back().index].relative_path.size() < directory_path.size()) {
+      auto next_separator = directory_path.find('/', ret[stack.back().index].relative_path.size() + 1);
+      open(directory_path.substr(0, next_separator), i);
+    }
+    auto name = separator == std::string_view::npos ? path : path.substr(separator + 1);
+    uint64_t leaf_digest = get_leaf_digest(i);
+    auto &digest = stack.back().digest;
+    digest = digest_append(digest, name.data(), name.size());
+    digest = digest_append(digest, "", 1);
+    digest = digest_append(digest, &leaf_digest, sizeof(leaf_digest));
+  }
+  while (!stack.empty())
+    close(count);
+  return ret;
+}
+
+class view {
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+  header_t header_{};
+public:
+  view() = default;
+
+  // Returns false if the buffer is not a binary manifest of a supported version, or is truncated
+  bool open(const void *data, size_t size) {
+    data_ = nullptr;
+    size_ = 0;
+    header_ = {};
+    if (data == nullptr || size < kMinHeaderSize)
+      return false;
+    std::memcpy(&header_, data, kMinHeaderSize);
+    if (header_.magic != kMagic || header_.version == 0 || header_.version > kVersion)
+      return false;
+    if (header_.header_size < kMinHeaderSize || header_.header_size > size || header_.entry_size < kMinEntrySize)
+      return false;
+    std::memcpy(&header_, data, std::min<size_t>(header_.header_size, sizeof(header_t)));
+    auto entries_end = static_cast<uint64_t>(header_.header_size)
+        + static_cast<uint64_t>(header_.entries_count) * header_.entry_size;
+    if (entries_end > size || header_.strings_offset < entries_end
+        || header_.strings_offset + header_.strings_size > size)
+      return false;
+    if (header_.directories_count != 0 && (header_.directory_size < sizeof(directory_t)
+        || header_.directories_offset + static_cast<uint64_t>(header_.directories_count) * header_.directory_size
+            > size))
+      return false;
+    if (header_.blocks_count > (size - std::min<uint64_t>(header_.blocks_offset, size)) / sizeof(uint64_t))
+      return false;
+    data_ = reinterpret_cast<const uint8_t *>(data);
+    size_ = size;
+    return true;
+  }
+
+  bool is_open() const { return data_ != nullptr; }
+  size_t size() const { return is_open() ? header_.entries_count : 0; }
+  size_t directories_size() const { return is_open() ? header_.directories_count : 0; }
+
+  // Throws if the record points outside of the string table or the block section, or was hashed with an unknown
+  // algorithm
+  entry_view_t at(size_t index) const {
+    if (index >= size())
+      throw std::out_of_range("Binary manifest entry index is out of range");
+    entry_t entry{};
+    std::memcpy(&entry, data_ + header_.header_size + index * header_.entry_size,
+                std::min<size_t>(header_.entry_size, sizeof(entry_t)));
+    if (static_cast<uint64_t>(entry.path_offset) + entry.path_size > header_.strings_size)
+      throw std::runtime_error("Binary manifest is corrupted: path is out of string table bounds");
+    if (static_cast<uint64_t>(entry.first_block) + entry.blocks_count > header_.blocks_count)
+      throw std::runtime_error("Binary manifest is corrupted: block digests are out of bounds");
+    auto hash_algorithm = (entry.flags & kEntryHashAlgorithmMask) >> kEntryHashAlgorithmShift;
+    if (!is_hash_algorithm_supported(hash_algorithm))
+      throw std::runtime_error("Binary manifest uses unsupported hash algorithm " + std::to_string(hash_algorithm));
+    if (header_.entry_size < sizeof(entry_t)) {
+      entry.hash = entry.fnv_hash;
+      entry.compressed_hash = entry.compressed_fnv_hash;
+    }
+    entry_view_t ret;
+    ret.relative_path = {reinterpret_cast<const char *>(data_ + header_.strings_offset + entry.path_offset),
+                         entry.path_size};
+    ret.size = entry.size;
+    ret.hash = entry.hash;
+    ret.hash_algorithm = static_cast<hash_algorithm_t>(hash_algorithm);
+    if (entry.blocks_count != 0)
+      ret.block_hashes = {data_ + header_.blocks_offset + entry.first_block * sizeof(uint64_t), entry.blocks_count};
+    ret.compressed = (entry.flags & kEntryCompressed) != 0;
+    ret.compressed_size = ret.compressed ? entry.compressed_size : 0;
+    ret.compressed_hash = ret.compressed ? entry.compressed_hash : 0;
+    return ret;
+  }
+
+  directory_view_t directory_at(size_t index) const {
+    if (index >= directories_size())
+      throw std::out_of_range("Binary manifest directory index is out of range");
+    directory_t directory;
+    std::memcpy(&directory, data_ + header_.directories_offset + index * header_.directory_size, sizeof(directory_t));
+    if (static_cast<uint64_t>(directory.path_offset) + directory.path_size > header_.strings_size
+        || static_cast<uint64_t>(directory.first_entry) + directory.entries_count > header_.entries_count)
+      throw std::runtime_error("Binary manifest is corrupted: directory is out of bounds");
+    directory_view_t ret;
+    ret.relative_path = {reinterpret_cast<const char *>(data_ + header_.strings_offset + directory.path_offset),
+                         directory.path_size};
+    ret.digest = directory.digest;
+    ret.first_entry = directory.first_entry;
+    ret.entries_count = directory.entries_count;
+    return ret;
+  }
+};
+
+class writer {
+  std::vector<entry_t> entries;
+  std::string strings;
+  std::vector<uint64_t> blocks;
+public:
+  void add(const entry_view_t &entry) {
+    if (strings.size() + entry.relative_path.size() > UINT32_MAX)
+      throw std::runtime_error("Binary manifest string table overflow");
+    if (blocks.size() + entry.block_hashes.size() > UINT32_MAX)
+      throw std::runtime_error("Binary manifest block section overflow");
+    entry_t record{};
+    record.size = entry.size;
+    record.path_offset = static_cast<uint32_t>(strings.size());
+    record.path_size = static_cast<uint32_t>(entry.relative_path.size());
+    record.hash = entry.hash;
+    record.fnv_hash = static_cast<uint32_t>(entry.hash);
+    record.flags |= static_cast<uint32_t>(entry.hash_algorithm) << kEntryHashAlgorithmShift;
+    if (entry.compressed) {
+      record.flags |= kEntryCompressed;
+      record.compressed_size = entry.compressed_size;
+      record.compressed_hash = entry.compressed_hash;
+      record.compressed_fnv_hash = static_cast<uint32_t>(entry.compressed_hash);
+    }
+    record.first_block = static_cast<uint32_t>(blocks.size());
+    record.blocks_count = static_cast<uint32_t>(entry.block_hashes.size());
+    for (size_t i = 0; i < entry.block_hashes.size(); ++i)
+      blocks.push_back(entry.block_hashes[i]);
+    strings.append(entry.relative_path);
+    entries.push_back(record);
+  }
+
+  // Entries are written sorted by path, whatever order they were added in
+  std::string serialize() const {
+    auto get_path = [&](const entry_t &entry) {
+      return std::string_view(strings).substr(entry.path_offset, entry.path_size);
+    };
+    auto sorted_entries = entries;
+    std::sort(sorted_entries.begin(), sorted_entries.end(), [&](const entry_t &left, const entry_t &right) {
+      return get_path(left) < get_path(right);
+    });
+    auto directories = build_directories(sorted_entries.size(), [&](size_t i) {
+      return get_path(sorted_entries[i]);
+    }, [&](size_t i) {
+      entry_view_t entry;
+      entry.size = sorted_entries[i].size;
+      entry.hash = sorted_entries[i].hash;
+      entry.hash_algorithm = static_cast<hash_algorithm_t>(
+          (sorted_entries[i].flags & kEntryHashAlgorithmMask) >> kEntryHashAlgorithmShift);
+      return get_entry_digest(entry);
+    });
+    std::vector<directory_t> directory_records;
+    directory_records.reserve(directories.size());
+    for (auto &directory : directories) {
+      directory_t record{};
+      record.digest = directory.digest;
+      record.path_offset = directory.relative_path.empty()
+          ? 0 : static_cast<uint32_t>(directory.relative_path.data() - strings.data());
+      record.path_size = static_cast<uint32_t>(directory.relative_path.size());
+      record.first_entry = directory.first_entry;
+      record.entries_count = directory.entries_count;
+      directory_records.push_back(record);
+    }
+
+    header_t header{};
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.header_size = sizeof(header_t);
+    header.entries_count = static_cast<uint32_t>(sorted_entries.size());
+    header.entry_size = sizeof(entry_t);
+    header.strings_offset = sizeof(header_t) + sorted_entries.size() * sizeof(entry_t);
+    header.strings_size = strings.size();
+    header.directories_offset = header.strings_offset + strings.size();
+    header.directories_count = static_cast<uint32_t>(directory_records.size());
+    header.directory_size = sizeof(directory_t);
+    header.blocks_offset = header.directories_offset + directory_records.size() * sizeof(directory_t);
+    header.blocks_count = blocks.size();
+
+    std::string ret;
+    ret.reserve(header.blocks_offset + blocks.size() * sizeof(uint64_t));
+    ret.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    ret.append(reinterpret_cast<const char *>(sorted_entries.data()), sorted_entries.size() * sizeof(entry_t));
+    ret.append(strings);
+    ret.append(reinterpret_cast<const char *>(directory_records.data()), directory_records.size() * sizeof(directory_t));
+    ret.append(reinterpret_cast<const char *>(blocks.data()), blocks.size() * sizeof(uint64_t));
+    return ret;
+  }
+
+  void write(const std::filesystem::path &path) const {
+    auto data = serialize();
+    std::ofstream out_file;
+    out_file.open(path, std::ios::out | std::ios::binary);
+    out_file.write(data.data(), static_cast<std::streamsize>(data.size()));
+    out_file.flush();
+  }
+};
+}
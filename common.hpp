@@ -29,10 +29,31 @@
 #include <thread>
 #include <vector>
 #include <zstd.h>
+#include <zstd_errors.h>
+#include <memory>
+#include <stdexcept>
 #include <sstream>
+#include <string_view>
+#include <iterator>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <future>
+#include <optional>
+#include "content_hash.hpp"
+#include "file_reader.hpp"
+#include "file_stat.hpp"
+#include "read_order.hpp"
+#include "thread_pool.hpp"
 
 namespace common {
 constexpr const char *kResourcesDataFilename = "rm_files_data.json";
+constexpr const char *kCompressedManifestSuffix = ".zst";
+constexpr const char *kManifestDictionaryFilename = "rm_files_data.dict";
+constexpr const char *kManifestVersionFilename = "rm_files_data.version";
+constexpr const char *kManifestShardsFilename = "rm_files_data.shards"; // index of the sharded binary manifest
+constexpr const char *kStateDirectoryName = ".rm_state"; // client-side caches, lives in the tree's base path
 constexpr size_t kMaxFullCheckSize = 5 * 1024 * 1024; // in bytes (default: 5MB)
 constexpr const char *kForcedFullCheckExtensions[] = {
     ".exe",
@@ -46,8 +67,20 @@ constexpr const char *kForcedFullCheckExtensions[] = {
     ".luac"
 };
 constexpr size_t kCheckEveryXBytes = 512 * 1024; // in bytes (default: 5KB)
-constexpr size_t kCheckXBytes = 4;
+constexpr size_t kCheckXBytes = 4; // FNV only, other algorithms sample kSampleWindowSize bytes
 static_assert(kCheckXBytes < kCheckEveryXBytes);
+constexpr size_t kSampleWindowSize = 4096; // a page, which the OS reads anyway however few bytes of it are needed
+static_assert(kCheckEveryXBytes % kSampleWindowSize == 0);
+
+// Delta from manifest version `from_version` to `from_version + 1`, published compressed only
+inline std::string get_manifest_delta_filename(uint64_t from_version) {
+  return "rm_files_data.delta." + std::to_string(from_version) + ".json";
+}
+
+// Binary manifest with a contiguous range of the sorted entries, published compressed only
+inline std::string get_manifest_shard_filename(size_t index) {
+  return "rm_files_data.shard." + std::to_string(index) + ".bin";
+}
 
 inline std::string str_tolower(std::string s) {
   std::transform(s.begin(), s.end(), s.begin(),
@@ -70,6 +103,25 @@ inline std::vector<std::string> str_split(const std::string &s, char delim) {
   return elems;
 }
 
+inline std::string read_file(const std::filesystem::path &path) {
+  std::ifstream file;
+  file.open(path, std::ios::in | std::ios::binary);
+  if (!file.is_open())
+    throw std::runtime_error("Could not open file " + path.string());
+  return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+inline void write_file(const std::filesystem::path &path, std::string_view data) {
+  if (path.has_parent_path() && !exists(path.parent_path()))
+    create_directories(path.parent_path());
+  std::ofstream file;
+  file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+    throw std::runtime_error("Could not open file " + path.string() + " for writing");
+  file.write(data.data(), static_cast<std::streamsize>(data.size()));
+  file.flush();
+}
+
 inline bool is_extension_forced_to_fullcheck(const std::string &extension) {
   auto lower_case_extension = str_tolower(extension);
   for (auto &entry : kForcedFullCheckExtensions) {
@@ -80,45 +132,257 @@ inline bool is_extension_forced_to_fullcheck(const std::string &extension) {
   return false;
 }
 
-inline uint32_t get_fnv_hash(const uint8_t *buffer, size_t buffer_size) {
-  static constexpr uint32_t fnv_prime = 0x811C9DC5;
-  uint32_t hash = 0;
-  for (uint32_t i = 0; i < buffer_size; ++i) {
-    hash *= fnv_prime;
-    hash ^= (buffer[i]);
+// Files up to kMaxFullCheckSize and files with forced extensions are hashed whole, anything bigger is sampled
+inline bool is_full_hash_check(const std::filesystem::path &path, uint64_t file_size) {
+  return file_size <= kMaxFullCheckSize || is_extension_forced_to_fullcheck(path.extension().string());
+}
+
+// FNV samples of kCheckXBytes at every kCheckEveryXBytes, the count is limited exactly like it always was
+inline uint64_t get_file_samples_count(uint64_t file_size) {
+  uint64_t alloc_size = file_size / (kCheckEveryXBytes * (kCheckXBytes + 1));
+  uint64_t ret = 0;
+  for (uint64_t i = 0, pos = 0; pos < file_size; i += kCheckXBytes, pos += kCheckEveryXBytes, ++ret) {
+    if (pos + kCheckXBytes > file_size || (i + kCheckXBytes) >= alloc_size)
+      break;
   }
-  return hash;
+  return ret;
 }
 
-inline uint32_t get_file_hash(const std::filesystem::path &path) {
-  if (!exists(path) || !is_regular_file(path))
-    return 0;
-  auto file_sz = file_size(path);
+// Ranges hashed for a sampled file, as if they were concatenated. FNV keeps its kCheckXBytes samples, so published
+// hashes stay the same. Other algorithms hash the page at every kCheckEveryXBytes and the last page of the file.
+inline std::vector<file_range_t> get_file_sample_windows(hash_algorithm_t algorithm, uint64_t file_size) {
+  std::vector<file_range_t> ret;
+  if (algorithm == hash_algorithm_t::kFnv) {
+    auto samples_count = get_file_samples_count(file_size);
+    ret.reserve(static_cast<size_t>(samples_count));
+    for (uint64_t i = 0; i < samples_count; ++i) {
+      ret.push_back({i * kCheckEveryXBytes, kCheckXBytes});
+    }
+    return ret;
+  }
+  ret.reserve(static_cast<size_t>(file_size / kCheckEveryXBytes + 2));
+  for (uint64_t offset = 0; offset < file_size; offset += kCheckEveryXBytes) {
+    ret.push_back({offset, std::min<uint64_t>(kSampleWindowSize, file_size - offset)});
+  }
+  auto last_page = file_size == 0 ? 0 : (file_size - 1) / kSampleWindowSize * kSampleWindowSize;
+  if (last_page % kCheckEveryXBytes != 0)
+    ret.push_back({last_page, file_size - last_page});
+  return ret;
+}
+
+// Called with every block digest as soon as it is known, from whatever thread hashed the block.
+// Returning false stops hashing the blocks that are left.
+using block_hash_callback_t = std::function<bool(size_t index, uint64_t block_hash)>;
+
+// kXxh3Blocks block digests of a whole file. Runs on `pool` when there is one and the file has more blocks than
+// one task hashes, every task covering one reader window. Returns nullopt if `on_block` stopped it. Throws if the
+// file can't be read or is shorter than `file_size`.
+inline std::optional<std::vector<uint64_t>> get_file_block_hashes(const std::filesystem::path &path,
+                                                                  uint64_t file_size,
+                                                                  thread_pool *pool = nullptr,
+                                                                  const block_hash_callback_t &on_block = {}) {
+  constexpr size_t kBlocksPerTask = kMappedReaderWindowSize / kHashBlockSize;
+  static_assert(kBlocksPerTask != 0 && kMappedReaderWindowSize % kHashBlockSize == 0);
+  auto blocks_count = static_cast<size_t>((file_size + kHashBlockSize - 1) / kHashBlockSize);
+  std::vector<uint64_t> ret(blocks_count);
+  std::atomic_bool stopped = false;
+  auto hash_blocks = [&](size_t first_block, size_t end_block) {
+    auto reader = open_file_reader(path, file_size, first_block * kHashBlockSize);
+    XXH3_state_t state;
+    for (auto i = first_block; i < end_block && !stopped; ++i) {
+      auto offset = static_cast<uint64_t>(i) * kHashBlockSize;
+      auto size = std::min<uint64_t>(kHashBlockSize, file_size - offset);
+      XXH3_64bits_reset(&state);
+      auto bytes_read = reader->read(offset, size, [&](const uint8_t *data, size_t data_size) {
+        XXH3_64bits_update_dispatch(&state, data, data_size);
+      });
+      if (bytes_read != size)
+        throw std::runtime_error("File " + path.string() + " is shorter than expected");
+      ret[i] = XXH3_64bits_digest(&state);
+      if (on_block && !on_block(i, ret[i]))
+        stopped = true;
+    }
+  };
+
+  if (pool == nullptr || blocks_count <= kBlocksPerTask) {
+    hash_blocks(0, blocks_count);
+  } else {
+    std::vector<std::future<void>> tasks;
+    for (size_t first_block = 0; first_block < blocks_count; first_block += kBlocksPerTask) {
+      tasks.push_back(pool->submit([&hash_blocks, first_block, blocks_count]() {
+        hash_blocks(first_block, std::min(first_block + kBlocksPerTask, blocks_count));
+      }));
+    }
+    // tasks reference this frame, so all of them have to finish before the first error is rethrown
+    std::exception_ptr error;
+    for (auto &task : tasks) {
+      try {
+        pool->wait(task);
+      } catch (...) {
+        if (!error)
+          error = std::current_exception();
+        stopped = true;
+      }
+    }
+    if (error)
+      std::rethrow_exception(error);
+  }
+  if (stopped)
+    return std::nullopt;
+  return ret;
+}
+
+// Memory use doesn't depend on the file size, see file_reader.hpp. Whole kXxh3Blocks files are hashed on `pool`
+// if there is one. `file_sz` has to be the current size of the file, e.g. from a file_stat_t. Throws if the file
+// can't be read.
+inline uint64_t get_file_hash(const std::filesystem::path &path, uint64_t file_sz, hash_algorithm_t algorithm,
+                              thread_pool *pool = nullptr) {
   if (file_sz == 0)
     return 0;
-  std::unique_ptr<char[]> buffer{nullptr};
-  size_t buffer_size_to_hash = 0;
-  std::ifstream file_stream;
-  file_stream.open(path, std::ios::in | std::ios::binary);
-  if (file_sz <= kMaxFullCheckSize || is_extension_forced_to_fullcheck(path.extension().string())) {
-    buffer.reset(new char[file_sz + 1]);
-    buffer_size_to_hash = file_sz;
-    file_stream.read(buffer.get(), file_sz);
+  content_hasher hasher(algorithm);
+  auto consume = [&](const uint8_t *data, size_t size) {
+    hasher.update(data, size);
+  };
+  if (algorithm == hash_algorithm_t::kXxh3Blocks && is_full_hash_check(path, file_sz)) {
+    auto block_hashes = get_file_block_hashes(path, file_sz, pool);
+    return combine_block_hashes(block_hashes->data(), block_hashes->size());
+  } else if (is_full_hash_check(path, file_sz)) {
+    open_file_reader(path, file_sz)->read(0, file_sz, consume);
   } else {
-    size_t alloc_size = file_sz / (kCheckEveryXBytes * (kCheckXBytes + 1));
-    buffer.reset(new char[alloc_size]);
-    for (auto i = 0, pos = 0; pos < file_sz; i += kCheckXBytes) {
-      if (pos + kCheckXBytes > file_sz || (i + kCheckXBytes) >= alloc_size)
-        break;
-      file_stream.seekg(pos);
-      file_stream.read(buffer.get() + i, kCheckXBytes);
-      pos += kCheckEveryXBytes;
-      buffer_size_to_hash = i + kCheckXBytes;
+    // every window is requested up front, so the OS can serve them in whatever order suits the disk
+    auto windows = get_file_sample_windows(algorithm, file_sz);
+    positional_file_reader reader(path);
+    reader.prefetch(windows);
+    for (auto &window : windows) {
+      reader.read(window.offset, window.size, consume);
     }
   }
-  return get_fnv_hash(reinterpret_cast<uint8_t *>(buffer.get()), buffer_size_to_hash);
+  return hasher.digest();
 }
 
+inline uint64_t get_file_hash(const std::filesystem::path &path, hash_algorithm_t algorithm,
+                              thread_pool *pool = nullptr) {
+  auto stat = get_file_stat(path);
+  if (!stat.has_value())
+    return 0;
+  return get_file_hash(path, stat->size, algorithm, pool);
+}
+
+// Sequential twin of get_file_hash for data that is never read back, e.g. a download: fed the whole content of a
+// `file_size` bytes file in order, in pieces of any size, it gives the hash get_file_hash would give for that file
+class file_hasher {
+  content_hasher hasher;
+  uint64_t file_size;
+  uint64_t hashed_end; // everything before it is hashed whole
+  std::vector<file_range_t> windows; // sampled files only
+  size_t next_window = 0; // first window that hasn't been fed completely
+  uint64_t position = 0;
+public:
+  file_hasher(hash_algorithm_t algorithm, const std::filesystem::path &path, uint64_t file_size)
+      : hasher(algorithm), file_size(file_size) {
+    if (is_full_hash_check(path, file_size)) {
+      hashed_end = file_size;
+    } else {
+      hashed_end = 0;
+      windows = get_file_sample_windows(algorithm, file_size);
+    }
+  }
+
+  void update(const void *data, size_t size) {
+    auto bytes = reinterpret_cast<const uint8_t *>(data);
+    auto begin = position;
+    position += size;
+    if (begin < hashed_end)
+      hasher.update(bytes, static_cast<size_t>(std::min<uint64_t>(position, hashed_end) - begin));
+    // windows overlapping [begin, position)
+    for (; next_window < windows.size(); ++next_window) {
+      auto &window = windows[next_window];
+      if (window.offset >= position)
+        break;
+      auto from = std::max(window.offset, begin);
+      auto to = std::min(window.offset + window.size, position);
+      if (from < to)
+        hasher.update(bytes + (from - begin), static_cast<size_t>(to - from));
+      if (window.offset + window.size > position)
+        break; // the rest of it comes with the next piece
+    }
+  }
+
+  uint64_t size() const { return position; }
+
+  // Meaningful only when exactly file_size bytes were fed
+  uint64_t digest() const {
+    return file_size == 0 ? 0 : hasher.digest();
+  }
+};
+
+// Thrown when a frame was compressed with a dictionary the decompressor doesn't have
+class zstd_dictionary_error : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// Push-style ZSTD decompressor: compressed bytes go in, decompressed chunks are passed to a callback
+class stream_decompressor {
+  ZSTD_DCtx *dctx = nullptr;
+  size_t buff_out_size = ZSTD_DStreamOutSize();
+  std::unique_ptr<char[]> buff_out = std::make_unique<char[]>(buff_out_size);
+  size_t last_ret = 0;
+public:
+  stream_decompressor() {
+    dctx = ZSTD_createDCtx();
+    if (dctx == nullptr)
+      throw std::runtime_error("Could not allocate decompressor context for ZSTD decompressor");
+  }
+
+  stream_decompressor(const stream_decompressor &) = delete;
+  stream_decompressor &operator=(const stream_decompressor &) = delete;
+
+  ~stream_decompressor() {
+    ZSTD_freeDCtx(dctx);
+  }
+
+  // Dictionary stays loaded across reset() calls
+  void load_dictionary(const void *dictionary, size_t dictionary_size) {
+    auto ret = ZSTD_DCtx_loadDictionary(dctx, dictionary, dictionary_size);
+    if (ZSTD_isError(ret)) {
+      std::string error_str = "Could not load ZSTD dictionary: ";
+      error_str += ZSTD_getErrorName(ret);
+      throw std::runtime_error(error_str);
+    }
+  }
+
+  void reset() {
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    last_ret = 0;
+  }
+
+  template <typename Fn>
+  void decompress(const void *data, size_t size, Fn &&on_output) {
+    ZSTD_inBuffer input{data, size, 0};
+    while (input.pos < input.size) {
+      ZSTD_outBuffer output{buff_out.get(), buff_out_size, 0};
+      auto ret = ZSTD_decompressStream(dctx, &output, &input);
+      if (ZSTD_isError(ret)) {
+        std::string error_str = "Unknown ZSTD error while decompressing: ";
+        error_str += ZSTD_getErrorName(ret);
+        if (ZSTD_getErrorCode(ret) == ZSTD_error_dictionary_wrong)
+          throw zstd_dictionary_error(error_str);
+        throw std::runtime_error(error_str);
+      }
+      last_ret = ret;
+      if (output.pos > 0)
+        on_output(buff_out.get(), output.pos);
+    }
+  }
+
+  // Throws if the input ended in the middle of a frame
+  void finish() const {
+    if (last_ret != 0)
+      throw std::runtime_error("ZSTD decompressor error: input is truncated");
+  }
+};
+
 inline bool decompress_file(const std::filesystem::path &in_filepath, const std::filesystem::path &out_filepath) {
   if (!exists(in_filepath) || !is_regular_file(in_filepath))
     throw std::runtime_error("Could not locate input path in decompressor");
@@ -127,13 +391,8 @@ inline bool decompress_file(const std::filesystem::path &in_filepath, const std:
     create_directories(out_filepath.parent_path());
 
   auto buff_in_size = ZSTD_DStreamInSize();
-  auto buff_out_size = ZSTD_DStreamOutSize();
   auto buff_in = std::make_unique<char[]>(buff_in_size);
-  auto buff_out = std::make_unique<char[]>(buff_out_size);
-  auto dctx = ZSTD_createDCtx();
-
-  if (dctx == nullptr)
-    throw std::runtime_error("Could not allocate decompressor context for ZSTD decompressor");
+  stream_decompressor decompressor;
 
   std::ifstream in_file;
   in_file.open(in_filepath, std::ios::in | std::ios::binary);
@@ -147,24 +406,18 @@ inline bool decompress_file(const std::filesystem::path &in_filepath, const std:
     if (bytes_read <= 0)
       break;
 
-    ZSTD_inBuffer input{buff_in.get(), static_cast<size_t>(bytes_read), 0};
-    while (input.pos < input.size) {
-      ZSTD_outBuffer output{buff_out.get(), buff_out_size, 0};
-      auto ret = ZSTD_decompressStream(dctx, &output, &input);
-      if (ZSTD_isError(ret)) {
-        std::string error_str = "Unknown ZSTD error while decompressing: ";
-        error_str += ZSTD_getErrorName(ret);
-        throw std::runtime_error(error_str);
-      }
-      out_file.write(buff_out.get(), output.pos);
-    }
+    decompressor.decompress(buff_in.get(), static_cast<size_t>(bytes_read), [&](const char *data, size_t size) {
+      out_file.write(data, size);
+    });
   }
   out_file.flush();
-  ZSTD_freeDCtx(dctx);
   return true;
 }
 
-inline bool compress_file(const std::filesystem::path &in_filepath, const std::filesystem::path &out_filepath, const int level) {
+inline bool compress_file(const std::filesystem::path &in_filepath,
+                          const std::filesystem::path &out_filepath,
+                          const int level,
+                          const std::string *dictionary = nullptr) {
   if (!exists(in_filepath) || !is_regular_file(in_filepath))
     throw std::runtime_error("Could not locate input path in compressor");
 
@@ -187,6 +440,14 @@ inline bool compress_file(const std::filesystem::path &in_filepath, const std::f
 
   ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
   ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+  if (dictionary != nullptr) {
+    auto ret = ZSTD_CCtx_loadDictionary(cctx, dictionary->data(), dictionary->size());
+    if (ZSTD_isError(ret)) {
+      std::string error_str = "Could not load ZSTD dictionary: ";
+      error_str += ZSTD_getErrorName(ret);
+      throw std::runtime_error(error_str);
+    }
+  }
   if (auto threads_count = std::thread::hardware_concurrency(); threads_count > 2) {
     threads_count /= 2;
     ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, threads_count);
@@ -0,0 +1,169 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <string_view>
+#include <xxh_dispatch.h>
+
+// Content hashes of manifest entries. Every entry carries the id of the algorithm its hashes were made with, so
+// manifests of older preparers, which only knew FNV and store no id, keep working.
+// kXxh3Blocks splits data into kHashBlockSize blocks starting at offset 0; the last one may be shorter and empty
+// data has no blocks at all.
+namespace common {
+enum class hash_algorithm_t : uint8_t {
+  kFnv = 0, // 32-bit, byte at a time
+  kXxh3 = 1, // 64-bit XXH3, vectorized for the running CPU
+  kXxh3Blocks = 2, // XXH3 of the XXH3 digests of every kHashBlockSize block, so blocks can be hashed concurrently
+  kMaxAlgorithm
+};
+
+constexpr size_t kHashBlockSize = 4 * 1024 * 1024;
+
+// Clients built before the algorithm id read every hash as FNV, so anything else has to be asked for
+constexpr hash_algorithm_t kDefaultHashAlgorithm = hash_algorithm_t::kFnv;
+
+inline bool is_hash_algorithm_supported(uint64_t id) {
+  return id < static_cast<uint64_t>(hash_algorithm_t::kMaxAlgorithm);
+}
+
+inline const char *get_hash_algorithm_name(hash_algorithm_t algorithm) {
+  switch (algorithm) {
+  case hash_algorithm_t::kFnv: return "fnv";
+  case hash_algorithm_t::kXxh3: return "xxh3";
+  case hash_algorithm_t::kXxh3Blocks: return "xxh3-blocks";
+  default: return "unknown";
+  }
+}
+
+inline std::optional<hash_algorithm_t> parse_hash_algorithm(std::string_view name) {
+  for (uint8_t i = 0; i < static_cast<uint8_t>(hash_algorithm_t::kMaxAlgorithm); ++i) {
+    if (name == get_hash_algorithm_name(static_cast<hash_algorithm_t>(i)))
+      return static_cast<hash_algorithm_t>(i);
+  }
+  return std::nullopt;
+}
+
+// `hash` continues a previous call, so the buffer may be hashed in chunks
+inline uint32_t get_fnv_hash(const uint8_t *buffer, size_t buffer_size, uint32_t hash = 0) {
+  static constexpr uint32_t fnv_prime = 0x811C9DC5;
+  for (size_t i = 0; i < buffer_size; ++i) {
+    hash *= fnv_prime;
+    hash ^= (buffer[i]);
+  }
+  return hash;
+}
+
+// Block digests are combined as their little-endian bytes
+inline void append_block_hash(XXH3_state_t &state, uint64_t block_hash) {
+  uint8_t bytes[sizeof(block_hash)];
+  for (size_t i = 0; i < sizeof(block_hash); ++i)
+    bytes[i] = static_cast<uint8_t>(block_hash >> (i * 8));
+  XXH3_64bits_update_dispatch(&state, bytes, sizeof(bytes));
+}
+
+// kXxh3Blocks digest of data whose blocks are already hashed
+inline uint64_t combine_block_hashes(const uint64_t *block_hashes, size_t count) {
+  XXH3_state_t state;
+  XXH3_64bits_reset(&state);
+  for (size_t i = 0; i < count; ++i)
+    append_block_hash(state, block_hashes[i]);
+  return XXH3_64bits_digest(&state);
+}
+
+inline uint64_t get_hash(hash_algorithm_t algorithm, const void *data, size_t size) {
+  if (algorithm == hash_algorithm_t::kXxh3)
+    return XXH3_64bits_dispatch(data, size);
+  if (algorithm == hash_algorithm_t::kXxh3Blocks) {
+    auto bytes = reinterpret_cast<const uint8_t *>(data);
+    XXH3_state_t state;
+    XXH3_64bits_reset(&state);
+    for (size_t offset = 0; offset < size; offset += kHashBlockSize)
+      append_block_hash(state, XXH3_64bits_dispatch(bytes + offset, std::min(kHashBlockSize, size - offset)));
+    return XXH3_64bits_digest(&state);
+  }
+  return get_fnv_hash(reinterpret_cast<const uint8_t *>(data), size);
+}
+
+// Incremental twin of get_hash: feeding data in any number of chunks gives the same result as hashing it at once
+class content_hasher {
+  hash_algorithm_t algorithm_;
+  uint32_t fnv_hash_ = 0;
+  XXH3_state_t xxh3_state_; // the current block for kXxh3Blocks
+  XXH3_state_t blocks_state_; // digests of the finished blocks
+  size_t block_filled_ = 0;
+public:
+  explicit content_hasher(hash_algorithm_t algorithm = kDefaultHashAlgorithm) : algorithm_(algorithm) {
+    reset();
+  }
+
+  hash_algorithm_t algorithm() const { return algorithm_; }
+
+  void reset() {
+    fnv_hash_ = 0;
+    block_filled_ = 0;
+    if (algorithm_ != hash_algorithm_t::kFnv)
+      XXH3_64bits_reset(&xxh3_state_);
+    if (algorithm_ == hash_algorithm_t::kXxh3Blocks)
+      XXH3_64bits_reset(&blocks_state_);
+  }
+
+  void update(const void *data, size_t size) {
+    if (algorithm_ == hash_algorithm_t::kXxh3) {
+      XXH3_64bits_update_dispatch(&xxh3_state_, data, size);
+    } else if (algorithm_ == hash_algorithm_t::kXxh3Blocks) {
+      auto bytes = reinterpret_cast<const uint8_t *>(data);
+      while (size != 0) {
+        auto chunk_size = std::min(size, kHashBlockSize - block_filled_);
+        XXH3_64bits_update_dispatch(&xxh3_state_, bytes, chunk_size);
+        bytes += chunk_size;
+        size -= chunk_size;
+        block_filled_ += chunk_size;
+        if (block_filled_ == kHashBlockSize) {
+          append_block_hash(blocks_state_, XXH3_64bits_digest(&xxh3_state_));
+          XXH3_64bits_reset(&xxh3_state_);
+          block_filled_ = 0;
+        }
+      }
+    } else {
+      fnv_hash_ = get_fnv_hash(reinterpret_cast<const uint8_t *>(data), size, fnv_hash_);
+    }
+  }
+
+  uint64_t digest() const {
+    if (algorithm_ == hash_algorithm_t::kXxh3)
+      return XXH3_64bits_digest(&xxh3_state_);
+    if (algorithm_ == hash_algorithm_t::kXxh3Blocks) {
+      if (block_filled_ == 0)
+        return XXH3_64bits_digest(&blocks_state_);
+      auto state = blocks_state_;
+      append_block_hash(state, XXH3_64bits_digest(&xxh3_state_));
+      return XXH3_64bits_digest(&state);
+    }
+    return fnv_hash_;
+  }
+};
+}
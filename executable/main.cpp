@@ -1,13 +1,23 @@
 #include <iostream>
 #include <filesystem>
+#include <optional>
+#include <unordered_map>
+#include <zdict.h>
 
 #include <json.hpp>
 #include <common.hpp>
+#include <binary_manifest.hpp>
 
 constexpr size_t kMaxUncompressedFilesize = 16 * 1024 * 1024;
 constexpr int kCompressionLevel = 3;
+constexpr int kManifestCompressionLevel = 19;
+constexpr size_t kMaxManifestDictionarySize = 112640; // ZDICT default
+constexpr uint64_t kMaxPublishedDeltasCount = 16; // clients further behind download the whole manifest
 
+auto hash_algorithm = common::kDefaultHashAlgorithm;
+common::thread_pool hash_pool; // blocks of large files are hashed concurrently
 auto json_container = nlohmann::json::array();
+common::binary_manifest::writer binary_container;
 
 std::filesystem::path in_path(const std::filesystem::path &relative_path) {
   return "./in" / relative_path;
@@ -17,6 +27,14 @@ std::filesystem::path out_path(const std::filesystem::path &relative_path) {
   return "./out" / relative_path;
 }
 
+// Files hashed whole that span several blocks get block digests with xxh3, so clients can hash them on all cores
+common::hash_algorithm_t get_file_hash_algorithm(const std::filesystem::path &path, uint64_t size) {
+  if (hash_algorithm == common::hash_algorithm_t::kXxh3 && size > common::kHashBlockSize
+      && common::is_full_hash_check(path, size))
+    return common::hash_algorithm_t::kXxh3Blocks;
+  return hash_algorithm;
+}
+
 void process_file(const std::filesystem::path &relative_path) {
   std::cout << "Processing a file: " << relative_path << std::endl;
   auto in_path_ = in_path(relative_path);
@@ -33,13 +51,35 @@ void process_file(const std::filesystem::path &relative_path) {
   }
   auto obj = nlohmann::json::object();
   obj["p"] = relative_path.string();
-  obj["s"] = static_cast<uint64_t>(file_size(in_path_));
-  obj["h"] = common::get_file_hash(in_path_);
+  uint64_t size = file_size(in_path_);
+  auto algorithm = get_file_hash_algorithm(in_path_, size);
+  std::vector<uint64_t> block_hashes;
+  obj["s"] = size;
+  if (algorithm == common::hash_algorithm_t::kXxh3Blocks && common::is_full_hash_check(in_path_, size)) {
+    block_hashes = *common::get_file_block_hashes(in_path_, size, &hash_pool);
+    obj["h"] = size == 0 ? 0 : common::combine_block_hashes(block_hashes.data(), block_hashes.size());
+    obj["b"] = block_hashes;
+  } else {
+    obj["h"] = common::get_file_hash(in_path_, algorithm);
+  }
+  if (algorithm != common::hash_algorithm_t::kFnv)
+    obj["a"] = static_cast<uint64_t>(algorithm);
   obj["c"] = compress;
   if (compress) {
     obj["cs"] = static_cast<uint64_t>(file_size(out_path_));
-    obj["ch"] = common::get_file_hash(out_path_);
+    obj["ch"] = common::get_file_hash(out_path_, algorithm, &hash_pool);
   }
+  auto generic_path = relative_path.generic_string();
+  common::binary_manifest::entry_view_t record;
+  record.relative_path = generic_path;
+  record.size = obj["s"];
+  record.hash = obj["h"];
+  record.hash_algorithm = algorithm;
+  record.block_hashes = {block_hashes.data(), block_hashes.size()};
+  record.compressed = compress;
+  record.compressed_size = compress ? static_cast<uint64_t>(obj["cs"]) : 0;
+  record.compressed_hash = compress ? static_cast<uint64_t>(obj["ch"]) : 0;
+  binary_container.add(record);
   json_container += obj;
 }
 
@@ -57,7 +97,202 @@ void process_directory(const std::filesystem::path &relative_path) {
   }
 }
 
-int main() {
+std::string train_manifest_dictionary() {
+  std::string samples;
+  std::vector<size_t> samples_sizes;
+  for (auto &entry : json_container) {
+    auto sample = entry.dump();
+    samples += sample;
+    samples_sizes.push_back(sample.size());
+  }
+  std::string dictionary(kMaxManifestDictionarySize, '\0');
+  auto ret = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(), samples.data(), samples_sizes.data(),
+                                   static_cast<unsigned>(samples_sizes.size()));
+  if (ZDICT_isError(ret))
+    throw std::runtime_error(std::string("Could not train manifest dictionary: ") + ZDICT_getErrorName(ret));
+  dictionary.resize(ret);
+  return dictionary;
+}
+
+void write_compressed_manifest(const std::filesystem::path &manifest_path, const std::string *dictionary) {
+  auto compressed_path = manifest_path;
+  compressed_path += common::kCompressedManifestSuffix;
+  common::compress_file(manifest_path, compressed_path, kManifestCompressionLevel, dictionary);
+  std::cout << "Compressed manifest " << manifest_path << ": " << file_size(manifest_path) << " -> "
+            << file_size(compressed_path) << " bytes" << std::endl;
+}
+
+// Splits the sorted binary manifest into contiguous path ranges, so clients can fetch and parse them in parallel
+void write_manifest_shards(size_t shards_count, const std::string *dictionary) {
+  auto data = binary_container.serialize();
+  common::binary_manifest::view manifest;
+  if (!manifest.open(data.data(), data.size()))
+    throw std::runtime_error("Could not read back binary manifest");
+  shards_count = std::max<size_t>(1, std::min(shards_count, manifest.size()));
+  auto index = nlohmann::json::object();
+  auto &shards = index["shards"] = nlohmann::json::array();
+  for (size_t i = 0; i < shards_count; ++i) {
+    auto first = manifest.size() * i / shards_count;
+    auto end = manifest.size() * (i + 1) / shards_count;
+    common::binary_manifest::writer shard;
+    for (auto j = first; j < end; ++j) {
+      shard.add(manifest.at(j));
+    }
+    auto shard_path = out_path(common::get_manifest_shard_filename(i));
+    auto compressed_path = shard_path;
+    compressed_path += common::kCompressedManifestSuffix;
+    shard.write(shard_path);
+    common::compress_file(shard_path, compressed_path, kManifestCompressionLevel, dictionary);
+    remove(shard_path);
+
+    auto shard_json = nlohmann::json::object();
+    shard_json["path"] = compressed_path.filename().string();
+    shard_json["entries"] = end - first;
+    shard_json["size"] = static_cast<uint64_t>(file_size(compressed_path));
+    shards += shard_json;
+  }
+  common::write_file(out_path(common::kManifestShardsFilename), index.dump());
+  std::cout << "Split manifest into " << shards_count << " shards" << std::endl;
+}
+
+std::filesystem::path get_history_manifest_path(const std::filesystem::path &history_path, uint64_t version) {
+  return history_path / ("rm_files_data." + std::to_string(version) + ".bin");
+}
+
+uint64_t find_latest_version(const std::filesystem::path &history_path) {
+  uint64_t ret = 0;
+  if (!is_directory(history_path))
+    return ret;
+  for (auto &this_path : std::filesystem::directory_iterator{history_path}) {
+    auto parts = common::str_split(this_path.path().filename().string(), '.');
+    if (parts.size() == 3 && parts[0] == "rm_files_data" && parts[2] == "bin")
+      ret = std::max<uint64_t>(ret, std::stoull(parts[1]));
+  }
+  return ret;
+}
+
+bool is_same_entry(const common::binary_manifest::entry_view_t &entry, const nlohmann::json &obj) {
+  bool compressed = obj["c"];
+  auto algorithm = static_cast<common::hash_algorithm_t>(obj.value<uint64_t>("a", 0));
+  return entry.size == obj["s"] && entry.hash_algorithm == algorithm && entry.hash == obj["h"]
+      && entry.compressed == compressed
+      && (!compressed || (entry.compressed_size == obj["cs"] && entry.compressed_hash == obj["ch"]));
+}
+
+nlohmann::json make_delta(const common::binary_manifest::view &previous) {
+  std::unordered_map<std::string_view, common::binary_manifest::entry_view_t> previous_entries;
+  for (size_t i = 0; i < previous.size(); ++i) {
+    auto entry = previous.at(i);
+    previous_entries[entry.relative_path] = entry;
+  }
+  auto delta = nlohmann::json::object();
+  delta["added"] = nlohmann::json::array();
+  delta["changed"] = nlohmann::json::array();
+  delta["removed"] = nlohmann::json::array();
+  for (auto &obj : json_container) {
+    auto path = std::filesystem::path(obj["p"].get<std::string>()).generic_string();
+    auto previous_entry = previous_entries.find(path);
+    if (previous_entry == previous_entries.end()) {
+      delta["added"] += obj;
+      continue;
+    }
+    if (!is_same_entry(previous_entry->second, obj))
+      delta["changed"] += obj;
+    previous_entries.erase(previous_entry);
+  }
+  for (auto &entry : previous_entries) {
+    delta["removed"] += std::string(entry.first);
+  }
+  return delta;
+}
+
+// Keeps the latest published manifest in the history directory, bumps the version when it differs from the
+// current one and publishes the version file along with the last kMaxPublishedDeltasCount deltas
+void publish_version(const std::filesystem::path &history_path, const std::string *dictionary) {
+  create_directories(history_path);
+  auto latest_version = find_latest_version(history_path);
+  auto version = latest_version + 1;
+  if (latest_version != 0) {
+    auto previous_data = common::read_file(get_history_manifest_path(history_path, latest_version));
+    common::binary_manifest::view previous;
+    if (!previous.open(previous_data.data(), previous_data.size()))
+      throw std::runtime_error("Manifest of version " + std::to_string(latest_version) + " is corrupted");
+    auto delta = make_delta(previous);
+    if (delta["added"].empty() && delta["changed"].empty() && delta["removed"].empty()) {
+      version = latest_version;
+      std::cout << "Nothing has changed since version " << latest_version << std::endl;
+    } else {
+      delta["from"] = latest_version;
+      delta["to"] = version;
+      std::cout << "Delta " << latest_version << " -> " << version << ": " << delta["added"].size() << " added, "
+                << delta["changed"].size() << " changed, " << delta["removed"].size() << " removed" << std::endl;
+      common::write_file(history_path / common::get_manifest_delta_filename(latest_version), delta.dump());
+    }
+  }
+  if (version != latest_version) {
+    binary_container.write(get_history_manifest_path(history_path, version));
+    if (latest_version != 0)
+      remove(get_history_manifest_path(history_path, latest_version));
+  }
+
+  auto version_json = nlohmann::json::object();
+  version_json["version"] = version;
+  common::write_file(out_path(common::kManifestVersionFilename), version_json.dump());
+  for (auto from = version > kMaxPublishedDeltasCount ? version - kMaxPublishedDeltasCount : 1; from < version;
+       ++from) {
+    auto delta_path = history_path / common::get_manifest_delta_filename(from);
+    if (!is_regular_file(delta_path))
+      continue;
+    auto published_path = out_path(common::get_manifest_delta_filename(from));
+    published_path += common::kCompressedManifestSuffix;
+    common::compress_file(delta_path, published_path, kManifestCompressionLevel, dictionary);
+  }
+  if (version > kMaxPublishedDeltasCount)
+    remove(history_path / common::get_manifest_delta_filename(version - kMaxPublishedDeltasCount - 1));
+  std::cout << "Published manifest version " << version << std::endl;
+}
+
+// Arguments:
+//   --manifest-dictionary <path>        compress manifests with an existing ZSTD dictionary
+//   --train-manifest-dictionary <path>  train a dictionary over manifest records, save it to <path> and use it
+//   --history <path>                    directory with previously published manifest and deltas (default: ./history)
+//   --manifest-shards <count>           also publish the binary manifest split into <count> shards
+//   --hash <fnv|xxh3|xxh3-blocks>       content hash algorithm (default: fnv, which every client reads). With xxh3
+//                                       large fully hashed files get xxh3-blocks. Clients built before xxh3
+//                                       support take such manifests for corrupt files, so switch only once
+//                                       they are all updated
+// Keep the same dictionary between releases: clients cache it and download it again only when its id changes.
+int main(int argc, char *argv[]) {
+  std::optional<std::filesystem::path> dictionary_path;
+  std::filesystem::path history_path = "./history";
+  size_t shards_count = 0;
+  auto train_dictionary = false;
+  for (auto i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if ((arg == "--manifest-dictionary" || arg == "--train-manifest-dictionary") && i + 1 < argc) {
+      dictionary_path = argv[++i];
+      train_dictionary = arg == "--train-manifest-dictionary";
+    } else if (arg == "--history" && i + 1 < argc) {
+      history_path = argv[++i];
+    } else if (arg == "--manifest-shards" && i + 1 < argc) {
+      shards_count = std::stoull(argv[++i]);
+    } else if (arg == "--hash" && i + 1 < argc) {
+      auto algorithm = common::parse_hash_algorithm(argv[++i]);
+      if (!algorithm.has_value()) {
+        std::cout << "Unknown hash algorithm: " << argv[i] << std::endl;
+        return 1;
+      }
+      hash_algorithm = *algorithm;
+    } else {
+      std::cout << "Unknown argument: " << arg << std::endl;
+      return 1;
+    }
+  }
+  if (dictionary_path.has_value() && !train_dictionary && !is_regular_file(*dictionary_path)) {
+    std::cout << "Could not locate manifest dictionary " << *dictionary_path << std::endl;
+    return 1;
+  }
+
   auto in_path_ = in_path(".");
   auto out_path_ = out_path(".");
   if (!is_directory(in_path_)) {
@@ -70,4 +305,26 @@ int main() {
   std::ofstream outfile;
   outfile.open(out_path(common::kResourcesDataFilename));
   outfile << json_container;
+  outfile.close();
+  binary_container.write(out_path(common::binary_manifest::kFilename));
+
+  std::optional<std::string> dictionary;
+  if (dictionary_path.has_value()) {
+    if (train_dictionary) {
+      std::cout << "Training manifest dictionary..." << std::endl;
+      dictionary = train_manifest_dictionary();
+      common::write_file(*dictionary_path, *dictionary);
+    } else {
+      dictionary = common::read_file(*dictionary_path);
+    }
+    std::cout << "Using manifest dictionary with id " << ZDICT_getDictID(dictionary->data(), dictionary->size())
+              << std::endl;
+    copy(*dictionary_path, out_path(common::kManifestDictionaryFilename));
+  }
+  auto dictionary_ptr = dictionary.has_value() ? &dictionary.value() : nullptr;
+  write_compressed_manifest(out_path(common::kResourcesDataFilename), dictionary_ptr);
+  write_compressed_manifest(out_path(common::binary_manifest::kFilename), dictionary_ptr);
+  if (shards_count > 1)
+    write_manifest_shards(shards_count, dictionary_ptr);
+  publish_version(history_path, dictionary_ptr);
 }
@@ -0,0 +1,276 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <system_error>
+#include <vector>
+#include "mapped_file.hpp"
+
+// Readers that hand a file range to a consumer piece by piece, holding at most a fixed amount of it in memory
+// whatever the file size is. open_file_reader picks the backend by file size.
+namespace common {
+constexpr size_t kStreamReaderBufferSize = 256 * 1024; // files up to this size are read in one go
+constexpr size_t kMappedReaderWindowSize = 16 * 1024 * 1024; // multiple of every page/allocation granularity
+
+#if !WIN32
+// off_t is 32 bits on 32-bit Android, and wherever _FILE_OFFSET_BITS isn't 64. Linux and Android have 64-bit variants
+// of the calls, elsewhere offsets that don't fit are refused, as mapped_file does
+#if defined(__linux__)
+using file_offset_t = off64_t;
+#else
+using file_offset_t = off_t;
+#endif
+
+inline bool to_file_offset(uint64_t value, file_offset_t &offset) {
+  if (value > static_cast<uint64_t>(std::numeric_limits<file_offset_t>::max()))
+    return false;
+  offset = static_cast<file_offset_t>(value);
+  return true;
+}
+
+// pread at a 64-bit offset, fails with EOVERFLOW where the platform can't take it
+inline ssize_t read_file_at(int fd, void *buffer, size_t size, uint64_t offset) {
+  file_offset_t file_offset = 0;
+  if (!to_file_offset(offset, file_offset)) {
+    errno = EOVERFLOW;
+    return -1;
+  }
+#if defined(__linux__)
+  return ::pread64(fd, buffer, size, file_offset);
+#else
+  return ::pread(fd, buffer, size, file_offset);
+#endif
+}
+
+// Only a hint, so ranges the platform can't take are skipped
+inline void advise_file_range(int fd, uint64_t offset, uint64_t size, [[maybe_unused]] int advice) {
+  file_offset_t file_offset = 0;
+  file_offset_t file_size = 0;
+  if (!to_file_offset(offset, file_offset) || !to_file_offset(size, file_size))
+    return;
+#if defined(__linux__)
+  posix_fadvise64(fd, file_offset, file_size, advice);
+#elif defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(fd, file_offset, file_size, advice);
+#else
+  (void) fd;
+#endif
+}
+#endif
+
+class file_reader {
+public:
+  using consumer_t = std::function<void(const uint8_t *data, size_t size)>;
+
+  virtual ~file_reader() = default;
+
+  // Passes [offset, offset + size) to `consumer` in consecutive pieces, valid only during the call.
+  // Stops early at the end of the file. Returns the number of bytes passed.
+  virtual uint64_t read(uint64_t offset, uint64_t size, const consumer_t &consumer) = 0;
+};
+
+// std::ifstream with a buffer of at most kStreamReaderBufferSize bytes
+class stream_file_reader : public file_reader {
+  std::ifstream stream;
+  std::unique_ptr<char[]> buffer;
+  size_t buffer_size = 0;
+public:
+  // Throws std::runtime_error if the file can't be opened
+  explicit stream_file_reader(const std::filesystem::path &path) {
+    stream.open(path, std::ios::in | std::ios::binary);
+    if (!stream.is_open())
+      throw std::runtime_error("Could not open file " + path.string());
+  }
+
+  uint64_t read(uint64_t offset, uint64_t size, const consumer_t &consumer) override {
+    if (size == 0)
+      return 0;
+    if (buffer_size < std::min<uint64_t>(size, kStreamReaderBufferSize)) {
+      buffer_size = static_cast<size_t>(std::min<uint64_t>(size, kStreamReaderBufferSize));
+      buffer.reset(new char[buffer_size]);
+    }
+    stream.clear();
+    stream.seekg(static_cast<std::streamoff>(offset));
+    uint64_t ret = 0;
+    while (ret < size) {
+      stream.read(buffer.get(), static_cast<std::streamsize>(std::min<uint64_t>(size - ret, buffer_size)));
+      auto bytes_read = stream.gcount();
+      if (bytes_read <= 0)
+        break;
+      consumer(reinterpret_cast<const uint8_t *>(buffer.get()), static_cast<size_t>(bytes_read));
+      ret += static_cast<uint64_t>(bytes_read);
+    }
+    return ret;
+  }
+};
+
+// Maps kMappedReaderWindowSize bytes at a time, so even 32-bit clients have address space left for huge files.
+// Mapped pages are backed by the file itself and can be dropped by the OS at any time.
+class mapped_file_reader : public file_reader {
+  std::filesystem::path path;
+  mapped_file window;
+  uint64_t window_offset = 0;
+public:
+  // Maps the window with `first_offset` right away, throws std::system_error if the file can't be mapped
+  explicit mapped_file_reader(std::filesystem::path path, uint64_t first_offset = 0)
+      : path(std::move(path)),
+        window(this->path, first_offset - first_offset % kMappedReaderWindowSize, kMappedReaderWindowSize),
+        window_offset(first_offset - first_offset % kMappedReaderWindowSize) {}
+
+  // Throws std::system_error if a window can't be mapped
+  uint64_t read(uint64_t offset, uint64_t size, const consumer_t &consumer) override {
+    uint64_t ret = 0;
+    while (ret < size) {
+      auto position = offset + ret;
+      if (position < window_offset || position >= window_offset + window.size()) {
+        window_offset = position - position % kMappedReaderWindowSize;
+        window = mapped_file(path, window_offset, kMappedReaderWindowSize);
+        if (position >= window_offset + window.size())
+          break;
+      }
+      auto window_position = static_cast<size_t>(position - window_offset);
+      auto piece_size = static_cast<size_t>(std::min<uint64_t>(size - ret, window.size() - window_position));
+      consumer(window.data() + window_position, piece_size);
+      ret += piece_size;
+    }
+    return ret;
+  }
+};
+
+struct file_range_t {
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Reads at explicit offsets without moving a shared file position (pread, ReadFile with an offset) through a buffer
+// of at most kStreamReaderBufferSize bytes. Meant for scattered small reads: the OS is told not to read ahead, and
+// prefetch() queues the I/O of all the ranges about to be read at once instead of one seek after another.
+class positional_file_reader : public file_reader {
+#if WIN32
+  HANDLE file = INVALID_HANDLE_VALUE;
+#else
+  int fd = -1;
+#endif
+  std::unique_ptr<uint8_t[]> buffer;
+  size_t buffer_size = 0;
+public:
+  // Throws std::system_error if the file can't be opened
+  explicit positional_file_reader(const std::filesystem::path &path) {
+#if WIN32
+    file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), "Could not open file");
+#else
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(), "Could not open file");
+#if defined(POSIX_FADV_RANDOM)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+#endif
+  }
+
+  positional_file_reader(const positional_file_reader &) = delete;
+  positional_file_reader &operator=(const positional_file_reader &) = delete;
+
+  ~positional_file_reader() override {
+#if WIN32
+    CloseHandle(file);
+#else
+    ::close(fd);
+#endif
+  }
+
+  // Only a hint, does nothing where the OS has no way to take it
+  void prefetch(const std::vector<file_range_t> &ranges) {
+#if !WIN32 && defined(POSIX_FADV_WILLNEED)
+    for (auto &range : ranges) {
+      advise_file_range(fd, range.offset, range.size, POSIX_FADV_WILLNEED);
+    }
+#else
+    (void) ranges;
+#endif
+  }
+
+  // Throws std::system_error if reading fails
+  uint64_t read(uint64_t offset, uint64_t size, const consumer_t &consumer) override {
+    if (size == 0)
+      return 0;
+    if (buffer_size < std::min<uint64_t>(size, kStreamReaderBufferSize)) {
+      buffer_size = static_cast<size_t>(std::min<uint64_t>(size, kStreamReaderBufferSize));
+      buffer.reset(new uint8_t[buffer_size]);
+    }
+    uint64_t ret = 0;
+    while (ret < size) {
+      auto piece_size = static_cast<size_t>(std::min<uint64_t>(size - ret, buffer_size));
+      auto position = offset + ret;
+#if WIN32
+      OVERLAPPED overlapped{};
+      overlapped.Offset = static_cast<DWORD>(position);
+      overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+      DWORD bytes_read = 0;
+      if (!ReadFile(file, buffer.get(), static_cast<DWORD>(piece_size), &bytes_read, &overlapped)) {
+        auto error = GetLastError();
+        if (error != ERROR_HANDLE_EOF)
+          throw std::system_error(static_cast<int>(error), std::system_category(), "Could not read file");
+      }
+#else
+      auto bytes_read = read_file_at(fd, buffer.get(), piece_size, position);
+      if (bytes_read < 0) {
+        if (errno == EINTR)
+          continue;
+        throw std::system_error(errno, std::generic_category(), "Could not read file");
+      }
+#endif
+      if (bytes_read == 0)
+        break;
+      consumer(buffer.get(), static_cast<size_t>(bytes_read));
+      ret += static_cast<uint64_t>(bytes_read);
+    }
+    return ret;
+  }
+};
+
+// Small files are read with a single buffered read, which is cheaper than setting up a mapping. Larger files are
+// mapped, or streamed if mapping is not possible, e.g. for files on some network shares. `first_offset` is where
+// reading is going to start.
+inline std::unique_ptr<file_reader> open_file_reader(const std::filesystem::path &path, uint64_t file_size,
+                                                     uint64_t first_offset = 0) {
+  if (file_size > kStreamReaderBufferSize) {
+    try {
+      return std::make_unique<mapped_file_reader>(path, first_offset);
+    } catch (const std::system_error &) {
+      /* fall back to streaming */
+    }
+  }
+  return std::make_unique<stream_file_reader>(path);
+}
+}
@@ -0,0 +1,166 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <unordered_map>
+
+#if WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace common {
+struct file_stat_t {
+  uint64_t size = 0;
+  int64_t mtime = 0; // platform ticks, only good for comparing against other file_stat_t::mtime values
+  uint64_t file_id = 0; // inode, changes when the file is replaced. 0 on Windows, where it takes opening the file
+};
+
+#if WIN32
+constexpr int64_t kMtimeTicksPerSecond = 10000000; // FILETIME
+#else
+constexpr int64_t kMtimeTicksPerSecond = 1000000000;
+#endif
+
+#if !WIN32
+inline std::optional<file_stat_t> to_file_stat(const struct stat &file_stat) {
+  if (!S_ISREG(file_stat.st_mode))
+    return std::nullopt;
+  file_stat_t ret;
+  ret.size = static_cast<uint64_t>(file_stat.st_size);
+  ret.file_id = static_cast<uint64_t>(file_stat.st_ino);
+#if __APPLE__
+  ret.mtime = static_cast<int64_t>(file_stat.st_mtimespec.tv_sec) * 1000000000 + file_stat.st_mtimespec.tv_nsec;
+#else
+  ret.mtime = static_cast<int64_t>(file_stat.st_mtim.tv_sec) * 1000000000 + file_stat.st_mtim.tv_nsec;
+#endif
+  return ret;
+}
+#endif
+
+// Single syscall replacement of exists() + is_regular_file() + file_size() + last_write_time().
+// Returns std::nullopt if the path is missing or is not a regular file.
+inline std::optional<file_stat_t> get_file_stat(const std::filesystem::path &path) {
+#if WIN32
+  WIN32_FILE_ATTRIBUTE_DATA data{};
+  if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data)
+      || (data.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_DEVICE)) != 0)
+    return std::nullopt;
+  file_stat_t ret;
+  ret.size = (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+  ret.mtime = static_cast<int64_t>((static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32)
+                                       | data.ftLastWriteTime.dwLowDateTime);
+  return ret;
+#else
+  struct stat file_stat{};
+  if (::stat(path.c_str(), &file_stat) != 0)
+    return std::nullopt;
+  return to_file_stat(file_stat);
+#endif
+}
+
+// Answers the stats of the files of one directory.
+// Windows lists the stats along with the names, one listing instead of a query per file. Files the listing doesn't
+// have are looked up by path, as the filesystem may be case insensitive. Elsewhere a listing has names and types
+// only and would still need a stat per file, so the directory is just opened and its files are stat'ed relative to
+// it, without resolving the whole path again. Either way a missing directory answers all of its files at once.
+// Only stats are answered: the snapshot lives for the stat pass, and the files are read later, by path.
+class directory_snapshot {
+  std::filesystem::path directory;
+  bool missing = false;
+#if WIN32
+  std::unordered_map<std::filesystem::path::string_type, file_stat_t> files;
+#else
+  int directory_fd = -1;
+#endif
+public:
+  explicit directory_snapshot(std::filesystem::path directory) : directory(std::move(directory)) {
+#if WIN32
+    WIN32_FIND_DATAW data{};
+    auto find = FindFirstFileExW((this->directory / L"*").c_str(), FindExInfoBasic, &data, FindExSearchNameMatch,
+                                 nullptr, FIND_FIRST_EX_LARGE_FETCH);
+    if (find == INVALID_HANDLE_VALUE) {
+      auto error = GetLastError();
+      missing = error == ERROR_PATH_NOT_FOUND || error == ERROR_FILE_NOT_FOUND;
+      return;
+    }
+    do {
+      if ((data.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_DEVICE)) != 0)
+        continue;
+      file_stat_t stat;
+      stat.size = (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+      stat.mtime = static_cast<int64_t>((static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32)
+                                            | data.ftLastWriteTime.dwLowDateTime);
+      files.emplace(data.cFileName, stat);
+    } while (FindNextFileW(find, &data));
+    FindClose(find);
+#else
+    directory_fd = open(this->directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory_fd == -1)
+      missing = errno == ENOENT || errno == ENOTDIR;
+#endif
+  }
+
+  directory_snapshot(const directory_snapshot &) = delete;
+  directory_snapshot &operator=(const directory_snapshot &) = delete;
+
+  ~directory_snapshot() {
+#if !WIN32
+    if (directory_fd != -1)
+      close(directory_fd);
+#endif
+  }
+
+  // Same as get_file_stat(directory / name)
+  std::optional<file_stat_t> get(const std::filesystem::path &name) const {
+    if (missing)
+      return std::nullopt;
+#if WIN32
+    auto file = files.find(name.native());
+    if (file == files.end())
+      return get_file_stat(directory / name);
+    return file->second;
+#else
+    if (directory_fd == -1)
+      return get_file_stat(directory / name);
+    struct stat file_stat{};
+    if (fstatat(directory_fd, name.c_str(), &file_stat, 0) != 0)
+      return std::nullopt;
+    return to_file_stat(file_stat);
+#endif
+  }
+};
+}
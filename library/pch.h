@@ -34,6 +34,8 @@
 #include <random>
 #include <variant>
 #include <optional>
+#include <deque>
+#include <future>
 
 #include <curl/curl.h>
 #include <zstd.h>
@@ -66,6 +66,10 @@ error_code_t rm_tree_download(rm_tree *tree) {
   return tree->download();
 }
 
+error_code_t rm_tree_set_download_concurrency(rm_tree *tree, size_t min_count, size_t max_count) {
+  return tree->set_download_concurrency(min_count, max_count);
+}
+
 bool rm_tree_downloading(rm_tree *tree) {
   return tree->downloading();
 }
@@ -82,6 +86,10 @@ error_code_t rm_tree_check(rm_tree *tree) {
   return tree->check();
 }
 
+error_code_t rm_tree_check_full(rm_tree *tree) {
+  return tree->check(true);
+}
+
 bool rm_tree_checking(rm_tree *tree) {
   return tree->checking();
 }
@@ -94,6 +102,46 @@ error_code_t rm_tree_stop_checking(rm_tree *tree) {
   return tree->stop_check();
 }
 
+error_code_t rm_tree_set_check_threads_count(rm_tree *tree, size_t count) {
+  return tree->set_check_threads_count(count);
+}
+
+bool rm_tree_deep_checking(rm_tree *tree) {
+  return tree->deep_checking();
+}
+
+uint64_t rm_tree_get_deep_check_total_work_amount(rm_tree *tree) {
+  return tree->get_deep_check_total_work_amount();
+}
+
+uint64_t rm_tree_get_deep_check_completed_work_amount(rm_tree *tree) {
+  return tree->get_deep_check_completed_work_amount();
+}
+
+error_code_t rm_tree_sync(rm_tree *tree) {
+  return tree->sync();
+}
+
+bool rm_tree_syncing(rm_tree *tree) {
+  return tree->syncing();
+}
+
+error_code_t rm_tree_stop_sync(rm_tree *tree) {
+  return tree->stop_sync();
+}
+
+error_code_t rm_tree_start_watching(rm_tree *tree) {
+  return tree->start_watching();
+}
+
+bool rm_tree_watching(rm_tree *tree) {
+  return tree->watching();
+}
+
+error_code_t rm_tree_stop_watching(rm_tree *tree) {
+  return tree->stop_watching();
+}
+
 error_code_t rm_tree_remove_modifications(rm_tree *tree) {
   return tree->remove_modifications();
 }
@@ -158,6 +206,10 @@ size_t rm_tree_get_pending_download_files_count(rm_tree *tree) {
   return tree->get_pending_download_files_count();
 }
 
+size_t rm_tree_get_download_concurrency(rm_tree *tree) {
+  return tree->get_download_concurrency();
+}
+
 rm_cdn *rm_cdn_create(const char *url) {
   return new rm_cdn(url);
 }
@@ -179,3 +231,7 @@ void rm_cdn_remove_header(rm_cdn *cdn, const char *key) {
 void rm_cdn_set_custom_cacert_filepath(rm_cdn *cdn, const char *path) {
   cdn->set_custom_cacert_filepath(path);
 }
+
+void rm_cdn_set_max_connections(rm_cdn *cdn, size_t count) {
+  cdn->set_max_connections(count);
+}
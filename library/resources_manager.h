@@ -50,6 +50,7 @@ enum error_code_t {
   kCouldNotConnectToHostRemoteAccessDenied,
   kUnknownHttpCodeResponse,
   kUnknownCurlError,
+  kCannotWatchChanges,
 
   kMaxErrorCode
 };
@@ -79,14 +80,35 @@ RM_EXPORT bool rm_tree_fetched_updates(rm_tree *tree);
 RM_EXPORT error_code_t rm_tree_stop_fetching_updates(rm_tree *tree);
 
 RM_EXPORT error_code_t rm_tree_download(rm_tree *tree);
+// Parallel downloads adapt to the link between these bounds, see rm_concurrency_controller.h
+RM_EXPORT error_code_t rm_tree_set_download_concurrency(rm_tree *tree, size_t min_count, size_t max_count);
 RM_EXPORT bool rm_tree_downloading(rm_tree *tree);
 RM_EXPORT bool rm_tree_downloaded(rm_tree *tree);
-RM_EXPORT error_code_t rm_tree_stop_downloading(rm_tree *tree);
+RM_EXPORT error_code_t rm_tree_stop_downloading(rm_tree *tree); // the next download resumes the stopped files
 
 RM_EXPORT error_code_t rm_tree_check(rm_tree *tree);
+RM_EXPORT error_code_t rm_tree_check_full(rm_tree *tree); // hashes every file, trusting nothing from earlier checks
 RM_EXPORT bool rm_tree_checking(rm_tree *tree);
 RM_EXPORT bool rm_tree_checked(rm_tree *tree);
 RM_EXPORT error_code_t rm_tree_stop_checking(rm_tree *tree);
+RM_EXPORT error_code_t rm_tree_set_check_threads_count(rm_tree *tree, size_t count); // 0 uses all hardware threads
+// A check finishes once stats have told what they can; the files only hashing can tell about are hashed in background
+// then. Corrupt files it finds are added to the pending ones, a download started meanwhile picks them up as well.
+// rm_tree_stop_checking stops it too.
+RM_EXPORT bool rm_tree_deep_checking(rm_tree *tree);
+RM_EXPORT uint64_t rm_tree_get_deep_check_total_work_amount(rm_tree *tree); // files to hash
+RM_EXPORT uint64_t rm_tree_get_deep_check_completed_work_amount(rm_tree *tree);
+
+// Fetches updates, checks and downloads in one run; pending files are downloaded while the check is still hashing.
+// rm_tree_fetching_updates, rm_tree_checking and rm_tree_downloading tell the current phase
+RM_EXPORT error_code_t rm_tree_sync(rm_tree *tree);
+RM_EXPORT bool rm_tree_syncing(rm_tree *tree);
+RM_EXPORT error_code_t rm_tree_stop_sync(rm_tree *tree);
+
+// Watches base path for changes while the app runs, so checks look only at changed files (Linux only)
+RM_EXPORT error_code_t rm_tree_start_watching(rm_tree *tree);
+RM_EXPORT bool rm_tree_watching(rm_tree *tree);
+RM_EXPORT error_code_t rm_tree_stop_watching(rm_tree *tree);
 
 RM_EXPORT error_code_t rm_tree_remove_modifications(rm_tree *tree);
 RM_EXPORT bool rm_tree_removing_modifications(rm_tree *tree);
@@ -105,6 +127,7 @@ RM_EXPORT uint64_t rm_tree_get_total_work_amount(rm_tree *tree);
 RM_EXPORT uint64_t rm_tree_get_completed_work_amount(rm_tree *tree);
 
 RM_EXPORT size_t rm_tree_get_pending_download_files_count(rm_tree *tree);
+RM_EXPORT size_t rm_tree_get_download_concurrency(rm_tree *tree); // parallel downloads chosen for the link
 
 // Resource manager CDNs
 
@@ -114,6 +137,7 @@ RM_EXPORT void rm_cdn_destroy(rm_cdn *cdn);
 RM_EXPORT void rm_cdn_add_header(rm_cdn *cdn, const char *key, const char *value);
 RM_EXPORT void rm_cdn_remove_header(rm_cdn *cdn, const char *key);
 RM_EXPORT void rm_cdn_set_custom_cacert_filepath(rm_cdn *cdn, const char *path);
+RM_EXPORT void rm_cdn_set_max_connections(rm_cdn *cdn, size_t count); // caps parallel downloads from the CDN
 
 #ifdef __cplusplus
 }
@@ -22,13 +22,80 @@
 
 #include "rm_cdn.h"
 #include <common.hpp>
+#include <array>
+
+struct rm_cdn::connection_pool_t {
+  CURLSH *share = nullptr; // created with the first handle, after curl_global_init
+  std::array<std::mutex, CURL_LOCK_DATA_LAST> share_locks;
+  std::mutex handles_mtx;
+  std::vector<CURL *> idle_handles;
+
+  ~connection_pool_t() {
+    for (auto ch : idle_handles)
+      curl_easy_cleanup(ch);
+    if (share != nullptr)
+      curl_share_cleanup(share);
+  }
+
+  CURL *acquire() {
+    std::scoped_lock lock(handles_mtx);
+    if (share == nullptr)
+      share = create_share();
+    CURL *ch = nullptr;
+    if (!idle_handles.empty()) {
+      ch = idle_handles.back();
+      idle_handles.pop_back();
+    } else {
+      ch = curl_easy_init();
+    }
+    if (ch != nullptr && share != nullptr)
+      curl_easy_setopt(ch, CURLOPT_SHARE, share);
+    return ch;
+  }
+
+  void release(CURL *ch) {
+    curl_easy_reset(ch); // keeps the connections and caches of the handle
+    std::scoped_lock lock(handles_mtx);
+    if (idle_handles.size() < kMaxIdleHandlesCount)
+      idle_handles.push_back(ch);
+    else
+      curl_easy_cleanup(ch);
+  }
+
+  CURLSH *create_share() {
+    auto ret = curl_share_init();
+    if (ret == nullptr) {
+      L_WARN("Could not initialize CURL share handler, connections won't be reused across transfers");
+      return nullptr;
+    }
+    auto lock_fn = +[](CURL *, curl_lock_data data, curl_lock_access, void *userptr) {
+      static_cast<connection_pool_t *>(userptr)->share_locks[data].lock();
+    };
+    auto unlock_fn = +[](CURL *, curl_lock_data data, void *userptr) {
+      static_cast<connection_pool_t *>(userptr)->share_locks[data].unlock();
+    };
+    curl_share_setopt(ret, CURLSHOPT_LOCKFUNC, lock_fn);
+    curl_share_setopt(ret, CURLSHOPT_UNLOCKFUNC, unlock_fn);
+    curl_share_setopt(ret, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(ret, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(ret, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    // connections aren't shared: the copies of a CDN may be used by several trees transferring at the same time,
+    // which libcurl doesn't support for a shared connection cache. The multi handle of a download and the kept
+    // easy handles reuse their own connections
+    return ret;
+  }
+};
 
 rm_cdn::easy_init_t::~easy_init_t() {
   if (ch != nullptr) {
     unlink_from_curlm();
-    curl_easy_cleanup(ch);
+    if (pool != nullptr)
+      pool->release(ch);
+    else
+      curl_easy_cleanup(ch);
     ch = nullptr;
   }
+  pool.reset();
   if (headers != nullptr) {
     curl_slist_free_all(headers);
     headers = nullptr;
@@ -52,6 +119,7 @@ rm_cdn::easy_init_t::easy_init_t(rm_cdn::easy_init_t &&old_init) {
   this->~easy_init_t();
   ch = old_init.ch;
   headers = old_init.headers;
+  pool = std::move(old_init.pool);
   old_init.ch = nullptr;
   old_init.headers = nullptr;
 }
@@ -60,12 +128,13 @@ rm_cdn::easy_init_t &rm_cdn::easy_init_t::operator=(rm_cdn::easy_init_t &&old_in
   this->~easy_init_t();
   ch = old_init.ch;
   headers = old_init.headers;
+  pool = std::move(old_init.pool);
   old_init.ch = nullptr;
   old_init.headers = nullptr;
   return *this;
 }
 
-rm_cdn::rm_cdn(std::string url) : base_url(std::move(url)) {
+rm_cdn::rm_cdn(std::string url) : base_url(std::move(url)), connection_pool(std::make_shared<connection_pool_t>()) {
   if (base_url.back() != '/') {
     base_url += '/';
   }
@@ -100,23 +169,32 @@ std::string rm_cdn::build_url(std::string path) const {
   return base_url + path;
 }
 
-rm_cdn::easy_init_t rm_cdn::easy_init(const std::string &path) const {
+rm_cdn::easy_init_t rm_cdn::easy_init(const std::string &path, const std::vector<std::string> &extra_headers) const {
   easy_init_t ret;
-  ret.ch = curl_easy_init();
+  ret.ch = connection_pool != nullptr ? connection_pool->acquire() : curl_easy_init();
   if (ret.ch == nullptr) {
     L_WARN("Could not initialuze CURL easy handler");
     return ret;
   }
+  ret.pool = connection_pool;
   curl_easy_setopt(ret.ch, CURLOPT_URL, build_url(path).c_str());
+  if (is_http()) {
+    // servers which can take several transfers over one connection get them all there
+    curl_easy_setopt(ret.ch, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(ret.ch, CURLOPT_PIPEWAIT, 1L);
+  }
   if (!custom_cacert_filepath.empty())
     curl_easy_setopt(ret.ch, CURLOPT_CAINFO, custom_cacert_filepath.c_str());
-  if (is_http() && !headers.empty()) {
-    curl_slist *curl_headers = nullptr;
+  if (is_http() && (!headers.empty() || !extra_headers.empty())) {
+    std::vector<std::string> lines = extra_headers;
     for (auto &entry : headers) {
       std::string value = entry.first;
       value += ": ";
       value += entry.second;
-
+      lines.emplace_back(std::move(value));
+    }
+    curl_slist *curl_headers = nullptr;
+    for (auto &value : lines) {
       auto temp = curl_slist_append(curl_headers, value.c_str());
       if (temp == nullptr) {
         // something went wrong, but we have no idea really what
@@ -133,6 +211,13 @@ rm_cdn::easy_init_t rm_cdn::easy_init(const std::string &path) const {
   return ret;
 }
 
+CURLM *rm_cdn::multi_init() {
+  auto ret = curl_multi_init();
+  if (ret != nullptr)
+    curl_multi_setopt(ret, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  return ret;
+}
+
 bool rm_cdn::is_http() const {
   return is_http_;
 }
@@ -140,3 +225,11 @@ bool rm_cdn::is_http() const {
 void rm_cdn::set_custom_cacert_filepath(const std::string &path) {
   custom_cacert_filepath = path;
 }
+
+void rm_cdn::set_max_connections(size_t count) {
+  max_connections = std::max<size_t>(1, count);
+}
+
+size_t rm_cdn::get_max_connections() const {
+  return max_connections;
+}
@@ -23,20 +23,28 @@
 #pragma once
 
 #include <curl/curl.h>
+#include <memory>
 #include <utility>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 class rm_cdn {
+  struct connection_pool_t;
+
   std::string base_url;
   std::unordered_map<std::string, std::string> headers;
   bool is_http_;
   std::string custom_cacert_filepath;
+  size_t max_connections = kDefaultMaxConnectionsCount;
+  // easy handles, DNS cache and TLS sessions, shared by the copies of the CDN
+  std::shared_ptr<connection_pool_t> connection_pool;
 public:
   struct easy_init_t {
     CURLM *linked_curlm = nullptr;
     CURL *ch = nullptr;
     curl_slist *headers = nullptr;
+    std::shared_ptr<connection_pool_t> pool; // ch goes back there instead of being cleaned up
 
     void link_to_curlm(CURLM *link_to);
     void unlink_from_curlm();
@@ -56,8 +64,15 @@ public:
   void add_header(const std::string &key, const std::string &value);
   void remove_header(const std::string &key);
   std::string build_url(std::string path) const;
-  easy_init_t easy_init(const std::string &path) const;
+  // extra_headers are complete "Key: value" lines sent along with CDN headers, for HTTP CDNs only
+  easy_init_t easy_init(const std::string &path, const std::vector<std::string> &extra_headers = {}) const;
+  static CURLM *multi_init(); // for easy_init handles, multiplexes them over HTTP/2 connections
   bool is_http() const;
 
   void set_custom_cacert_filepath(const std::string &path);
+  void set_max_connections(size_t count); // parallel downloads from this CDN, however many the link could take
+  size_t get_max_connections() const;
+
+  static constexpr size_t kDefaultMaxConnectionsCount = 16;
+  static constexpr size_t kMaxIdleHandlesCount = 32;
 };
@@ -0,0 +1,260 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "rm_change_journal.h"
+#include <common.hpp>
+#include <cstring>
+
+#if __linux__
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace {
+#if __linux__
+constexpr uint32_t kWatchedEvents = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+    | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+#endif
+
+std::string join_path(const std::string &directory, std::string_view name) {
+  return directory.empty() ? std::string(name) : directory + "/" + std::string(name);
+}
+}
+
+rm_change_journal::rm_change_journal(std::filesystem::path base_path) : base_path(std::move(base_path)) {
+  /* Nothing to do */
+}
+
+rm_change_journal::~rm_change_journal() {
+  stop();
+}
+
+void rm_change_journal::add_key(const std::string &key) {
+  std::scoped_lock lock(journals_mtx);
+  journals.try_emplace(key);
+}
+
+bool rm_change_journal::watching() const {
+  return running;
+}
+
+#if __linux__
+bool rm_change_journal::start() {
+  if (running)
+    return true;
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (inotify_fd < 0 || stop_fd < 0) {
+    L_WARN("Could not start watching {}: {}", base_path.string(), std::strerror(errno));
+    stop();
+    return false;
+  }
+  try {
+    watch_directory({});
+  } catch (const std::exception &exc) {
+    // usually fs.inotify.max_user_watches is too low for the tree
+    L_WARN("Could not start watching {}: {}", base_path.string(), exc.what());
+    stop();
+    return false;
+  }
+  running = true;
+  watcher = std::thread(&rm_change_journal::watch_loop, this);
+  return true;
+}
+
+void rm_change_journal::stop() {
+  if (running) {
+    uint64_t value = 1;
+    if (write(stop_fd, &value, sizeof(value)) < 0)
+      L_WARN("Could not signal change watcher to stop: {}", std::strerror(errno));
+    watcher.join();
+    running = false;
+  }
+  if (inotify_fd >= 0)
+    close(inotify_fd);
+  if (stop_fd >= 0)
+    close(stop_fd);
+  inotify_fd = stop_fd = -1;
+  watched_directories.clear();
+
+  std::scoped_lock lock(journals_mtx);
+  for (auto &[key, journal] : journals) {
+    journal.complete = false;
+    if (journal.paths.empty())
+      continue;
+    try {
+      auto state_path = get_state_path(key);
+      auto persisted = load_persisted(state_path);
+      journal.paths.insert(persisted.paths.begin(), persisted.paths.end());
+      create_directories(state_path);
+      common::write_file(state_path / kPersistedFilename, nlohmann::json{{"paths", journal.paths}}.dump());
+      journal.paths.clear();
+    } catch (const std::exception &exc) {
+      L_WARN("Could not persist change journal: {}", exc.what());
+    }
+  }
+}
+
+// Throws std::system_error if the directory can't be watched
+void rm_change_journal::watch_directory(const std::string &relative_path) {
+  auto path = base_path / relative_path;
+  auto wd = inotify_add_watch(inotify_fd, path.c_str(), kWatchedEvents);
+  if (wd < 0) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      return; // gone already, its parent's event says so
+    throw std::system_error(errno, std::generic_category(), "Could not watch " + path.string());
+  }
+  watched_directories[wd] = relative_path;
+  std::error_code error;
+  for (auto it = std::filesystem::directory_iterator(path, error); !error && it != std::filesystem::directory_iterator();
+       it.increment(error)) {
+    auto name = it->path().filename().string();
+    if (relative_path.empty() && name == common::kStateDirectoryName)
+      continue; // our own state changes on every check
+    if (it->is_directory(error) && !it->is_symlink(error))
+      watch_directory(join_path(relative_path, name));
+  }
+}
+
+void rm_change_journal::watch_loop() {
+  alignas(inotify_event) char buffer[64 * 1024];
+  pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+  while (true) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      L_ERROR("Change watcher failed: {}", std::strerror(errno));
+      lose_events();
+      return;
+    }
+    if (fds[1].revents != 0)
+      return;
+    auto size = read(inotify_fd, buffer, sizeof(buffer));
+    if (size <= 0)
+      continue; // EAGAIN
+    for (ssize_t offset = 0; offset < size;) {
+      auto event = reinterpret_cast<const inotify_event *>(buffer + offset);
+      offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+      if ((event->mask & IN_Q_OVERFLOW) != 0) {
+        L_WARN("Change watcher missed events, the next check looks at every file");
+        lose_events();
+        continue;
+      }
+      auto directory = watched_directories.find(event->wd);
+      if (directory == watched_directories.end())
+        continue;
+      if ((event->mask & IN_IGNORED) != 0) {
+        watched_directories.erase(directory);
+        continue;
+      }
+      if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) != 0) {
+        if (directory->second.empty())
+          lose_events(); // the base path itself is gone
+        else
+          record(directory->second);
+        continue;
+      }
+      std::string_view name(event->len != 0 ? event->name : "");
+      if (directory->second.empty() && name == common::kStateDirectoryName)
+        continue;
+      auto relative_path = join_path(directory->second, name);
+      if ((event->mask & IN_ISDIR) != 0) {
+        if ((event->mask & IN_MOVED_FROM) != 0) {
+          lose_events(); // watches inside of it keep the old path
+          continue;
+        }
+        if ((event->mask & (IN_CREATE | IN_MOVED_TO)) != 0) {
+          try {
+            watch_directory(relative_path);
+          } catch (const std::exception &exc) {
+            L_WARN("{}, the next check looks at every file", exc.what());
+            lose_events();
+          }
+        }
+      }
+      record(std::move(relative_path));
+    }
+  }
+}
+#else
+bool rm_change_journal::start() {
+  return false;
+}
+
+void rm_change_journal::stop() {
+  /* Nothing to do */
+}
+#endif
+
+void rm_change_journal::record(std::string relative_path) {
+  std::scoped_lock lock(journals_mtx);
+  for (auto &[key, journal] : journals) {
+    if (journal.paths.size() < kMaxJournalPaths)
+      journal.paths.insert(relative_path);
+    else
+      journal.complete = false;
+  }
+}
+
+void rm_change_journal::lose_events() {
+  std::scoped_lock lock(journals_mtx);
+  for (auto &[key, journal] : journals) {
+    journal.complete = false;
+  }
+}
+
+rm_change_journal::changes_t rm_change_journal::take(const std::string &key) {
+  std::scoped_lock lock(journals_mtx);
+  auto &journal = journals[key];
+  changes_t ret;
+  ret.complete = journal.complete;
+  ret.paths.assign(journal.paths.begin(), journal.paths.end());
+  journal.paths.clear();
+  journal.complete = running;
+  return ret;
+}
+
+void rm_change_journal::invalidate(const std::string &key) {
+  std::scoped_lock lock(journals_mtx);
+  journals[key].complete = false;
+}
+
+std::filesystem::path rm_change_journal::get_state_path(const std::string &key) const {
+  return base_path / common::kStateDirectoryName / key;
+}
+
+rm_change_journal::changes_t rm_change_journal::load_persisted(const std::filesystem::path &state_path) {
+  changes_t ret;
+  auto path = state_path / kPersistedFilename;
+  if (!is_regular_file(path))
+    return ret;
+  auto data_json = nlohmann::json::parse(common::read_file(path));
+  ret.paths = data_json.at("paths").get<std::vector<std::string>>();
+  return ret;
+}
+
+void rm_change_journal::clear_persisted(const std::filesystem::path &state_path) {
+  std::error_code error;
+  std::filesystem::remove(state_path / kPersistedFilename, error);
+}
@@ -0,0 +1,84 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <unordered_map>
+#include <unordered_set>
+
+// Journal of paths under a tree's base path that were modified, created or deleted while the host app runs, so a
+// check only has to look at them. Linux only (inotify), start() fails elsewhere.
+// Every tree sharing the base path consumes the journal under its own key. A key's changes are complete only if
+// the watcher ran without losing events since the key's previous take(); otherwise the paths are still worth
+// re-hashing, but anything else may have changed too. Paths seen while watching are persisted on stop(), so a
+// later process re-hashes them even though their stat may look untouched.
+class rm_change_journal {
+public:
+  struct changes_t {
+    bool complete = false;
+    std::vector<std::string> paths; // '/'-separated, relative to the base path, may be directories
+  };
+
+  explicit rm_change_journal(std::filesystem::path base_path);
+  ~rm_change_journal();
+
+  rm_change_journal(const rm_change_journal &) = delete;
+  rm_change_journal &operator=(const rm_change_journal &) = delete;
+
+  void add_key(const std::string &key); // changes are collected only for added keys
+  bool start(); // returns false if changes can't be watched
+  void stop();
+  bool watching() const;
+
+  // Changes since the previous take() under `key`, the next ones are collected from now on
+  changes_t take(const std::string &key);
+  void invalidate(const std::string &key); // the changes taken last were not used up, e.g. a check failed
+
+  // Paths persisted by stop() into the state directory of a key, they stay there until cleared
+  static changes_t load_persisted(const std::filesystem::path &state_path); // throws if the file is corrupted
+  static void clear_persisted(const std::filesystem::path &state_path);
+private:
+  struct journal_t {
+    bool complete = false;
+    std::unordered_set<std::string> paths;
+  };
+
+  std::filesystem::path base_path;
+  std::unordered_map<std::string, journal_t> journals;
+  mutable std::mutex journals_mtx;
+  std::atomic_bool running = false;
+  std::thread watcher;
+#if __linux__
+  int inotify_fd = -1;
+  int stop_fd = -1;
+  std::unordered_map<int, std::string> watched_directories; // watch descriptor -> relative path
+
+  void watch_directory(const std::string &relative_path);
+  void watch_loop();
+#endif
+  void record(std::string relative_path);
+  void lose_events(); // e.g. the kernel queue overflowed
+  std::filesystem::path get_state_path(const std::string &key) const;
+
+  static constexpr const char *kPersistedFilename = "journal.json";
+  static constexpr size_t kMaxJournalPaths = 65536; // more changes than that aren't worth tracking one by one
+};
@@ -0,0 +1,74 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "rm_concurrency_controller.h"
+#include <algorithm>
+
+rm_concurrency_controller::rm_concurrency_controller(size_t min_limit, size_t max_limit, size_t initial_limit)
+    : min_limit(std::max<size_t>(1, min_limit)),
+      max_limit(std::max(this->min_limit, max_limit)),
+      limit(std::clamp(initial_limit, this->min_limit, this->max_limit)) {}
+
+size_t rm_concurrency_controller::get_limit() const {
+  return limit;
+}
+
+void rm_concurrency_controller::on_transfer_finished(uint64_t bytes, double first_byte_seconds, bool failed) {
+  ++window_transfers_count;
+  window_bytes += bytes;
+  if (failed)
+    ++window_failures_count;
+  else
+    window_first_byte_seconds += first_byte_seconds;
+  if (window_transfers_count >= limit)
+    end_window();
+}
+
+void rm_concurrency_controller::end_window() {
+  auto now = std::chrono::steady_clock::now();
+  auto seconds = std::max(std::chrono::duration<double>(now - window_start).count(), 0.001);
+  auto throughput = static_cast<double>(window_bytes) / seconds;
+  auto previous_limit = limit;
+  if (window_failures_count != 0) {
+    limit = std::max(min_limit, limit / 2);
+  } else {
+    auto first_byte_seconds = window_first_byte_seconds / static_cast<double>(window_transfers_count);
+    if (!best_first_byte_seconds.has_value() || first_byte_seconds < *best_first_byte_seconds)
+      best_first_byte_seconds = first_byte_seconds;
+    if (first_byte_seconds > *best_first_byte_seconds * kCongestedFirstByteFactor
+        && throughput < last_throughput * kThroughputGainFactor)
+      limit = std::max(min_limit, limit - std::max<size_t>(1, limit / 4));
+    else
+      limit = std::min(max_limit, limit + 1);
+  }
+  if (limit != previous_limit) {
+    L_VERBOSE(1, "Parallel transfers: {} -> {}, {:.0f} KB/s, {} failed", previous_limit, limit, throughput / 1024,
+              window_failures_count);
+  }
+
+  last_throughput = throughput;
+  window_start = now;
+  window_transfers_count = 0;
+  window_failures_count = 0;
+  window_bytes = 0;
+  window_first_byte_seconds = 0;
+}
@@ -0,0 +1,58 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// Number of parallel transfers, adjusted by additive increase / multiplicative decrease.
+// Every window of as many finished transfers as the current limit is judged as a whole:
+//   - a failed transfer halves the limit,
+//   - a time to first byte far above the best window seen, with no more throughput to show for it, means the link
+//     is congested, and the limit shrinks by a quarter,
+//   - otherwise one more parallel transfer is tried.
+class rm_concurrency_controller {
+  size_t min_limit;
+  size_t max_limit;
+  size_t limit;
+
+  std::chrono::steady_clock::time_point window_start = std::chrono::steady_clock::now();
+  size_t window_transfers_count = 0;
+  size_t window_failures_count = 0;
+  uint64_t window_bytes = 0;
+  double window_first_byte_seconds = 0; // summed over the transfers of the window
+  double last_throughput = 0; // bytes per second of the previous window
+  std::optional<double> best_first_byte_seconds;
+
+  void end_window();
+public:
+  rm_concurrency_controller(size_t min_limit, size_t max_limit, size_t initial_limit);
+
+  size_t get_limit() const;
+  void on_transfer_finished(uint64_t bytes, double first_byte_seconds, bool failed);
+
+  static constexpr double kCongestedFirstByteFactor = 2.0;
+  static constexpr double kThroughputGainFactor = 1.05; // less than that is no gain
+};
@@ -33,11 +33,31 @@ rm_entry::rm_entry(const nlohmann::json &json) {
 #endif
   relative_path = path;
   size = static_cast<uint64_t>(json["s"]);
-  fnv_hash = json["h"];
+  hash = json["h"];
+  auto algorithm = json.value<uint64_t>("a", 0);
+  if (!common::is_hash_algorithm_supported(algorithm))
+    throw std::runtime_error("Manifest entry uses unsupported hash algorithm " + std::to_string(algorithm));
+  hash_algorithm = static_cast<common::hash_algorithm_t>(algorithm);
+  if (json.contains("b"))
+    block_hashes = json["b"].get<std::vector<uint64_t>>();
 
   compressed = json["c"];
   compressed_size = compressed ? static_cast<uint64_t>(json["cs"]) : 0;
-  compressed_fnv_hash = compressed ? static_cast<uint32_t>(json["ch"]) : 0;
+  compressed_hash = compressed ? static_cast<uint64_t>(json["ch"]) : 0;
+}
+
+rm_entry::rm_entry(const common::binary_manifest::entry_view_t &view)
+    : relative_path(view.relative_path),
+      size(view.size),
+      hash(view.hash),
+      hash_algorithm(view.hash_algorithm),
+      compressed(view.compressed),
+      compressed_size(view.compressed_size),
+      compressed_hash(view.compressed_hash) {
+  block_hashes.reserve(view.block_hashes.size());
+  for (size_t i = 0; i < view.block_hashes.size(); ++i) {
+    block_hashes.push_back(view.block_hashes[i]);
+  }
 }
 
 bool rm_entry::operator==(const rm_entry &other) const {
@@ -22,18 +22,23 @@
 
 #pragma once
 
+#include <binary_manifest.hpp>
+
 class rm_entry {
 public:
   std::filesystem::path relative_path;
   uint64_t size = 0;
-  uint32_t fnv_hash = 0;
+  uint64_t hash = 0;
+  common::hash_algorithm_t hash_algorithm = common::hash_algorithm_t::kFnv;
+  std::vector<uint64_t> block_hashes; // published for large kXxh3Blocks entries
 
   bool compressed = false;
   uint64_t compressed_size = 0;
-  uint32_t compressed_fnv_hash = 0;
+  uint64_t compressed_hash = 0;
 
   rm_entry();
   explicit rm_entry(const nlohmann::json &json);
+  explicit rm_entry(const common::binary_manifest::entry_view_t &view);
 
   bool operator==(const rm_entry &other) const;
   bool operator!=(const rm_entry &other) const;
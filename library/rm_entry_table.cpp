@@ -0,0 +1,232 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "rm_entry_table.h"
+
+size_t rm_entry_table::size() const {
+  return sizes.size();
+}
+
+bool rm_entry_table::empty() const {
+  return sizes.empty();
+}
+
+void rm_entry_table::clear() {
+  paths.clear();
+  path_offsets.assign(1, 0);
+  sizes.clear();
+  hashes.clear();
+  hash_algorithms.clear();
+  compressed_sizes.clear();
+  compressed_hashes.clear();
+  compressed.clear();
+  block_hashes.clear();
+  block_ranges.clear();
+  directories.clear();
+}
+
+void rm_entry_table::reserve(size_t entries_count, size_t paths_size) {
+  paths.reserve(paths_size);
+  path_offsets.reserve(entries_count + 1);
+  sizes.reserve(entries_count);
+  hashes.reserve(entries_count);
+  hash_algorithms.reserve(entries_count);
+  compressed_sizes.reserve(entries_count);
+  compressed_hashes.reserve(entries_count);
+  compressed.reserve(entries_count);
+}
+
+rm_entry_table::id_t rm_entry_table::add(const common::binary_manifest::entry_view_t &entry) {
+  if (paths.size() + entry.relative_path.size() > UINT32_MAX || sizes.size() >= UINT32_MAX)
+    throw std::runtime_error("Too many manifest entries");
+  auto id = static_cast<id_t>(sizes.size());
+  auto path_offset = paths.size();
+  paths.append(entry.relative_path);
+  std::replace(paths.begin() + static_cast<std::ptrdiff_t>(path_offset), paths.end(), '\\', '/');
+  path_offsets.push_back(static_cast<uint32_t>(paths.size()));
+  sizes.push_back(entry.size);
+  hashes.push_back(entry.hash);
+  hash_algorithms.push_back(entry.hash_algorithm);
+  compressed_sizes.push_back(entry.compressed ? entry.compressed_size : 0);
+  compressed_hashes.push_back(entry.compressed ? entry.compressed_hash : 0);
+  compressed.push_back(entry.compressed);
+  set_block_hashes(id, entry.block_hashes);
+  directories.clear();
+  return id;
+}
+
+rm_entry_table::id_t rm_entry_table::add(const rm_entry &entry) {
+  auto path = entry.relative_path.generic_string();
+  common::binary_manifest::entry_view_t view;
+  view.relative_path = path;
+  view.size = entry.size;
+  view.hash = entry.hash;
+  view.hash_algorithm = entry.hash_algorithm;
+  view.compressed = entry.compressed;
+  view.compressed_size = entry.compressed_size;
+  view.compressed_hash = entry.compressed_hash;
+  view.block_hashes = {entry.block_hashes.data(), entry.block_hashes.size()};
+  return add(view);
+}
+
+void rm_entry_table::update(id_t id, const rm_entry &entry) {
+  sizes.at(id) = entry.size;
+  hashes[id] = entry.hash;
+  hash_algorithms[id] = entry.hash_algorithm;
+  compressed_sizes[id] = entry.compressed ? entry.compressed_size : 0;
+  compressed_hashes[id] = entry.compressed ? entry.compressed_hash : 0;
+  compressed[id] = entry.compressed;
+  set_block_hashes(id, {entry.block_hashes.data(), entry.block_hashes.size()});
+  directories.clear();
+}
+
+void rm_entry_table::set_block_hashes(id_t id, const common::binary_manifest::block_hashes_view_t &hashes) {
+  if (hashes.empty()) {
+    block_ranges.erase(id);
+    return;
+  }
+  if (block_hashes.size() + hashes.size() > UINT32_MAX)
+    throw std::runtime_error("Too many block digests");
+  block_ranges[id] = {static_cast<uint32_t>(block_hashes.size()), static_cast<uint32_t>(hashes.size())};
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    block_hashes.push_back(hashes[i]);
+  }
+}
+
+void rm_entry_table::remove(const std::vector<bool> &removed) {
+  rm_entry_table ret;
+  ret.reserve(size(), paths.size());
+  for (id_t id = 0; id < size(); ++id) {
+    if (id >= removed.size() || !removed[id])
+      ret.add(at(id));
+  }
+  *this = std::move(ret);
+}
+
+void rm_entry_table::sort() {
+  std::vector<id_t> order(size());
+  for (id_t id = 0; id < size(); ++id) {
+    order[id] = id;
+  }
+  std::sort(order.begin(), order.end(), [&](id_t left, id_t right) {
+    return get_path(left) < get_path(right);
+  });
+  if (!std::is_sorted(order.begin(), order.end())) {
+    rm_entry_table ret;
+    ret.reserve(size(), paths.size());
+    for (auto id : order) {
+      ret.add(at(id));
+    }
+    *this = std::move(ret);
+  }
+  auto tree = common::binary_manifest::build_directories(size(), [&](size_t id) {
+    return get_path(static_cast<id_t>(id));
+  }, [&](size_t id) {
+    return common::binary_manifest::get_entry_digest(at(static_cast<id_t>(id)));
+  });
+  directories.clear();
+  directories.reserve(tree.size());
+  for (auto &directory : tree) {
+    common::binary_manifest::directory_t record{};
+    record.digest = directory.digest;
+    record.path_offset = directory.relative_path.empty()
+        ? 0 : static_cast<uint32_t>(directory.relative_path.data() - paths.data());
+    record.path_size = static_cast<uint32_t>(directory.relative_path.size());
+    record.first_entry = directory.first_entry;
+    record.entries_count = directory.entries_count;
+    directories.push_back(record);
+  }
+}
+
+size_t rm_entry_table::get_directories_count() const {
+  return directories.size();
+}
+
+common::binary_manifest::directory_view_t rm_entry_table::get_directory(size_t index) const {
+  auto &directory = directories[index];
+  common::binary_manifest::directory_view_t ret;
+  ret.relative_path = {paths.data() + directory.path_offset, directory.path_size};
+  ret.digest = directory.digest;
+  ret.first_entry = directory.first_entry;
+  ret.entries_count = directory.entries_count;
+  return ret;
+}
+
+std::string_view rm_entry_table::get_path(id_t id) const {
+  return {paths.data() + path_offsets[id], path_offsets[id + 1] - path_offsets[id]};
+}
+
+uint64_t rm_entry_table::get_size(id_t id) const {
+  return sizes[id];
+}
+
+uint64_t rm_entry_table::get_hash(id_t id) const {
+  return hashes[id];
+}
+
+common::hash_algorithm_t rm_entry_table::get_hash_algorithm(id_t id) const {
+  return hash_algorithms[id];
+}
+
+common::binary_manifest::block_hashes_view_t rm_entry_table::get_block_hashes(id_t id) const {
+  auto it = block_ranges.find(id);
+  if (it == block_ranges.end())
+    return {};
+  return {block_hashes.data() + it->second.first, it->second.count};
+}
+
+bool rm_entry_table::is_compressed(id_t id) const {
+  return compressed[id];
+}
+
+uint64_t rm_entry_table::get_compressed_size(id_t id) const {
+  return compressed_sizes[id];
+}
+
+uint64_t rm_entry_table::get_compressed_hash(id_t id) const {
+  return compressed_hashes[id];
+}
+
+uint64_t rm_entry_table::get_download_size(id_t id) const {
+  return compressed[id] ? compressed_sizes[id] : sizes[id];
+}
+
+common::binary_manifest::entry_view_t rm_entry_table::at(id_t id) const {
+  common::binary_manifest::entry_view_t ret;
+  ret.relative_path = get_path(id);
+  ret.size = sizes[id];
+  ret.hash = hashes[id];
+  ret.hash_algorithm = hash_algorithms[id];
+  ret.block_hashes = get_block_hashes(id);
+  ret.compressed = compressed[id];
+  ret.compressed_size = compressed_sizes[id];
+  ret.compressed_hash = compressed_hashes[id];
+  return ret;
+}
+
+uint64_t rm_entry_table::get_memory_usage() const {
+  return paths.capacity() + path_offsets.capacity() * sizeof(uint32_t) + sizes.capacity() * sizeof(uint64_t)
+      + hashes.capacity() * sizeof(uint64_t) + hash_algorithms.capacity() * sizeof(common::hash_algorithm_t)
+      + compressed_sizes.capacity() * sizeof(uint64_t) + compressed_hashes.capacity() * sizeof(uint64_t)
+      + compressed.capacity() / 8 + block_hashes.capacity() * sizeof(uint64_t)
+      + block_ranges.size() * (sizeof(id_t) + sizeof(block_range_t) + 2 * sizeof(void *));
+}
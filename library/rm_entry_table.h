@@ -0,0 +1,85 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <unordered_map>
+
+#include "rm_entry.h"
+
+// Struct-of-arrays storage of manifest entries.
+// All relative paths are normalized to '/' and interned back to back in a single arena, sizes and hashes live in
+// parallel arrays, so a million entries cost a few allocations and the checker walks dense memory.
+// Entries are addressed by id_t, which stays valid until the table is cleared or compacted.
+class rm_entry_table {
+public:
+  using id_t = uint32_t;
+
+  size_t size() const;
+  bool empty() const;
+  void clear();
+  void reserve(size_t entries_count, size_t paths_size = 0);
+
+  id_t add(const common::binary_manifest::entry_view_t &entry);
+  id_t add(const rm_entry &entry);
+  void update(id_t id, const rm_entry &entry); // everything but the path, which identifies the entry
+  void remove(const std::vector<bool> &removed); // compacts the table, invalidates ids
+  void sort(); // by path, so directories become contiguous id ranges; invalidates ids
+
+  // Pre-order directory tree with Merkle digests of the sorted table, see binary_manifest.hpp.
+  // Built by sort(), any later modification drops it.
+  size_t get_directories_count() const;
+  common::binary_manifest::directory_view_t get_directory(size_t index) const;
+
+  std::string_view get_path(id_t id) const;
+  uint64_t get_size(id_t id) const;
+  uint64_t get_hash(id_t id) const;
+  common::hash_algorithm_t get_hash_algorithm(id_t id) const;
+  common::binary_manifest::block_hashes_view_t get_block_hashes(id_t id) const; // valid until the next modification
+  bool is_compressed(id_t id) const;
+  uint64_t get_compressed_size(id_t id) const;
+  uint64_t get_compressed_hash(id_t id) const;
+  uint64_t get_download_size(id_t id) const;
+
+  // The view is valid until the next add
+  common::binary_manifest::entry_view_t at(id_t id) const;
+  uint64_t get_memory_usage() const;
+private:
+  struct block_range_t {
+    uint32_t first;
+    uint32_t count;
+  };
+
+  std::string paths;
+  std::vector<uint32_t> path_offsets{0}; // path of id is [path_offsets[id], path_offsets[id + 1])
+  std::vector<uint64_t> sizes;
+  std::vector<uint64_t> hashes;
+  std::vector<common::hash_algorithm_t> hash_algorithms;
+  std::vector<uint64_t> compressed_sizes; // 0 for uncompressed entries
+  std::vector<uint64_t> compressed_hashes;
+  std::vector<bool> compressed;
+  std::vector<uint64_t> block_hashes; // updated entries leave their old digests behind until the table is compacted
+  std::unordered_map<id_t, block_range_t> block_ranges; // few entries have block digests
+  std::vector<common::binary_manifest::directory_t> directories; // paths point into the arena
+
+  void set_block_hashes(id_t id, const common::binary_manifest::block_hashes_view_t &hashes);
+};
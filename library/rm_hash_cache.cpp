@@ -0,0 +1,86 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "rm_hash_cache.h"
+#include <common.hpp>
+
+void rm_hash_cache::load(const std::filesystem::path &path) {
+  records.clear();
+  if (!is_regular_file(path))
+    return;
+  auto data_json = nlohmann::json::parse(common::read_file(path));
+  for (auto &file : data_json.at("files")) {
+    uint64_t hash_algorithm = file.at(3);
+    if (!common::is_hash_algorithm_supported(hash_algorithm))
+      continue;
+    record_t record;
+    record.stat.size = file.at(1);
+    record.stat.mtime = file.at(2);
+    record.hash_algorithm = static_cast<common::hash_algorithm_t>(hash_algorithm);
+    record.hash = file.at(4);
+    record.stat.file_id = file.size() > 5 ? file.at(5).get<uint64_t>() : 0; // caches from before file ids
+    records[file.at(0)] = record;
+  }
+}
+
+void rm_hash_cache::save(const std::filesystem::path &path) const {
+  auto data_json = nlohmann::json::object();
+  auto &files_json = data_json["files"] = nlohmann::json::array();
+  for (auto &[relative_path, record] : records) {
+    files_json.push_back({relative_path, record.stat.size, record.stat.mtime,
+                          static_cast<uint64_t>(record.hash_algorithm), record.hash, record.stat.file_id});
+  }
+  common::write_file(path, data_json.dump());
+}
+
+void rm_hash_cache::clear() {
+  records.clear();
+}
+
+const rm_hash_cache::record_t *rm_hash_cache::get(std::string_view relative_path) const {
+  auto it = records.find(relative_path);
+  return it != records.end() ? &it->second : nullptr;
+}
+
+void rm_hash_cache::set(std::string_view relative_path, const record_t &record) {
+  auto it = records.find(relative_path);
+  if (it != records.end())
+    it->second = record;
+  else
+    records.emplace(relative_path, record);
+}
+
+void rm_hash_cache::remove(std::string_view relative_path) {
+  auto it = records.find(relative_path);
+  if (it != records.end())
+    records.erase(it);
+}
+
+std::optional<uint64_t> rm_hash_cache::find(std::string_view relative_path,
+                                            const common::file_stat_t &stat,
+                                            common::hash_algorithm_t hash_algorithm) const {
+  auto it = records.find(relative_path);
+  if (it == records.end() || it->second.stat.size != stat.size || it->second.stat.mtime != stat.mtime
+      || it->second.stat.file_id != stat.file_id || it->second.hash_algorithm != hash_algorithm)
+    return std::nullopt;
+  return it->second.hash;
+}
@@ -0,0 +1,58 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <unordered_map>
+#include <content_hash.hpp>
+#include <file_stat.hpp>
+
+// Hashes of local files, recorded when their content was verified by a download or a check.
+// A record stays good for as long as the file keeps the size, modification time and file id it had when it was
+// recorded.
+class rm_hash_cache {
+public:
+  struct record_t {
+    common::file_stat_t stat;
+    common::hash_algorithm_t hash_algorithm = common::hash_algorithm_t::kFnv;
+    uint64_t hash = 0;
+  };
+
+  void load(const std::filesystem::path &path); // a missing file gives an empty cache, throws if it is corrupted
+  void save(const std::filesystem::path &path) const;
+  void clear();
+
+  const record_t *get(std::string_view relative_path) const;
+  void set(std::string_view relative_path, const record_t &record);
+  void remove(std::string_view relative_path);
+  // Returns the recorded hash if the file still has the recorded stat and was hashed with `hash_algorithm`
+  std::optional<uint64_t> find(std::string_view relative_path,
+                               const common::file_stat_t &stat,
+                               common::hash_algorithm_t hash_algorithm) const;
+private:
+  struct path_hash_t {
+    using is_transparent = void;
+    size_t operator()(std::string_view path) const { return std::hash<std::string_view>{}(path); }
+  };
+
+  std::unordered_map<std::string, record_t, path_hash_t, std::equal_to<>> records;
+};
@@ -0,0 +1,398 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "rm_manifest_parser.h"
+
+#include <charconv>
+
+rm_manifest_parser::rm_manifest_parser(entry_callback_t callback) : callback(std::move(callback)) {
+  /* Nothing to do */
+}
+
+void rm_manifest_parser::reset() {
+  lexer_state = lexer_state_t::kIdle;
+  token_value.clear();
+  unicode_code_unit = 0;
+  unicode_digits_count = 0;
+  pending_high_surrogate = 0;
+  parser_state = parser_state_t::kExpectArray;
+  skip_depth = 0;
+  current_key.clear();
+  current_path.clear();
+  current_fields = 0;
+  parsed_entries_count = 0;
+  consumed_bytes = 0;
+  chunk_position = 0;
+}
+
+size_t rm_manifest_parser::get_parsed_entries_count() const {
+  return parsed_entries_count;
+}
+
+void rm_manifest_parser::feed(const char *data, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    chunk_position = i;
+    auto c = data[i];
+    switch (lexer_state) {
+    case lexer_state_t::kString: {
+      // copy the plain part of the string in one go
+      auto span_end = i;
+      while (span_end < size && data[span_end] != '"' && data[span_end] != '\\'
+          && static_cast<unsigned char>(data[span_end]) >= 0x20)
+        ++span_end;
+      if (span_end != i) {
+        if (pending_high_surrogate != 0)
+          fail("unpaired UTF-16 surrogate in string");
+        token_value.append(data + i, span_end - i);
+        i = chunk_position = span_end;
+        if (i == size)
+          break;
+        c = data[i];
+      }
+      if (c == '"') {
+        if (pending_high_surrogate != 0)
+          fail("unpaired UTF-16 surrogate in string");
+        lexer_state = lexer_state_t::kIdle;
+        on_token(token_t::kString);
+      } else if (c == '\\') {
+        lexer_state = lexer_state_t::kStringEscape;
+      } else {
+        fail("control character in string");
+      }
+      break;
+    }
+    case lexer_state_t::kStringEscape:
+      if (pending_high_surrogate != 0 && c != 'u')
+        fail("unpaired UTF-16 surrogate in string");
+      lexer_state = lexer_state_t::kString;
+      switch (c) {
+      case '"': token_value += '"';
+        break;
+      case '\\': token_value += '\\';
+        break;
+      case '/': token_value += '/';
+        break;
+      case 'b': token_value += '\b';
+        break;
+      case 'f': token_value += '\f';
+        break;
+      case 'n': token_value += '\n';
+        break;
+      case 'r': token_value += '\r';
+        break;
+      case 't': token_value += '\t';
+        break;
+      case 'u':
+        unicode_code_unit = 0;
+        unicode_digits_count = 0;
+        lexer_state = lexer_state_t::kStringUnicode;
+        break;
+      default: fail("invalid escape sequence");
+      }
+      break;
+    case lexer_state_t::kStringUnicode: {
+      uint32_t digit;
+      if (c >= '0' && c <= '9')
+        digit = c - '0';
+      else if (c >= 'a' && c <= 'f')
+        digit = c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F')
+        digit = c - 'A' + 10;
+      else
+        fail("invalid unicode escape sequence");
+      unicode_code_unit = (unicode_code_unit << 4) | digit;
+      if (++unicode_digits_count < 4)
+        break;
+      lexer_state = lexer_state_t::kString;
+      if (unicode_code_unit >= 0xD800 && unicode_code_unit <= 0xDBFF) {
+        if (pending_high_surrogate != 0)
+          fail("unpaired UTF-16 surrogate in string");
+        pending_high_surrogate = unicode_code_unit;
+      } else if (unicode_code_unit >= 0xDC00 && unicode_code_unit <= 0xDFFF) {
+        if (pending_high_surrogate == 0)
+          fail("unpaired UTF-16 surrogate in string");
+        append_code_point(0x10000 + ((pending_high_surrogate - 0xD800) << 10) + (unicode_code_unit - 0xDC00));
+        pending_high_surrogate = 0;
+      } else {
+        if (pending_high_surrogate != 0)
+          fail("unpaired UTF-16 surrogate in string");
+        append_code_point(unicode_code_unit);
+      }
+      break;
+    }
+    case lexer_state_t::kNumber:
+      if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E') {
+        token_value += c;
+        break;
+      }
+      flush_pending_token();
+      --i; // the terminating character belongs to the next token
+      break;
+    case lexer_state_t::kLiteral:
+      if (c >= 'a' && c <= 'z') {
+        token_value += c;
+        break;
+      }
+      flush_pending_token();
+      --i;
+      break;
+    case lexer_state_t::kIdle:
+      switch (c) {
+      case ' ':
+      case '\t':
+      case '\r':
+      case '\n':break;
+      case '[': on_token(token_t::kBeginArray);
+        break;
+      case ']': on_token(token_t::kEndArray);
+        break;
+      case '{': on_token(token_t::kBeginObject);
+        break;
+      case '}': on_token(token_t::kEndObject);
+        break;
+      case ':': on_token(token_t::kColon);
+        break;
+      case ',': on_token(token_t::kComma);
+        break;
+      case '"':
+        token_value.clear();
+        lexer_state = lexer_state_t::kString;
+        break;
+      default:
+        if ((c >= '0' && c <= '9') || c == '-') {
+          token_value.assign(1, c);
+          lexer_state = lexer_state_t::kNumber;
+        } else if (c >= 'a' && c <= 'z') {
+          token_value.assign(1, c);
+          lexer_state = lexer_state_t::kLiteral;
+        } else {
+          fail(std::string("unexpected character '") + c + "'");
+        }
+      }
+      break;
+    }
+  }
+  consumed_bytes += size;
+  chunk_position = 0;
+}
+
+void rm_manifest_parser::finish() {
+  flush_pending_token();
+  if (lexer_state != lexer_state_t::kIdle || parser_state != parser_state_t::kDone)
+    fail("document is truncated");
+}
+
+void rm_manifest_parser::flush_pending_token() {
+  if (lexer_state == lexer_state_t::kNumber) {
+    lexer_state = lexer_state_t::kIdle;
+    on_token(token_t::kNumber);
+  } else if (lexer_state == lexer_state_t::kLiteral) {
+    lexer_state = lexer_state_t::kIdle;
+    if (token_value != "true" && token_value != "false" && token_value != "null")
+      fail("unknown literal '" + token_value + "'");
+    on_token(token_t::kLiteral);
+  }
+}
+
+void rm_manifest_parser::on_token(token_t token) {
+  switch (parser_state) {
+  case parser_state_t::kExpectArray:
+    if (token != token_t::kBeginArray)
+      fail("manifest root must be an array");
+    parser_state = parser_state_t::kExpectObjectOrEnd;
+    break;
+  case parser_state_t::kExpectObjectOrEnd:
+    if (token == token_t::kEndArray) {
+      parser_state = parser_state_t::kDone;
+      break;
+    }
+    [[fallthrough]];
+  case parser_state_t::kExpectObject:
+    if (token != token_t::kBeginObject)
+      fail("manifest entry must be an object");
+    current_entry = rm_entry();
+    current_path.clear();
+    current_fields = 0;
+    parser_state = parser_state_t::kExpectKeyOrEnd;
+    break;
+  case parser_state_t::kExpectKeyOrEnd:
+    if (token == token_t::kEndObject) {
+      on_entry_end();
+      break;
+    }
+    [[fallthrough]];
+  case parser_state_t::kExpectKey:
+    if (token != token_t::kString)
+      fail("object key expected");
+    current_key.swap(token_value);
+    parser_state = parser_state_t::kExpectColon;
+    break;
+  case parser_state_t::kExpectColon:
+    if (token != token_t::kColon)
+      fail("':' expected");
+    parser_state = parser_state_t::kExpectValue;
+    break;
+  case parser_state_t::kExpectValue:
+    if (token == token_t::kBeginArray && current_key == "b") {
+      current_entry.block_hashes.clear();
+      parser_state = parser_state_t::kExpectBlockHashOrEnd;
+    } else if (token == token_t::kBeginArray || token == token_t::kBeginObject) {
+      skip_depth = 1;
+      parser_state = parser_state_t::kSkipValue;
+    } else if (token == token_t::kString || token == token_t::kNumber || token == token_t::kLiteral) {
+      on_value(token);
+      parser_state = parser_state_t::kExpectObjectSeparator;
+    } else {
+      fail("value expected");
+    }
+    break;
+  case parser_state_t::kSkipValue:
+    if (token == token_t::kBeginArray || token == token_t::kBeginObject) {
+      ++skip_depth;
+    } else if (token == token_t::kEndArray || token == token_t::kEndObject) {
+      if (--skip_depth == 0)
+        parser_state = parser_state_t::kExpectObjectSeparator;
+    }
+    break;
+  case parser_state_t::kExpectBlockHashOrEnd:
+    if (token == token_t::kEndArray) {
+      parser_state = parser_state_t::kExpectObjectSeparator;
+      break;
+    }
+    [[fallthrough]];
+  case parser_state_t::kExpectBlockHash:
+    if (token != token_t::kNumber)
+      fail("\"b\" must be an array of unsigned integers");
+    current_entry.block_hashes.push_back(parse_unsigned(current_key));
+    parser_state = parser_state_t::kExpectBlockHashSeparator;
+    break;
+  case parser_state_t::kExpectBlockHashSeparator:
+    if (token == token_t::kComma)
+      parser_state = parser_state_t::kExpectBlockHash;
+    else if (token == token_t::kEndArray)
+      parser_state = parser_state_t::kExpectObjectSeparator;
+    else
+      fail("',' or ']' expected");
+    break;
+  case parser_state_t::kExpectObjectSeparator:
+    if (token == token_t::kComma)
+      parser_state = parser_state_t::kExpectKey;
+    else if (token == token_t::kEndObject)
+      on_entry_end();
+    else
+      fail("',' or '}' expected");
+    break;
+  case parser_state_t::kExpectArraySeparator:
+    if (token == token_t::kComma)
+      parser_state = parser_state_t::kExpectObject;
+    else if (token == token_t::kEndArray)
+      parser_state = parser_state_t::kDone;
+    else
+      fail("',' or ']' expected");
+    break;
+  case parser_state_t::kDone:fail("unexpected data after the end of manifest");
+  }
+}
+
+void rm_manifest_parser::on_value(token_t token) {
+  if (current_key == "p") {
+    if (token != token_t::kString)
+      fail("\"p\" must be a string");
+    current_path.swap(token_value);
+    current_fields |= kFieldPath;
+  } else if (current_key == "c") {
+    if (token != token_t::kLiteral || token_value == "null")
+      fail("\"c\" must be a boolean");
+    current_entry.compressed = token_value == "true";
+    current_fields |= kFieldCompressed;
+  } else if (current_key == "s") {
+    current_entry.size = parse_unsigned(current_key);
+    current_fields |= kFieldSize;
+  } else if (current_key == "h") {
+    current_entry.hash = parse_unsigned(current_key);
+    current_fields |= kFieldHash;
+  } else if (current_key == "cs") {
+    current_entry.compressed_size = parse_unsigned(current_key);
+    current_fields |= kFieldCompressedSize;
+  } else if (current_key == "ch") {
+    current_entry.compressed_hash = parse_unsigned(current_key);
+    current_fields |= kFieldCompressedHash;
+  } else if (current_key == "a") {
+    auto algorithm = parse_unsigned(current_key);
+    if (!common::is_hash_algorithm_supported(algorithm))
+      fail("unsupported hash algorithm " + std::to_string(algorithm));
+    current_entry.hash_algorithm = static_cast<common::hash_algorithm_t>(algorithm);
+  }
+}
+
+void rm_manifest_parser::on_entry_end() {
+  constexpr uint32_t required_fields = kFieldPath | kFieldSize | kFieldHash | kFieldCompressed;
+  constexpr uint32_t required_compressed_fields = kFieldCompressedSize | kFieldCompressedHash;
+  if ((current_fields & required_fields) != required_fields)
+    fail("entry misses one of required keys \"p\", \"s\", \"h\", \"c\"");
+  if (current_entry.compressed) {
+    if ((current_fields & required_compressed_fields) != required_compressed_fields)
+      fail("compressed entry misses one of required keys \"cs\", \"ch\"");
+  } else {
+    current_entry.compressed_size = 0;
+    current_entry.compressed_hash = 0;
+  }
+#ifndef WIN32
+  std::replace(current_path.begin(), current_path.end(), '\\', '/');
+#endif
+  current_entry.relative_path = current_path;
+  ++parsed_entries_count;
+  parser_state = parser_state_t::kExpectArraySeparator;
+  callback(std::move(current_entry));
+}
+
+void rm_manifest_parser::append_code_point(uint32_t code_point) {
+  if (code_point < 0x80) {
+    token_value += static_cast<char>(code_point);
+  } else if (code_point < 0x800) {
+    token_value += static_cast<char>(0xC0 | (code_point >> 6));
+    token_value += static_cast<char>(0x80 | (code_point & 0x3F));
+  } else if (code_point < 0x10000) {
+    token_value += static_cast<char>(0xE0 | (code_point >> 12));
+    token_value += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+    token_value += static_cast<char>(0x80 | (code_point & 0x3F));
+  } else {
+    token_value += static_cast<char>(0xF0 | (code_point >> 18));
+    token_value += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+    token_value += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+    token_value += static_cast<char>(0x80 | (code_point & 0x3F));
+  }
+}
+
+uint64_t rm_manifest_parser::parse_unsigned(std::string_view key) const {
+  uint64_t ret = 0;
+  auto begin = token_value.data();
+  auto end = begin + token_value.size();
+  auto result = std::from_chars(begin, end, ret);
+  if (result.ec != std::errc() || result.ptr != end)
+    fail("\"" + std::string(key) + "\" must be an unsigned integer");
+  return ret;
+}
+
+void rm_manifest_parser::fail(const std::string &reason) const {
+  throw std::runtime_error("Malformed manifest near byte " + std::to_string(consumed_bytes + chunk_position) + ": " + reason);
+}
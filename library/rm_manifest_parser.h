@@ -0,0 +1,118 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <functional>
+
+#include "rm_entry.h"
+
+// Incremental (push) parser of rm_files_data.json.
+// Bytes can be fed in arbitrary chunks, e.g. straight from a CURL write callback, and every manifest record is
+// emitted as soon as its closing brace is seen, so neither the raw document nor a JSON DOM is kept in memory.
+// Unknown keys are skipped, including nested arrays and objects.
+class rm_manifest_parser {
+public:
+  using entry_callback_t = std::function<void(rm_entry &&entry)>;
+
+  explicit rm_manifest_parser(entry_callback_t callback);
+
+  void feed(const char *data, size_t size);
+  void finish(); // throws if the document is incomplete
+  void reset();
+
+  size_t get_parsed_entries_count() const;
+private:
+  enum class token_t {
+    kBeginArray,
+    kEndArray,
+    kBeginObject,
+    kEndObject,
+    kColon,
+    kComma,
+    kString,
+    kNumber,
+    kLiteral
+  };
+
+  enum class lexer_state_t {
+    kIdle,
+    kString,
+    kStringEscape,
+    kStringUnicode,
+    kNumber,
+    kLiteral
+  };
+
+  enum class parser_state_t {
+    kExpectArray,
+    kExpectObjectOrEnd,
+    kExpectObject,
+    kExpectKeyOrEnd,
+    kExpectKey,
+    kExpectColon,
+    kExpectValue,
+    kSkipValue,
+    kExpectBlockHashOrEnd,
+    kExpectBlockHash,
+    kExpectBlockHashSeparator,
+    kExpectObjectSeparator,
+    kExpectArraySeparator,
+    kDone
+  };
+
+  enum field_t : uint32_t {
+    kFieldPath = 1 << 0,
+    kFieldSize = 1 << 1,
+    kFieldHash = 1 << 2,
+    kFieldCompressed = 1 << 3,
+    kFieldCompressedSize = 1 << 4,
+    kFieldCompressedHash = 1 << 5,
+  };
+
+  entry_callback_t callback;
+
+  lexer_state_t lexer_state = lexer_state_t::kIdle;
+  std::string token_value;
+  uint32_t unicode_code_unit = 0;
+  uint32_t unicode_digits_count = 0;
+  uint32_t pending_high_surrogate = 0;
+
+  parser_state_t parser_state = parser_state_t::kExpectArray;
+  size_t skip_depth = 0;
+  std::string current_key;
+  rm_entry current_entry;
+  std::string current_path;
+  uint32_t current_fields = 0;
+
+  size_t parsed_entries_count = 0;
+  uint64_t consumed_bytes = 0;
+  size_t chunk_position = 0;
+
+  void on_token(token_t token);
+  void on_value(token_t token);
+  void on_entry_end();
+  void flush_pending_token();
+  void append_code_point(uint32_t code_point);
+  uint64_t parse_unsigned(std::string_view key) const;
+  [[noreturn]] void fail(const std::string &reason) const;
+};
@@ -0,0 +1,96 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "rm_path_index.h"
+
+void rm_path_index::build(const rm_entry_table &entries) {
+  table = &entries;
+  entries_count = 0;
+  slots.clear();
+  rehash(entries.size());
+  for (rm_entry_table::id_t id = 0; id < entries.size(); ++id) {
+    add(id);
+  }
+}
+
+void rm_path_index::add(rm_entry_table::id_t id) {
+  if ((entries_count + 1) * 2 > slots.size())
+    rehash(slots.size());
+  insert(hash(table->get_path(id)), id);
+  ++entries_count;
+}
+
+void rm_path_index::clear() {
+  table = nullptr;
+  slots.clear();
+  entries_count = 0;
+}
+
+std::optional<rm_entry_table::id_t> rm_path_index::find(std::string_view relative_path) const {
+  if (slots.empty())
+    return std::nullopt;
+  auto path_hash = hash(relative_path);
+  auto mask = slots.size() - 1;
+  for (auto i = static_cast<size_t>(path_hash) & mask;; i = (i + 1) & mask) {
+    auto slot = slots[i];
+    if (slot == 0)
+      return std::nullopt;
+    auto id = static_cast<rm_entry_table::id_t>((slot & UINT32_MAX) - 1);
+    if ((slot >> 32) == (path_hash >> 32) && table->get_path(id) == relative_path)
+      return id;
+  }
+}
+
+bool rm_path_index::contains(std::string_view relative_path) const {
+  return find(relative_path).has_value();
+}
+
+uint64_t rm_path_index::hash(std::string_view relative_path) {
+  // std::hash may be 32-bit wide, spread it so the slot position and the stored tag use different bits
+  uint64_t ret = std::hash<std::string_view>{}(relative_path);
+  ret ^= ret >> 33;
+  ret *= 0xff51afd7ed558ccdULL;
+  ret ^= ret >> 33;
+  return ret;
+}
+
+void rm_path_index::insert(uint64_t path_hash, rm_entry_table::id_t id) {
+  auto mask = slots.size() - 1;
+  auto i = static_cast<size_t>(path_hash) & mask;
+  while (slots[i] != 0)
+    i = (i + 1) & mask;
+  slots[i] = (path_hash & ~static_cast<uint64_t>(UINT32_MAX)) | (static_cast<uint64_t>(id) + 1);
+}
+
+void rm_path_index::rehash(size_t entries_capacity) {
+  size_t capacity = 16;
+  while (capacity < entries_capacity * 2 + 2)
+    capacity *= 2;
+  auto old_slots = std::move(slots);
+  slots.assign(capacity, 0);
+  for (auto slot : old_slots) {
+    if (slot == 0)
+      continue;
+    auto id = static_cast<rm_entry_table::id_t>((slot & UINT32_MAX) - 1);
+    insert(hash(table->get_path(id)), id);
+  }
+}
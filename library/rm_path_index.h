@@ -0,0 +1,46 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "rm_entry_table.h"
+
+// Open-addressing hash index from a normalized ('/'-separated) relative path to its rm_entry_table id.
+// Slots keep only the id and a part of the path hash, paths themselves are compared in the table arena, so the
+// index stays valid while entries are appended through add(). Rebuild it after the table is cleared or compacted.
+class rm_path_index {
+public:
+  void build(const rm_entry_table &table);
+  void add(rm_entry_table::id_t id); // the id must belong to the indexed table
+  void clear();
+
+  std::optional<rm_entry_table::id_t> find(std::string_view relative_path) const;
+  bool contains(std::string_view relative_path) const;
+private:
+  const rm_entry_table *table = nullptr;
+  std::vector<uint64_t> slots; // (hash high bits << 32) | (id + 1), 0 is an empty slot
+  size_t entries_count = 0;
+
+  static uint64_t hash(std::string_view relative_path);
+  void insert(uint64_t path_hash, rm_entry_table::id_t id);
+  void rehash(size_t capacity);
+};
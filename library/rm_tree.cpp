@@ -22,7 +22,10 @@
 
 #include "rm_tree.h"
 #include "deferred_function.hpp"
+#include "rm_manifest_parser.h"
 #include <common.hpp>
+#include <mapped_file.hpp>
+#include <charconv>
 
 rm_tree::rm_tree(std::filesystem::path base_path)
     : base_path(std::move(base_path)) {
@@ -40,14 +43,19 @@ rm_tree::rm_tree(std::filesystem::path base_path)
 }
 
 rm_tree::rm_tree(const rm_tree &tree)
-    : base_path(tree.base_path), cdns(tree.cdns) {
+    : cdns(tree.cdns), change_journal(tree.change_journal), base_path(tree.base_path), state_name(tree.state_name) {
   worker.current_cdn = cdns.cend();
+  // dependencies are copied again whenever the dependencies vector grows, they must keep their state directory
+  // and the journal their changes are collected in
   // Only root project can have dependencies, so don't copy them
   // This is a copy constructor which gets called only within add_dependency function
   // After any task has started, an app can't add new dependencies for safety reasons
 }
 
 rm_tree::~rm_tree() {
+  worker.deep_check_data.force_stop = true;
+  worker.process_data.force_stop = true;
+  deep_checker_release();
   if (worker.self != nullptr) {
     if (worker.self->joinable()) {
       worker.process_data.force_stop = true;
@@ -73,7 +81,13 @@ error_code_t rm_tree::add_dependency(const rm_tree &dependency) {
     return kCannotWhenWorking;
   if (worker.last_state != worker_mode_t::kNone)
     return kCannotAfterStarted;
-  dependencies.emplace_back(dependency).base_path = base_path;
+  auto &added_dependency = dependencies.emplace_back(dependency);
+  added_dependency.base_path = base_path;
+  added_dependency.state_name = "dependency_" + std::to_string(dependencies.size() - 1);
+  added_dependency.change_journal = change_journal;
+  // the name is fixed by now (see the copy constructor), so its key is registered once
+  if (change_journal != nullptr)
+    change_journal->add_key(added_dependency.state_name);
   return kNoError;
 }
 
@@ -82,8 +96,8 @@ error_code_t rm_tree::add_dependency(const rm_tree &dependency) {
 error_code_t rm_tree::fetch_updates() {
   if (is_working())
     return kCannotWhenWorking;
-  items.clear();
   worker.pending_download_items.clear();
+  worker.deep_check_findings.clear();
   worker.worker_error.reset();
   worker.current_state = worker_mode_t::kFetching;
   summon_worker(updates_fetcher_worker);
@@ -110,10 +124,10 @@ error_code_t rm_tree::stop_fetching() {
 // Downloader
 
 error_code_t rm_tree::download() {
-  if (is_working())
+  if (worker.current_state != worker_mode_t::kNone) // downloads may run along with the hashing tier of a check
     return kCannotWhenWorking;
 
-  if (get_pending_download_files_count() <= 0)
+  if (get_pending_download_files_count() <= 0 && !deep_checking())
     return kCannotWhenNothingToDownload;
 
   worker.worker_error.reset();
@@ -139,13 +153,26 @@ error_code_t rm_tree::stop_download() {
   return kNoError;
 }
 
+error_code_t rm_tree::set_download_concurrency(size_t min_count, size_t max_count) {
+  if (is_working())
+    return kCannotWhenWorking;
+  min_download_jobs_count = std::max<size_t>(min_count, 1);
+  max_download_jobs_count = std::max(max_count, min_download_jobs_count);
+  return kNoError;
+}
+
+size_t rm_tree::get_download_concurrency() const {
+  return worker.process_data.download_jobs_limit;
+}
+
 // Checker
 
-error_code_t rm_tree::check() {
+error_code_t rm_tree::check(bool full) {
   if (is_working())
     return kCannotWhenWorking;
 
   worker.worker_error.reset();
+  worker.process_data.full_check = full;
   worker.current_state = worker_mode_t::kChecking;
   summon_worker(check_worker);
   return kNoError;
@@ -160,14 +187,91 @@ bool rm_tree::checked() const {
 }
 
 error_code_t rm_tree::stop_check() {
-  if (!checking())
+  if (!checking() && !deep_checking())
     return kCannotWhenNotWorking;
 
-  worker.process_data.force_stop = true;
+  worker.deep_check_data.force_stop = true;
+  if (checking())
+    worker.process_data.force_stop = true;
 //  while (checking()); // spinlock
   return kNoError;
 }
 
+error_code_t rm_tree::set_check_threads_count(size_t count) {
+  if (is_working())
+    return kCannotWhenWorking;
+  check_threads_count = count;
+  return kNoError;
+}
+
+bool rm_tree::deep_checking() const {
+  return worker.deep_checking;
+}
+
+uint64_t rm_tree::get_deep_check_total_work_amount() const {
+  return worker.deep_check_data.total_work_amount;
+}
+
+uint64_t rm_tree::get_deep_check_completed_work_amount() const {
+  return worker.deep_check_data.processed_work_amount;
+}
+
+// Pipeline
+
+error_code_t rm_tree::sync() {
+  if (is_working())
+    return kCannotWhenWorking;
+  worker.pending_download_items.clear();
+  worker.deep_check_findings.clear();
+  worker.worker_error.reset();
+  worker.syncing = true;
+  worker.current_state = worker_mode_t::kFetching;
+  summon_worker(sync_worker);
+  return kNoError;
+}
+
+bool rm_tree::syncing() const {
+  return worker.syncing;
+}
+
+error_code_t rm_tree::stop_sync() {
+  if (!syncing())
+    return kCannotWhenNotWorking;
+
+  worker.process_data.force_stop = true;
+  worker.deep_check_data.force_stop = true;
+  return kNoError;
+}
+
+// Change watcher
+
+error_code_t rm_tree::start_watching() {
+  if (is_working())
+    return kCannotWhenWorking;
+  if (change_journal == nullptr) {
+    change_journal = std::make_shared<rm_change_journal>(base_path);
+    change_journal->add_key(state_name);
+    for (auto &dependency : dependencies) {
+      dependency.change_journal = change_journal;
+      change_journal->add_key(dependency.state_name);
+    }
+  }
+  return change_journal->start() ? kNoError : kCannotWatchChanges;
+}
+
+bool rm_tree::watching() const {
+  return change_journal != nullptr && change_journal->watching();
+}
+
+error_code_t rm_tree::stop_watching() {
+  if (is_working())
+    return kCannotWhenWorking;
+  if (!watching())
+    return kCannotWhenNotWorking;
+  change_journal->stop();
+  return kNoError;
+}
+
 // Remover modifications
 
 error_code_t rm_tree::remove_modifications() {
@@ -264,22 +368,27 @@ uint64_t rm_tree::get_completed_work_amount() {
 // Helpers
 
 bool rm_tree::is_working() const {
-  return worker.current_state != worker_mode_t::kNone;
+  return worker.current_state != worker_mode_t::kNone || worker.deep_checking;
 }
 
-std::filesystem::path rm_tree::get_entry_full_path(const rm_entry &entry) const {
-  return base_path / entry.relative_path;
+std::filesystem::path rm_tree::get_entry_full_path(rm_entry_table::id_t id) const {
+  return base_path / items.get_path(id);
 }
 
 void rm_tree::summon_worker(rm_tree::worker_t worker_fn) {
   if (worker_fn == nullptr)
     return;
   worker_release();
-  worker.self = new std::thread(worker_fn, std::ref(*this), nullptr);
+  worker.process_data.force_stop = false; // a stopped task can be started again
+  worker.self = new std::thread([this, worker_fn]() {
+    worker_fn(*this, nullptr);
+    worker.last_state = worker.current_state.load();
+    worker.current_state = worker_mode_t::kNone;
+  });
 }
 
 void rm_tree::worker_release() {
-  if (is_working() || worker.self == nullptr)
+  if (worker.current_state != worker_mode_t::kNone || worker.self == nullptr)
     return;
   if (worker.self->joinable())
     worker.self->join();
@@ -287,6 +396,15 @@ void rm_tree::worker_release() {
   worker.self = nullptr;
 }
 
+void rm_tree::deep_checker_release() {
+  if (worker.deep_checker == nullptr)
+    return;
+  if (worker.deep_checker->joinable())
+    worker.deep_checker->join();
+  delete worker.deep_checker;
+  worker.deep_checker = nullptr;
+}
+
 rm_tree::cdns_const_iterator rm_tree::get_current_cdn(uint64_t offset) {
   static std::mutex mtx;
   std::scoped_lock lock(mtx);
@@ -322,30 +440,114 @@ rm_tree::cdns_const_iterator rm_tree::get_current_cdn(uint64_t offset) {
   return current_cdn;
 }
 
-std::string rm_tree::fetch_url_path_content(const std::string &path) {
-  auto error_code = CURL_LAST;
+std::optional<std::string> rm_tree::fetch_url_path_content(const std::string &path, bool allow_missing) {
   std::string ret;
+  fetch_sink_t sink;
+  sink.reset = [&]() { ret.clear(); };
+  sink.reserve = [&](uint64_t size) { ret.reserve(size); };
+  sink.write = [&](const char *data, size_t size) { ret.append(data, size); };
+  fetch_options_t options;
+  options.allow_missing = allow_missing;
+  if (fetch_url_path(path, sink, options) == fetch_status_t::kMissing)
+    return std::nullopt;
+  return ret;
+}
+
+rm_tree::fetch_status_t rm_tree::fetch_url_path(const std::string &path,
+                                                const fetch_sink_t &sink,
+                                                const fetch_options_t &options,
+                                                fetch_validators_t *validators) {
+  struct fetch_context_t {
+    const fetch_sink_t *sink = nullptr;
+    CURL *ch = nullptr;
+    bool is_http = false;
+    bool response_checked = false;
+    bool passthrough = false;
+    std::string error_body;
+    std::exception_ptr exception;
+    fetch_validators_t validators;
+  };
+  auto header_fn = +[](char *buffer, size_t size, size_t nitems, void *userp) -> size_t {
+    auto &validators = reinterpret_cast<fetch_context_t *>(userp)->validators;
+    auto length = size * nitems;
+    std::string_view line(buffer, length);
+    if (line.rfind("HTTP/", 0) == 0) {
+      validators = {}; // status line of a new response, e.g. after a redirect
+      return length;
+    }
+    auto header = parse_header_line(line);
+    if (!header.has_value())
+      return length;
+    auto &[key, value] = *header;
+    if (key == "etag")
+      validators.etag = value;
+    else if (key == "last-modified")
+      validators.last_modified = value;
+    return length;
+  };
   auto write_fn = +[](void *contents, size_t size, size_t nmemb, void *userp) -> size_t {
+    auto context = reinterpret_cast<fetch_context_t *>(userp);
     auto downloaded_size = size * nmemb;
-    reinterpret_cast<decltype(&ret)>(userp)->append(reinterpret_cast<char *>(contents), downloaded_size);
     L_VERBOSE(1, "Fetch URL path content process: {}", downloaded_size);
+    if (!context->response_checked) {
+      // don't let error pages reach the sink, keep them for the error message instead
+      context->response_checked = true;
+      long response_code = 0;
+      if (context->is_http)
+        curl_easy_getinfo(context->ch, CURLINFO_RESPONSE_CODE, &response_code);
+      context->passthrough = !context->is_http || response_code == 200;
+      curl_off_t content_length = -1;
+      curl_easy_getinfo(context->ch, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+      if (context->passthrough && content_length > 0 && context->sink->reserve)
+        context->sink->reserve(static_cast<uint64_t>(content_length));
+    }
+    if (!context->passthrough) {
+      constexpr size_t max_error_body_size = 4096;
+      if (context->error_body.size() < max_error_body_size)
+        context->error_body.append(reinterpret_cast<char *>(contents),
+                                   std::min(downloaded_size, max_error_body_size - context->error_body.size()));
+      return downloaded_size;
+    }
+    try {
+      context->sink->write(reinterpret_cast<char *>(contents), downloaded_size);
+    } catch (...) {
+      // exceptions must not cross CURL frames, rethrow them after curl_easy_perform instead
+      context->exception = std::current_exception();
+      return 0;
+    }
     return downloaded_size;
   };
+  auto error_code = CURL_LAST;
   const auto max_fails_count = 3;
   auto fails_count = 0;
   while (error_code != CURLE_OK) {
     auto cdn = get_current_cdn();
-    auto init = cdn->easy_init(path);
+    std::vector<std::string> extra_headers;
+    if (!options.conditional.etag.empty())
+      extra_headers.emplace_back("If-None-Match: " + options.conditional.etag);
+    if (!options.conditional.last_modified.empty())
+      extra_headers.emplace_back("If-Modified-Since: " + options.conditional.last_modified);
+    auto init = cdn->easy_init(path, extra_headers);
     auto is_http = cdn->is_http();
     auto &ch = init.ch;
     if (ch == nullptr)
       throw std::runtime_error("Could not initialize CURL channel");
 
-    ret.clear();
+    fetch_context_t context;
+    context.sink = &sink;
+    context.ch = ch;
+    context.is_http = is_http;
+    if (sink.reset)
+      sink.reset();
     curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, write_fn);
-    curl_easy_setopt(ch, CURLOPT_WRITEDATA, &ret);
+    curl_easy_setopt(ch, CURLOPT_WRITEDATA, &context);
+    if (is_http) {
+      curl_easy_setopt(ch, CURLOPT_HEADERFUNCTION, header_fn);
+      curl_easy_setopt(ch, CURLOPT_HEADERDATA, &context);
+    }
     error_code = curl_easy_perform(ch);
-    curl_easy_cleanup(ch);
+    if (context.exception)
+      std::rethrow_exception(context.exception);
 
     std::string error_str;
     deferred_function def_error([&]() {
@@ -355,32 +557,30 @@ std::string rm_tree::fetch_url_path_content(const std::string &path) {
     });
     long response_code = 0;
     error_code_t indexed_error_code = kNoError;
-    switch (error_code) {
-    case CURLE_OK:curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &response_code);
-      break;
-    case CURLE_COULDNT_RESOLVE_PROXY:error_str = "Couldn't resolve proxy.";
-      indexed_error_code = kCouldNotResolveProxy;
-      break;
-    case CURLE_COULDNT_RESOLVE_HOST:error_str = "Couldn't resolve host.";
-      indexed_error_code = kCouldNotResolveHost;
-      break;
-    case CURLE_COULDNT_CONNECT:error_str = "Couldn't connect to host.";
-      indexed_error_code = kCouldNotConnectToHost;
-      break;
-    case CURLE_REMOTE_ACCESS_DENIED:error_str = "Couldn't connect to host: remote access denied.";
-      indexed_error_code = kCouldNotConnectToHostRemoteAccessDenied;
-      break;
-    default:error_str = "Unknown CURL error: " + std::to_string(error_code) + ".";
-      indexed_error_code = kUnknownCurlError;
-      break;
-    }
+    if (error_code == CURLE_OK)
+      curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &response_code);
+    else
+      indexed_error_code = get_curl_error(error_code, error_str);
 
     const char *url = nullptr;
     curl_easy_getinfo(ch, CURLINFO_EFFECTIVE_URL, &url);
 
+    if (options.allow_missing && is_missing_file_response(error_code, is_http, response_code)) {
+      L_INFO("Optional url path is missing on CDN: {}", url != nullptr ? url : path);
+      error_str.clear();
+      return fetch_status_t::kMissing;
+    }
+
+    if (error_code == CURLE_OK && is_http && response_code == 304 && !options.conditional.empty()) {
+      L_INFO("Url path content is not modified: {}", url != nullptr ? url : path);
+      if (validators != nullptr)
+        *validators = options.conditional;
+      return fetch_status_t::kNotModified;
+    }
+
     if (error_code == CURLE_OK && is_http && response_code != 200) {
       error_str = "The request was proceeded correctly, but host returned an unknown HTTP code: "
-          + std::to_string(response_code) + ". Remote response body: " + ret;
+          + std::to_string(response_code) + ". Remote response body: " + context.error_body;
       error_code = CURL_LAST;
       indexed_error_code = kUnknownHttpCodeResponse;
     }
@@ -401,28 +601,833 @@ std::string rm_tree::fetch_url_path_content(const std::string &path) {
         throw indexed_error(indexed_error_code, error_str);
       }
     }
+    if (!has_error && validators != nullptr)
+      *validators = std::move(context.validators);
   }
-  return ret;
+  return fetch_status_t::kFetched;
+}
+
+void rm_tree::fetch_url_paths(const std::vector<std::string> &paths,
+                              const std::function<void(size_t index, std::string &&content)> &on_fetched,
+                              const std::atomic_bool &force_stop) {
+  struct transfer_t {
+    size_t index;
+    size_t fails_count;
+    bool is_http;
+    std::string content;
+    rm_cdn::easy_init_t init;
+  };
+  auto write_fn = +[](void *contents, size_t size, size_t nmemb, void *userp) -> size_t {
+    auto downloaded_size = size * nmemb;
+    reinterpret_cast<transfer_t *>(userp)->content.append(reinterpret_cast<char *>(contents), downloaded_size);
+    return downloaded_size;
+  };
+
+  auto curlm = rm_cdn::multi_init();
+  if (curlm == nullptr)
+    throw std::runtime_error("Could not initialize curl multi handle");
+  std::vector<std::unique_ptr<transfer_t>> transfers;
+  deferred_function scoped_curlm([&]() {
+    transfers.clear(); // handles have to leave the multi handle before it's gone
+    curl_multi_cleanup(curlm);
+  });
+
+  std::deque<std::pair<size_t, size_t>> queue; // index and fails count of paths waiting for a free slot
+  for (size_t i = 0; i < paths.size(); ++i) {
+    queue.emplace_back(i, 0);
+  }
+  while (!queue.empty() || !transfers.empty()) {
+    while (!queue.empty() && transfers.size() < kParallelFetchesCount) {
+      auto cdn = get_current_cdn();
+      auto &transfer = transfers.emplace_back(std::make_unique<transfer_t>());
+      std::tie(transfer->index, transfer->fails_count) = queue.front();
+      queue.pop_front();
+      transfer->is_http = cdn->is_http();
+      transfer->init = cdn->easy_init(paths[transfer->index]);
+      if (transfer->init.ch == nullptr)
+        throw std::runtime_error("Could not initialize CURL channel");
+      curl_easy_setopt(transfer->init.ch, CURLOPT_WRITEFUNCTION, write_fn);
+      curl_easy_setopt(transfer->init.ch, CURLOPT_WRITEDATA, transfer.get());
+      curl_easy_setopt(transfer->init.ch, CURLOPT_PRIVATE, transfer.get());
+      transfer->init.link_to_curlm(curlm);
+    }
+
+    int still_running = 0;
+    auto mc = curl_multi_perform(curlm, &still_running);
+    if (mc == CURLM_OK)
+      mc = curl_multi_wait(curlm, nullptr, 0, 300, nullptr);
+    if (mc != CURLM_OK)
+      throw std::runtime_error("Unknown CURLM error: " + std::to_string(mc));
+    if (force_stop)
+      throw indexed_error(kForceStoppedProcess, "Force stopped updates fetcher");
+
+    int msgs_left = 0;
+    while (auto msg = curl_multi_info_read(curlm, &msgs_left)) {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+      auto ch = msg->easy_handle;
+      auto error_code = msg->data.result;
+      char *private_data = nullptr;
+      curl_easy_getinfo(ch, CURLINFO_PRIVATE, &private_data);
+      auto transfer = std::find_if(transfers.begin(), transfers.end(), [&](const std::unique_ptr<transfer_t> &item) {
+        return item.get() == reinterpret_cast<transfer_t *>(private_data);
+      });
+      if (transfer == transfers.end())
+        continue;
+
+      std::string error_str;
+      error_code_t indexed_error_code = kNoError;
+      long response_code = 0;
+      if (error_code == CURLE_OK)
+        curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &response_code);
+      else
+        indexed_error_code = get_curl_error(error_code, error_str);
+      if (error_code == CURLE_OK && (*transfer)->is_http && response_code != 200) {
+        error_str = "The request was proceeded correctly, but host returned an unknown HTTP code: "
+            + std::to_string(response_code) + ".";
+        indexed_error_code = kUnknownHttpCodeResponse;
+      }
+      if (!error_str.empty()) {
+        const char *url = nullptr;
+        curl_easy_getinfo(ch, CURLINFO_EFFECTIVE_URL, &url);
+        error_str += " Problematic URL path was: ";
+        error_str += url != nullptr ? url : "Unknown url";
+      }
+
+      auto index = (*transfer)->index;
+      auto fails_count = (*transfer)->fails_count;
+      auto content = std::move((*transfer)->content);
+      std::swap(*transfer, transfers.back());
+      transfers.pop_back();
+
+      if (error_str.empty()) {
+        on_fetched(index, std::move(content));
+        continue;
+      }
+      L_ERROR("Error during fetching url paths: {}", error_str);
+      worker.current_cdn_errors_count = kMaxCdnErrorsCount + 1;
+      if (++fails_count >= kMaxFetchFailsCount) {
+        error_str += " Couldn't receive data " + std::to_string(fails_count) + " times.";
+        if (indexed_error_code == kNoError)
+          throw std::runtime_error(error_str);
+        throw indexed_error(indexed_error_code, error_str);
+      }
+      queue.emplace_back(index, fails_count);
+    }
+  }
+}
+
+error_code_t rm_tree::get_curl_error(CURLcode error_code, std::string &error_str) {
+  switch (error_code) {
+  case CURLE_COULDNT_RESOLVE_PROXY:error_str = "Couldn't resolve proxy.";
+    return kCouldNotResolveProxy;
+  case CURLE_COULDNT_RESOLVE_HOST:error_str = "Couldn't resolve host.";
+    return kCouldNotResolveHost;
+  case CURLE_COULDNT_CONNECT:error_str = "Couldn't connect to host.";
+    return kCouldNotConnectToHost;
+  case CURLE_REMOTE_ACCESS_DENIED:error_str = "Couldn't connect to host: remote access denied.";
+    return kCouldNotConnectToHostRemoteAccessDenied;
+  default:error_str = "Unknown CURL error: " + std::to_string(error_code) + ".";
+    return kUnknownCurlError;
+  }
+}
+
+bool rm_tree::is_missing_file_response(CURLcode error_code, bool is_http, long response_code) {
+  if (error_code == CURLE_FILE_COULDNT_READ_FILE || error_code == CURLE_REMOTE_FILE_NOT_FOUND)
+    return true;
+  return error_code == CURLE_OK && is_http && (response_code == 404 || response_code == 410);
+}
+
+rm_tree::fetch_status_t rm_tree::fetch_compressed_url_path(const std::string &path,
+                                                           const fetch_sink_t &content_sink,
+                                                           const fetch_options_t &options,
+                                                           fetch_validators_t *validators) {
+  common::stream_decompressor decompressor;
+  auto dictionary_path = get_state_path() / common::kManifestDictionaryFilename;
+  if (is_regular_file(dictionary_path)) {
+    auto dictionary = common::read_file(dictionary_path);
+    decompressor.load_dictionary(dictionary.data(), dictionary.size());
+  }
+  fetch_sink_t sink;
+  sink.reset = [&]() {
+    decompressor.reset();
+    if (content_sink.reset)
+      content_sink.reset();
+  };
+  // no reserve: content length is the compressed one
+  sink.write = [&](const char *chunk, size_t size) {
+    decompressor.decompress(chunk, size, [&](const char *data, size_t data_size) {
+      content_sink.write(data, data_size);
+    });
+  };
+
+  fetch_status_t status;
+  try {
+    status = fetch_url_path(path, sink, options, validators);
+  } catch (const common::zstd_dictionary_error &) {
+    L_INFO("{} is compressed with an unknown dictionary, fetching it", path);
+    auto dictionary = fetch_manifest_dictionary();
+    decompressor.reset();
+    decompressor.load_dictionary(dictionary.data(), dictionary.size());
+    status = fetch_url_path(path, sink, options, validators);
+  }
+  if (status == fetch_status_t::kFetched)
+    decompressor.finish();
+  return status;
+}
+
+std::filesystem::path rm_tree::get_state_path() const {
+  return base_path / common::kStateDirectoryName / state_name;
+}
+
+// Fetcher helpers
+
+std::vector<rm_tree::manifest_variant_t> rm_tree::get_manifest_variants() {
+  std::string binary_path = common::binary_manifest::kFilename;
+  std::string json_path = common::kResourcesDataFilename;
+  return {
+      {common::kManifestShardsFilename, true, true, true, true},
+      {binary_path + common::kCompressedManifestSuffix, true, true, true},
+      {binary_path, true, false, true},
+      {json_path + common::kCompressedManifestSuffix, false, true, true},
+      {json_path, false, false, false},
+  };
+}
+
+void rm_tree::update_manifest(const std::atomic_bool &force_stop) {
+  auto cache_info = load_manifest_cache_info();
+  auto version = fetch_manifest_version();
+  auto variants = get_manifest_variants();
+  try {
+    if (version != 0 && cache_info.has_value() && cache_info->version != 0 && cache_info->version <= version
+        && version - cache_info->version <= kMaxManifestDeltaChainLength) {
+      if (update_manifest_with_deltas(*cache_info, version, force_stop))
+        return;
+    }
+
+    if (cache_info.has_value()) {
+      // ask for the cached variant first, so an unchanged manifest costs a single 304
+      auto cached_variant = std::find_if(variants.begin(), variants.end(), [&](const manifest_variant_t &variant) {
+        return variant.path == cache_info->variant_path;
+      });
+      if (cached_variant != variants.end())
+        std::rotate(variants.begin(), cached_variant, cached_variant + 1);
+      else
+        cache_info.reset();
+    }
+
+    for (auto &variant : variants) {
+      fetch_validators_t conditional;
+      if (cache_info.has_value() && variant.path == cache_info->variant_path)
+        conditional = cache_info->validators;
+      fetch_validators_t validators;
+      auto status = fetch_manifest(variant, conditional, validators, force_stop);
+      if (status == fetch_status_t::kNotModified) {
+        if (loaded_manifest == cache_info || load_cached_manifest(*cache_info)) {
+          L_INFO("Manifest is not modified, keeping {} loaded entries", items.size());
+          if (cache_info->version != version) {
+            cache_info->version = version;
+            store_manifest_cache(*cache_info);
+          }
+          return;
+        }
+        // the cache is unusable, ask for the whole manifest again
+        status = fetch_manifest(variant, {}, validators, force_stop);
+      }
+      if (status == fetch_status_t::kMissing)
+        continue;
+
+      manifest_cache_info_t info;
+      info.variant_path = variant.path;
+      info.validators = std::move(validators);
+      info.version = version;
+      store_manifest_cache(std::move(info));
+      return;
+    }
+  } catch (...) {
+    items.clear();
+    loaded_manifest.reset();
+    throw;
+  }
+  throw std::runtime_error("Could not fetch manifest: none of its variants is usable");
+}
+
+rm_tree::fetch_status_t rm_tree::fetch_manifest(const manifest_variant_t &variant,
+                                                const fetch_validators_t &conditional,
+                                                fetch_validators_t &validators,
+                                                const std::atomic_bool &force_stop) {
+  if (variant.sharded)
+    return fetch_sharded_manifest(variant, conditional, validators, force_stop);
+  std::string binary_data;
+  rm_manifest_parser parser([&](rm_entry &&entry) {
+    items.add(entry);
+  });
+  // loaded entries go only once a new manifest arrives, a 304 keeps them
+  auto items_cleared = false;
+  fetch_sink_t sink;
+  sink.reset = [&]() {
+    binary_data.clear();
+    parser.reset();
+  };
+  sink.reserve = [&](uint64_t size) {
+    if (variant.binary)
+      binary_data.reserve(size);
+  };
+  sink.write = [&](const char *chunk, size_t size) {
+    if (force_stop)
+      throw indexed_error(kForceStoppedProcess, "Force stopped updates fetcher");
+    if (!items_cleared) {
+      items.clear();
+      loaded_manifest.reset();
+      items_cleared = true;
+    }
+    if (variant.binary)
+      binary_data.append(chunk, size);
+    else
+      parser.feed(chunk, size);
+  };
+
+  fetch_options_t options;
+  options.allow_missing = variant.optional;
+  options.conditional = conditional;
+  auto status = variant.compressed ? fetch_compressed_url_path(variant.path, sink, options, &validators)
+                                   : fetch_url_path(variant.path, sink, options, &validators);
+  if (status != fetch_status_t::kFetched)
+    return status;
+  if (!items_cleared) { // an empty body
+    items.clear();
+    loaded_manifest.reset();
+  }
+
+  if (variant.binary) {
+    common::binary_manifest::view view;
+    if (!view.open(binary_data.data(), binary_data.size())) {
+      L_WARN("Manifest {} is malformed or has unsupported version, skipping it", variant.path);
+      items.clear();
+      return fetch_status_t::kMissing;
+    }
+    items.clear();
+    items.reserve(view.size(), binary_data.size());
+    for (size_t i = 0; i < view.size(); ++i) {
+      items.add(view.at(i));
+    }
+  } else {
+    parser.finish();
+  }
+  items.sort();
+  L_INFO("Fetched {} manifest entries from {}", items.size(), variant.path);
+  return fetch_status_t::kFetched;
+}
+
+rm_tree::fetch_status_t rm_tree::fetch_sharded_manifest(const manifest_variant_t &variant,
+                                                        const fetch_validators_t &conditional,
+                                                        fetch_validators_t &validators,
+                                                        const std::atomic_bool &force_stop) {
+  std::string index_data;
+  fetch_sink_t sink;
+  sink.reset = [&]() { index_data.clear(); };
+  sink.write = [&](const char *data, size_t size) { index_data.append(data, size); };
+  fetch_options_t options;
+  options.allow_missing = variant.optional;
+  options.conditional = conditional;
+  auto status = fetch_url_path(variant.path, sink, options, &validators);
+  if (status != fetch_status_t::kFetched)
+    return status;
+
+  items.clear();
+  loaded_manifest.reset();
+  std::vector<std::string> paths;
+  std::vector<size_t> entries_counts;
+  try {
+    auto index_json = nlohmann::json::parse(index_data);
+    for (auto &shard : index_json.at("shards")) {
+      paths.emplace_back(shard.at("path"));
+      entries_counts.emplace_back(shard.at("entries"));
+    }
+  } catch (const std::exception &exc) {
+    L_WARN("Manifest shards index is malformed, skipping it: {}", exc.what());
+    return fetch_status_t::kMissing;
+  }
+
+  // shards are parsed on their own threads as soon as they arrive, while the rest are still downloading
+  std::string dictionary;
+  auto dictionary_path = get_state_path() / common::kManifestDictionaryFilename;
+  if (is_regular_file(dictionary_path))
+    dictionary = common::read_file(dictionary_path);
+  std::vector<std::string> shards(paths.size());
+  auto parse_shard = [&](size_t index) {
+    common::stream_decompressor decompressor;
+    if (!dictionary.empty())
+      decompressor.load_dictionary(dictionary.data(), dictionary.size());
+    std::string data;
+    decompressor.decompress(shards[index].data(), shards[index].size(), [&](const char *chunk, size_t size) {
+      data.append(chunk, size);
+    });
+    decompressor.finish();
+    common::binary_manifest::view view;
+    if (!view.open(data.data(), data.size()) || view.size() != entries_counts[index])
+      throw std::runtime_error("Manifest shard " + paths[index] + " is malformed or doesn't match the index");
+    rm_entry_table ret;
+    ret.reserve(view.size(), data.size());
+    for (size_t i = 0; i < view.size(); ++i) {
+      ret.add(view.at(i));
+    }
+    return ret;
+  };
+  std::vector<std::future<rm_entry_table>> parsed_shards(paths.size());
+  fetch_url_paths(paths, [&](size_t index, std::string &&content) {
+    shards[index] = std::move(content);
+    parsed_shards[index] = std::async(std::launch::async, parse_shard, index);
+  }, force_stop);
+
+  for (auto &parsed_shard : parsed_shards) {
+    parsed_shard.wait(); // nothing may read the dictionary while it's replaced below
+  }
+  std::vector<rm_entry_table> tables;
+  tables.reserve(paths.size());
+  size_t entries_count = 0;
+  auto dictionary_fetched = false;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    try {
+      tables.emplace_back(parsed_shards[i].get());
+    } catch (const common::zstd_dictionary_error &) {
+      if (!dictionary_fetched) {
+        L_INFO("Manifest shard {} is compressed with an unknown dictionary, fetching it", paths[i]);
+        dictionary = fetch_manifest_dictionary();
+        dictionary_fetched = true;
+      }
+      tables.emplace_back(parse_shard(i)); // throws again if the fetched dictionary doesn't fit either
+    }
+    entries_count += tables.back().size();
+  }
+  items.reserve(entries_count);
+  for (auto &table : tables) {
+    for (rm_entry_table::id_t id = 0; id < table.size(); ++id) {
+      items.add(table.at(id));
+    }
+  }
+  items.sort();
+  L_INFO("Fetched {} manifest entries from {} shards", items.size(), paths.size());
+  return fetch_status_t::kFetched;
+}
+
+std::string rm_tree::fetch_manifest_dictionary() {
+  auto dictionary = fetch_url_path_content(common::kManifestDictionaryFilename).value();
+  common::write_file(get_state_path() / common::kManifestDictionaryFilename, dictionary);
+  return dictionary;
+}
+
+uint64_t rm_tree::fetch_manifest_version() {
+  auto content = fetch_url_path_content(common::kManifestVersionFilename, true);
+  if (!content.has_value())
+    return 0;
+  try {
+    return nlohmann::json::parse(*content).at("version");
+  } catch (const std::exception &exc) {
+    L_WARN("Manifest version file is malformed, ignoring it: {}", exc.what());
+    return 0;
+  }
+}
+
+bool rm_tree::update_manifest_with_deltas(manifest_cache_info_t info,
+                                          uint64_t version,
+                                          const std::atomic_bool &force_stop) {
+  if (loaded_manifest != info && !load_cached_manifest(info))
+    return false;
+  if (info.version == version) {
+    L_INFO("Manifest version {} is up to date, keeping {} loaded entries", version, items.size());
+    return true;
+  }
+
+  // fetch the whole chain before touching items, so a missing delta leaves them intact
+  std::vector<std::string> deltas;
+  for (auto from = info.version; from < version; ++from) {
+    if (force_stop)
+      throw indexed_error(kForceStoppedProcess, "Force stopped updates fetcher");
+    std::string delta;
+    fetch_sink_t sink;
+    sink.reset = [&]() { delta.clear(); };
+    sink.write = [&](const char *data, size_t size) { delta.append(data, size); };
+    fetch_options_t options;
+    options.allow_missing = true;
+    auto path = common::get_manifest_delta_filename(from) + common::kCompressedManifestSuffix;
+    if (fetch_compressed_url_path(path, sink, options) == fetch_status_t::kMissing) {
+      L_INFO("Manifest delta from version {} is not published, fetching the whole manifest", from);
+      return false;
+    }
+    deltas.emplace_back(std::move(delta));
+  }
+
+  try {
+    for (auto &delta : deltas) {
+      apply_manifest_delta(nlohmann::json::parse(delta));
+    }
+    items.sort();
+  } catch (const std::exception &exc) {
+    L_WARN("Could not apply manifest delta, fetching the whole manifest: {}", exc.what());
+    items.clear();
+    loaded_manifest.reset();
+    return false;
+  }
+  L_INFO("Updated manifest from version {} to {} with {} deltas, {} entries now",
+         info.version, version, deltas.size(), items.size());
+  info.version = version;
+  info.validators = {}; // they describe the variant content cached before the deltas
+  store_manifest_cache(std::move(info));
+  return true;
+}
+
+void rm_tree::apply_manifest_delta(const nlohmann::json &delta) {
+  items_index.build(items);
+  std::vector<bool> removed(items.size(), false);
+  auto upsert = [&](const nlohmann::json &obj) {
+    rm_entry entry(obj);
+    auto id = items_index.find(entry.relative_path.generic_string());
+    if (!id.has_value()) {
+      items_index.add(items.add(entry));
+      removed.push_back(false);
+    } else {
+      items.update(*id, entry);
+      removed[*id] = false;
+    }
+  };
+  for (auto &obj : delta.at("added")) {
+    upsert(obj);
+  }
+  for (auto &obj : delta.at("changed")) {
+    upsert(obj);
+  }
+  for (auto &obj : delta.at("removed")) {
+    std::string path = obj;
+    std::replace(path.begin(), path.end(), '\\', '/');
+    auto id = items_index.find(path);
+    if (id.has_value())
+      removed[*id] = true;
+  }
+  if (std::find(removed.begin(), removed.end(), true) != removed.end())
+    items.remove(removed);
+  items_index.clear();
+}
+
+std::optional<rm_tree::manifest_cache_info_t> rm_tree::load_manifest_cache_info() const {
+  auto info_path = get_state_path() / kCachedManifestInfoFilename;
+  if (!is_regular_file(info_path) || !is_regular_file(get_state_path() / kCachedManifestFilename))
+    return std::nullopt;
+  try {
+    auto info_json = nlohmann::json::parse(common::read_file(info_path));
+    manifest_cache_info_t info;
+    info.variant_path = info_json.at("variant");
+    info.validators.etag = info_json.at("etag");
+    info.validators.last_modified = info_json.at("last_modified");
+    info.manifest_size = info_json.at("size");
+    info.version = info_json.value("version", uint64_t{0});
+    return info;
+  } catch (const std::exception &exc) {
+    L_WARN("Manifest cache info is corrupted, ignoring it: {}", exc.what());
+    return std::nullopt;
+  }
+}
+
+bool rm_tree::load_cached_manifest(const manifest_cache_info_t &info) {
+  try {
+    common::mapped_file file(get_state_path() / kCachedManifestFilename);
+    common::binary_manifest::view view;
+    if (file.size() != info.manifest_size || !view.open(file.data(), file.size())) {
+      L_WARN("Cached manifest is corrupted, ignoring it");
+      return false;
+    }
+    items.clear();
+    items.reserve(view.size(), file.size());
+    for (size_t i = 0; i < view.size(); ++i) {
+      items.add(view.at(i));
+    }
+    items.sort();
+  } catch (const std::exception &exc) {
+    L_WARN("Could not load cached manifest: {}", exc.what());
+    items.clear();
+    loaded_manifest.reset();
+    return false;
+  }
+  loaded_manifest = info;
+  L_INFO("Loaded {} manifest entries from cache", items.size());
+  return true;
+}
+
+void rm_tree::save_manifest_cache(manifest_cache_info_t &info) const {
+  common::binary_manifest::writer writer;
+  for (rm_entry_table::id_t id = 0; id < items.size(); ++id) {
+    writer.add(items.at(id));
+  }
+  auto data = writer.serialize();
+  info.manifest_size = data.size();
+  auto info_json = nlohmann::json::object();
+  info_json["variant"] = info.variant_path;
+  info_json["etag"] = info.validators.etag;
+  info_json["last_modified"] = info.validators.last_modified;
+  info_json["size"] = info.manifest_size;
+  info_json["version"] = info.version;
+  // manifest goes first: info is what makes the cache valid
+  remove(get_state_path() / kCachedManifestInfoFilename);
+  common::write_file(get_state_path() / kCachedManifestFilename, data);
+  common::write_file(get_state_path() / kCachedManifestInfoFilename, info_json.dump());
+}
+
+void rm_tree::store_manifest_cache(manifest_cache_info_t info) {
+  // without validators or version there's no way to tell whether the cache is still fresh
+  if (!info.validators.empty() || info.version != 0) {
+    try {
+      save_manifest_cache(info);
+    } catch (const std::exception &exc) {
+      L_WARN("Could not save manifest cache: {}", exc.what());
+    }
+  }
+  loaded_manifest = std::move(info);
 }
 
 // Download helpers
 
-auto rm_tree::find_download_worker(CURL *easy_handler) {
-  for (auto item = worker.download_workers.begin(); item != worker.download_workers.end(); ++item) {
-    if (*item && (*item)->init.ch == easy_handler) {
-      return item;
+rm_tree::download_worker_job_t *rm_tree::find_download_worker(CURL *easy_handler) const {
+  char *job = nullptr;
+  curl_easy_getinfo(easy_handler, CURLINFO_PRIVATE, &job);
+  return reinterpret_cast<download_worker_job_t *>(job);
+}
+
+void rm_tree::release_download_worker(const download_worker_job_t *job) {
+  std::scoped_lock dl_workers_lock(worker.download_workers_mtx);
+  auto &download_workers = worker.download_workers;
+  // there are at most kMaxParallelJobsCount jobs, swap with the last one instead of shifting
+  for (auto &item : download_workers) {
+    if (item.get() == job) {
+      std::swap(item, download_workers.back());
+      download_workers.pop_back();
+      return;
     }
   }
-  return worker.download_workers.end();
 }
 
-auto rm_tree::find_pending_download_item(const rm_entry &entry) {
-  for (auto item = worker.pending_download_items.begin(); item != worker.pending_download_items.end(); ++item) {
-    if (item->value == entry) {
-      return item;
+std::optional<std::pair<std::string, std::string_view>> rm_tree::parse_header_line(std::string_view line) {
+  auto colon = line.find(':');
+  if (colon == std::string_view::npos)
+    return std::nullopt;
+  auto key = common::str_tolower(std::string(line.substr(0, colon)));
+  auto value = line.substr(colon + 1);
+  while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+    value.remove_prefix(1);
+  while (!value.empty() && (value.back() == '\r' || value.back() == '\n' || value.back() == ' '))
+    value.remove_suffix(1);
+  return std::pair{std::move(key), value};
+}
+
+void rm_tree::open_download(download_worker_job_t &job) {
+  auto id = job.pending_item->id;
+  auto full_path = get_entry_full_path(id);
+  auto is_compressed = items.is_compressed(id);
+  // the current file, if any, stays in place until the new content is verified
+  job.part_path = full_path;
+  job.part_path += kPartialDownloadSuffix;
+  job.info_path = full_path;
+  job.info_path += kPartialDownloadInfoSuffix;
+  if (is_compressed) {
+    job.received_path = full_path;
+    job.received_path += kPartialDownloadReceivedSuffix;
+  }
+  if (!exists(job.part_path.parent_path()))
+    create_directories(job.part_path.parent_path());
+
+  // a previous attempt is only resumed for the very same content
+  auto partial_info = nlohmann::json::object();
+  partial_info["size"] = items.get_size(id);
+  partial_info["hash"] = items.get_hash(id);
+  partial_info["compressed_size"] = is_compressed ? items.get_compressed_size(id) : 0;
+  partial_info["compressed_hash"] = is_compressed ? items.get_compressed_hash(id) : 0;
+  auto init_content = [this, &job, id, is_compressed]() {
+    auto hash_algorithm = items.get_hash_algorithm(id);
+    job.hasher.emplace(hash_algorithm, job.relative_path, items.get_size(id));
+    if (is_compressed) {
+      job.decompressor.emplace();
+      job.download_hasher.emplace(hash_algorithm, job.relative_path, items.get_compressed_size(id));
     }
+  };
+  job.start_over = [&job, is_compressed, partial_info, init_content]() {
+    job.stream.close();
+    job.received_stream.close();
+    job.stream.clear();
+    job.received_stream.clear();
+    job.resume_offset = 0;
+    job.resume_validators = {};
+    init_content();
+    std::error_code ec;
+    std::filesystem::remove(job.info_path, ec); // before the content it describes is overwritten
+    job.stream.open(job.part_path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (is_compressed)
+      job.received_stream.open(job.received_path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!job.stream.is_open() || (is_compressed && !job.received_stream.is_open()))
+      throw std::runtime_error("Could not open " + job.part_path.string() + " for writing");
+    job.partial_info = partial_info;
+  };
+  init_content();
+  if (!resume_download(job, partial_info))
+    job.start_over();
+
+  std::vector<std::string> extra_headers;
+  if (job.resume_offset != 0 && job.is_http) {
+    extra_headers.emplace_back("Range: bytes=" + std::to_string(job.resume_offset) + "-");
+    // the server sends the whole entry instead if it has changed since. Weak ETags are not allowed there
+    auto &validators = job.resume_validators;
+    if (!validators.etag.empty() && validators.etag.rfind("W/", 0) != 0)
+      extra_headers.emplace_back("If-Range: " + validators.etag);
+    else if (!validators.last_modified.empty())
+      extra_headers.emplace_back("If-Range: " + validators.last_modified);
   }
-  return worker.pending_download_items.end();
+  job.init = job.cdn->easy_init(job.relative_path, extra_headers);
+  if (job.init.ch == nullptr)
+    throw std::runtime_error("Could not initialize CURL channel");
+  if (job.resume_offset != 0 && !job.is_http)
+    curl_easy_setopt(job.init.ch, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(job.resume_offset));
+}
+
+bool rm_tree::resume_download(download_worker_job_t &job, const nlohmann::json &partial_info) {
+  if (!is_regular_file(job.info_path))
+    return false;
+  auto id = job.pending_item->id;
+  auto is_compressed = items.is_compressed(id);
+  auto &transfer_path = is_compressed ? job.received_path : job.part_path;
+  auto transfer_size = is_compressed ? items.get_compressed_size(id) : items.get_size(id);
+  try {
+    auto saved_info = nlohmann::json::parse(common::read_file(job.info_path));
+    for (auto &[key, value] : partial_info.items()) {
+      if (saved_info.at(key) != value)
+        return false; // the entry has changed since
+    }
+    auto stat = common::get_file_stat(transfer_path);
+    // a complete transfer that wasn't committed is rare enough to be downloaded again
+    if (!stat.has_value() || stat->size == 0 || stat->size >= transfer_size)
+      return false;
+    job.resume_validators.etag = saved_info.at("etag");
+    job.resume_validators.last_modified = saved_info.at("last_modified");
+    job.resume_offset = stat->size;
+
+    // hashes, and the content of compressed entries, are rebuilt from what was received
+    if (is_compressed)
+      job.stream.open(job.part_path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (is_compressed && !job.stream.is_open())
+      return false;
+    common::open_file_reader(transfer_path, job.resume_offset)->read(0, job.resume_offset,
+                                                                     [&](const uint8_t *data, size_t size) {
+      if (is_compressed)
+        receive_download_content(job, reinterpret_cast<const char *>(data), size);
+      else
+        job.hasher->update(data, size);
+    });
+    if (!job.stream.is_open())
+      job.stream.open(job.part_path, std::ios::out | std::ios::binary | std::ios::app);
+    if (is_compressed)
+      job.received_stream.open(job.received_path, std::ios::out | std::ios::binary | std::ios::app);
+    if (!job.stream || (is_compressed && !job.received_stream))
+      return false;
+  } catch (const std::exception &exc) {
+    L_WARN("Could not resume downloading {}, starting over: {}", job.relative_path, exc.what());
+    return false;
+  }
+  L_INFO("Resuming download of {} from byte {}", job.relative_path, job.resume_offset);
+  return true;
+}
+
+bool rm_tree::accept_download_response(download_worker_job_t &job) {
+  long response_code = 0;
+  if (job.is_http)
+    curl_easy_getinfo(job.init.ch, CURLINFO_RESPONSE_CODE, &response_code);
+  if (job.is_http && job.resume_offset != 0 && response_code == 200) {
+    // the server ignored the range or the entry has changed since, and the whole entry is coming anyway
+    L_INFO("Download of {} can't be resumed, taking the whole entry", job.relative_path);
+    job.start_over();
+  } else if (job.is_http && job.resume_offset != 0
+      && (response_code == 416 || (response_code == 206 && job.content_range_start != job.resume_offset))) {
+    // the range is not the one asked for
+    job.restart = true;
+    return false;
+  }
+  if (job.is_http && response_code != (job.resume_offset != 0 ? 206 : 200))
+    return false; // an error page, reported once the transfer ends
+  if (!job.partial_info.empty()) {
+    job.partial_info["etag"] = job.validators.etag;
+    job.partial_info["last_modified"] = job.validators.last_modified;
+    common::write_file(job.info_path, job.partial_info.dump());
+  }
+  return true;
+}
+
+void rm_tree::receive_download_content(download_worker_job_t &job, const char *data, size_t size) {
+  auto write_content = [&job](const char *data, size_t size) {
+    job.stream.write(data, static_cast<std::streamsize>(size));
+    job.hasher->update(data, size);
+  };
+  if (job.decompressor.has_value()) {
+    if (job.received_stream.is_open())
+      job.received_stream.write(data, static_cast<std::streamsize>(size));
+    job.download_hasher->update(data, size);
+    job.decompressor->decompress(data, size, write_content);
+  } else {
+    write_content(data, size);
+  }
+}
+
+void rm_tree::suspend_download(download_worker_job_t &job) {
+  job.stream.close();
+  if (job.received_stream.is_open())
+    job.received_stream.close();
+  if (job.stream.fail() || job.received_stream.fail())
+    discard_download(job); // what is on the disk can't be trusted
+}
+
+void rm_tree::discard_download(download_worker_job_t &job) {
+  job.stream.close();
+  job.received_stream.close();
+  std::error_code ec;
+  std::filesystem::remove(job.info_path, ec); // first, so nothing is resumed from the rest
+  std::filesystem::remove(job.part_path, ec);
+  if (!job.received_path.empty())
+    std::filesystem::remove(job.received_path, ec);
+}
+
+std::string rm_tree::commit_download(download_worker_job_t &job) {
+  auto id = job.pending_item->id;
+  auto discard = [&](std::string error) {
+    discard_download(job);
+    return error;
+  };
+  if (!job.error.empty())
+    return discard(job.error);
+  if (job.decompressor.has_value()) {
+    try {
+      job.decompressor->finish();
+    } catch (const std::exception &exc) {
+      return discard(exc.what());
+    }
+    if (job.download_hasher->size() != items.get_compressed_size(id)
+        || job.download_hasher->digest() != items.get_compressed_hash(id))
+      return discard("Compressed content doesn't match the manifest.");
+  }
+  job.stream.close();
+  if (job.stream.fail())
+    return discard("Could not write " + job.part_path.string() + ".");
+  if (job.hasher->size() != items.get_size(id) || job.hasher->digest() != items.get_hash(id))
+    return discard("Content doesn't match the manifest.");
+
+  auto full_path = get_entry_full_path(id);
+  std::filesystem::rename(job.part_path, full_path);
+  std::error_code ec;
+  std::filesystem::remove(job.info_path, ec);
+  if (!job.received_path.empty()) {
+    job.received_stream.close();
+    std::filesystem::remove(job.received_path, ec);
+  }
+  auto stat = common::get_file_stat(full_path);
+  if (stat.has_value()) {
+    std::scoped_lock lock(worker.deep_check_mtx);
+    hash_cache.set(items.get_path(id), {*stat, items.get_hash_algorithm(id), items.get_hash(id)});
+  }
+  return {};
 }
 
 size_t rm_tree::get_pending_download_files_count(bool include_dependencies) const {
@@ -437,14 +1442,152 @@ size_t rm_tree::get_pending_download_files_count(bool include_dependencies) cons
 
 // Checker helpers
 
-bool rm_tree::is_entry_valid(const rm_entry &entry) const {
-  auto full_path = get_entry_full_path(entry);
-  if (!exists(full_path) || !is_regular_file(full_path))
+std::optional<bool> rm_tree::is_entry_valid_by_stat(rm_entry_table::id_t id,
+                                                    const std::optional<common::file_stat_t> &stat,
+                                                    const std::optional<int64_t> &racy_mtime) const {
+  if (!stat.has_value() || stat->size != items.get_size(id))
     return false;
-  auto file_sz = file_size(full_path);
-  if (file_sz != entry.size)
+  if (racy_mtime.has_value() && stat->mtime < *racy_mtime) {
+    auto cached_hash = hash_cache.find(items.get_path(id), *stat, items.get_hash_algorithm(id));
+    if (cached_hash.has_value())
+      return *cached_hash == items.get_hash(id);
+  }
+  return std::nullopt;
+}
+
+bool rm_tree::is_entry_content_valid(rm_entry_table::id_t id,
+                                     const common::file_stat_t &stat,
+                                     common::thread_pool *hash_pool) const {
+  auto path = get_entry_full_path(id);
+  try {
+    auto block_hashes = items.get_block_hashes(id);
+    if (items.get_hash_algorithm(id) != common::hash_algorithm_t::kXxh3Blocks
+        || !common::is_full_hash_check(path, stat.size)
+        || block_hashes.size() != (stat.size + common::kHashBlockSize - 1) / common::kHashBlockSize)
+      return common::get_file_hash(path, stat.size, items.get_hash_algorithm(id), hash_pool) == items.get_hash(id);
+    // published block digests let a damaged file fail at its first bad block
+    auto hashes = common::get_file_block_hashes(path, stat.size, hash_pool, [&](size_t index, uint64_t hash) {
+      if (hash == block_hashes[index])
+        return true;
+      L_VERBOSE(1, "Block {} of {} doesn't match the manifest", index, path.string());
+      return false;
+    });
+    return hashes.has_value() && common::combine_block_hashes(hashes->data(), hashes->size()) == items.get_hash(id);
+  } catch (const std::exception &exc) {
+    // e.g. locked by a running game, downloading it again gives a proper error if it's still locked then
+    L_WARN("Could not read {} to check it: {}", path.string(), exc.what());
     return false;
-  return common::get_file_hash(full_path) == entry.fnv_hash;
+  }
+}
+
+// The table is sorted by path, so entries under a changed directory are a contiguous range
+std::vector<bool> rm_tree::get_changed_entries(const std::vector<std::string> &paths) const {
+  std::vector<bool> ret(items.size(), false);
+  for (auto &path : paths) {
+    rm_entry_table::id_t first = 0;
+    for (auto count = static_cast<rm_entry_table::id_t>(items.size()); count > 0;) {
+      auto step = count / 2;
+      if (items.get_path(first + step) < path) {
+        first += step + 1;
+        count -= step + 1;
+      } else {
+        count = step;
+      }
+    }
+    for (auto id = first; id < items.size() && items.get_path(id).substr(0, path.size()) == path; ++id) {
+      auto entry_path = items.get_path(id);
+      if (entry_path.size() == path.size() || entry_path[path.size()] == '/')
+        ret[id] = true;
+    }
+  }
+  return ret;
+}
+
+int64_t rm_tree::touch_check_stamp() const {
+  // the stamp gets its mtime from the same clock as the checked files
+  auto stamp_path = get_state_path() / kCheckStampFilename;
+  common::write_file(stamp_path, std::to_string(std::chrono::system_clock::now().time_since_epoch().count()));
+  auto stat = common::get_file_stat(stamp_path);
+  if (!stat.has_value())
+    throw std::runtime_error("Could not stat check stamp");
+  return stat->mtime;
+}
+
+void rm_tree::load_hash_cache() {
+  try {
+    hash_cache.load(get_state_path() / kHashCacheFilename);
+  } catch (const std::exception &exc) {
+    L_WARN("Hash cache is corrupted, ignoring it: {}", exc.what());
+    hash_cache.clear();
+  }
+}
+
+void rm_tree::save_hash_cache() const {
+  try {
+    hash_cache.save(get_state_path() / kHashCacheFilename);
+  } catch (const std::exception &exc) {
+    L_WARN("Could not save hash cache: {}", exc.what());
+  }
+}
+
+rm_tree::verified_directories_t rm_tree::load_verified_directories() const {
+  verified_directories_t ret;
+  auto path = get_state_path() / kVerifiedDirectoriesFilename;
+  if (!is_regular_file(path))
+    return ret;
+  try {
+    auto data_json = nlohmann::json::parse(common::read_file(path));
+    for (auto &directory : data_json.at("directories")) {
+      ret[directory.at(0)] = {directory.at(1), directory.at(2)};
+    }
+  } catch (const std::exception &exc) {
+    L_WARN("Verified directories state is corrupted, ignoring it: {}", exc.what());
+    ret.clear();
+  }
+  return ret;
+}
+
+void rm_tree::save_verified_directories(const verified_directories_t &directories) const {
+  auto data_json = nlohmann::json::object();
+  auto &directories_json = data_json["directories"] = nlohmann::json::array();
+  for (auto &[path, directory] : directories) {
+    directories_json.push_back({path, directory.digest, directory.fingerprint});
+  }
+  common::write_file(get_state_path() / kVerifiedDirectoriesFilename, data_json.dump());
+}
+
+// Saves what a check has learned once every file is known to be valid or not
+void rm_tree::finish_check(const std::vector<bool> &invalid,
+                           const std::vector<uint64_t> &fingerprints,
+                           const std::optional<int64_t> &racy_mtime,
+                           bool incremental) {
+  if (!racy_mtime.has_value())
+    return;
+  save_hash_cache();
+  try {
+    rm_change_journal::clear_persisted(get_state_path());
+  } catch (const std::exception &exc) {
+    L_WARN("Could not clear journaled changes: {}", exc.what());
+  }
+  if (incremental)
+    return; // incremental checks have no fingerprints
+
+  std::vector<uint32_t> invalid_before(items.size() + 1, 0);
+  for (size_t id = 0; id < items.size(); ++id) {
+    invalid_before[id + 1] = invalid_before[id] + (invalid[id] ? 1 : 0);
+  }
+  verified_directories_t verified_directories;
+  for (size_t i = 0; i < fingerprints.size(); ++i) {
+    auto directory = items.get_directory(i);
+    auto end = directory.first_entry + directory.entries_count;
+    if (invalid_before[end] == invalid_before[directory.first_entry])
+      verified_directories[std::string(directory.relative_path)] = {directory.digest, fingerprints[i]};
+  }
+  try {
+    save_verified_directories(verified_directories);
+  } catch (const std::exception &exc) {
+    L_WARN("Could not save verified directories: {}", exc.what());
+  }
 }
 
 size_t rm_tree::get_entries_count(bool include_dependencies) const {
@@ -457,10 +1600,20 @@ size_t rm_tree::get_entries_count(bool include_dependencies) const {
   return ret;
 }
 
+void rm_tree::take_deep_check_findings(worker_process_data_t *downloader_data) {
+  std::scoped_lock lock(worker.deep_check_mtx);
+  for (auto id : worker.deep_check_findings) {
+    worker.pending_download_items.emplace_back(id);
+    if (downloader_data != nullptr)
+      downloader_data->total_work_amount += items.get_download_size(id);
+  }
+  worker.deep_check_findings.clear();
+}
+
 uint64_t rm_tree::get_pending_items_download_size(bool include_dependencies) const {
   uint64_t ret = 0;
   for (auto &entry : worker.pending_download_items) {
-    ret += entry.value.compressed ? entry.value.compressed_size : entry.value.size;
+    ret += items.get_download_size(entry.id);
   }
   if (include_dependencies) {
     for (auto &dependency : dependencies) {
@@ -472,15 +1625,33 @@ uint64_t rm_tree::get_pending_items_download_size(bool include_dependencies) con
 
 // Modifications remover helpers
 
-std::vector<rm_entry> rm_tree::get_all_entries(bool include_dependencies) const {
-  auto entries = items;
+void rm_tree::build_path_index(bool include_dependencies) {
+  items_index.build(items);
   if (include_dependencies) {
     for (auto &dependency : dependencies) {
-      auto dep_entries = dependency.get_all_entries();
-      entries.insert(entries.end(), dep_entries.begin(), dep_entries.end());
+      dependency.build_path_index();
     }
   }
-  return entries;
+}
+
+bool rm_tree::has_entry(std::string_view relative_path, bool include_dependencies) const {
+  if (items_index.contains(relative_path))
+    return true;
+  if (include_dependencies) {
+    for (auto &dependency : dependencies) {
+      if (dependency.has_entry(relative_path))
+        return true;
+    }
+  }
+  return false;
+}
+
+bool rm_tree::is_partial_download(std::string_view relative_path) const {
+  for (std::string_view suffix : {kPartialDownloadSuffix, kPartialDownloadInfoSuffix, kPartialDownloadReceivedSuffix}) {
+    if (relative_path.ends_with(suffix) && has_entry(relative_path.substr(0, relative_path.size() - suffix.size())))
+      return true;
+  }
+  return false;
 }
 
 // Workers
@@ -493,32 +1664,92 @@ void rm_tree::download_worker(rm_tree &tree, worker_process_data_t *process_data
   auto &pending_download_items = worker.pending_download_items;
   auto &download_workers = worker.download_workers;
 
+  std::optional<rm_concurrency_controller> download_concurrency;
   if (process_data == nullptr) { // only root tree has to do this
     downloaded_size = 0;
     total_download_size = tree.get_pending_items_download_size();
+    download_concurrency.emplace(tree.min_download_jobs_count, tree.max_download_jobs_count, kParallelJobsCount);
+    downloader_data.download_concurrency = &*download_concurrency;
   }
+  deferred_function scoped_download_concurrency([&]() {
+    if (process_data == nullptr)
+      downloader_data.download_concurrency = nullptr;
+  });
+  auto &concurrency = *downloader_data.download_concurrency;
 
+  auto header_fn = +[](char *buffer, size_t size, size_t nitems, void *userp) -> size_t {
+    auto this_worker = reinterpret_cast<download_worker_job_t *>(userp);
+    auto length = size * nitems;
+    std::string_view line(buffer, length);
+    if (line.rfind("HTTP/", 0) == 0) {
+      // status line of a new response, e.g. after a redirect
+      this_worker->validators = {};
+      this_worker->content_range_start.reset();
+      return length;
+    }
+    auto header = parse_header_line(line);
+    if (!header.has_value())
+      return length;
+    auto &[key, value] = *header;
+    if (key == "etag") {
+      this_worker->validators.etag = value;
+    } else if (key == "last-modified") {
+      this_worker->validators.last_modified = value;
+    } else if (key == "content-range" && value.rfind("bytes ", 0) == 0) {
+      uint64_t start = 0;
+      auto range = value.substr(6);
+      if (std::from_chars(range.data(), range.data() + range.size(), start).ec == std::errc())
+        this_worker->content_range_start = start;
+    }
+    return length;
+  };
   auto write_fn = +[](void *contents, size_t size, size_t nmemb, void *userp) -> size_t {
     auto this_worker = reinterpret_cast<download_worker_job_t *>(userp);
-    if (this_worker->abort)
-      return CURL_READFUNC_ABORT;
     auto downloaded_size = size * nmemb;
     L_VERBOSE(1,
               "Downloaded worker process (bytes): {}, file: {}",
               downloaded_size,
-              this_worker->item.relative_path.string());
+              this_worker->relative_path);
+    try {
+      if (!this_worker->response_checked) {
+        this_worker->response_checked = true;
+        this_worker->response_accepted = accept_download_response(*this_worker);
+      }
+      if (this_worker->restart)
+        return 0; // no use to receive the rest
+      if (!this_worker->response_accepted)
+        return downloaded_size; // error pages don't reach the entry
+      receive_download_content(*this_worker, reinterpret_cast<const char *>(contents), downloaded_size);
+    } catch (const std::exception &exc) {
+      this_worker->error = exc.what();
+      return 0; // fails the transfer with CURLE_WRITE_ERROR
+    }
     this_worker->downloaded_size += downloaded_size;
-    this_worker->stream.write(reinterpret_cast<char *>(contents), downloaded_size);
     return downloaded_size;
   };
 
   try {
-    auto curlm = curl_multi_init();
+    // verified downloads are recorded, so the next check doesn't have to read them again
+    {
+      std::scoped_lock lock(worker.deep_check_mtx);
+      if (!worker.deep_check.has_value()) // the hashing tier of a check records to the cache in memory
+        tree.load_hash_cache();
+    }
+    deferred_function scoped_hash_cache([&]() {
+      std::scoped_lock lock(worker.deep_check_mtx);
+      tree.save_hash_cache();
+    });
+
+    auto curlm = rm_cdn::multi_init();
     if (curlm == nullptr)
       throw std::runtime_error("Could not initialize curl multi handle");
 
     deferred_function scoped_curlm([&]() {
       std::scoped_lock dl_workers_lock(worker.download_workers_mtx);
+      for (auto &job : download_workers) { // stopped in flight, they go on from there on the next download
+        suspend_download(*job);
+        job->pending_item->downloading = false;
+      }
       download_workers.clear();
       if (curlm != nullptr) {
         curl_multi_cleanup(curlm);
@@ -526,74 +1757,86 @@ void rm_tree::download_worker(rm_tree &tree, worker_process_data_t *process_data
       }
     });
 
-    while (!pending_download_items.empty()) {
+    while (true) {
+      // corrupt files found by the hashing tier of a check are downloaded too, so wait for it to finish
+      auto deep_checking = worker.deep_checking.load(); // read first, so its last findings are taken below
+      tree.take_deep_check_findings(&downloader_data);
+      if (pending_download_items.empty()) {
+        if (!deep_checking)
+          break;
+        if (downloader_data.force_stop)
+          throw indexed_error(kForceStoppedProcess, "Force stopped downloader process");
+        std::this_thread::sleep_for(kDeepCheckPollInterval);
+        continue;
+      }
       {
         std::scoped_lock dl_workers_lock(worker.download_workers_mtx);
 
-        for (auto i = 0; i < kParallelJobsCount; ++i) {
-          if (i >= pending_download_items.size() || download_workers.size() >= kParallelJobsCount)
-            break;
-          auto &pending_download_item = pending_download_items.at(i);
-          auto &entry = pending_download_item.value;
+        // free slots are refilled as soon as a transfer ends, as many as the link takes, but no more than the CDN
+        // allows. Items stay pending until verified, so the ones in flight are skipped
+        auto cdn = tree.get_current_cdn();
+        auto jobs_limit = concurrency.get_limit();
+        downloader_data.download_jobs_limit = jobs_limit;
+        auto cdn_jobs_count = static_cast<size_t>(std::count_if(download_workers.begin(),
+                                                                download_workers.end(),
+                                                                [&](const auto &job) { return job->cdn == cdn; }));
+        for (auto pending_item = pending_download_items.begin();
+             pending_item != pending_download_items.end() && download_workers.size() < jobs_limit
+                 && cdn_jobs_count < cdn->get_max_connections();
+             ++pending_item) {
+          if (pending_item->downloading)
+            continue;
+          auto id = pending_item->id;
           auto &job = download_workers.emplace_back();
           job = std::make_unique<download_worker_job_t>();
-          job->item = entry;
-          job->init = std::move(tree.get_current_cdn()->easy_init(entry.relative_path.string()));
-          job->is_http = tree.get_current_cdn()->is_http();
+          pending_item->downloading = true;
+          ++cdn_jobs_count;
+          job->pending_item = pending_item;
+          job->relative_path = tree.items.get_path(id);
+          job->cdn = cdn;
+          job->is_http = cdn->is_http();
           job->downloaded_size = 0;
-          auto full_path = tree.get_entry_full_path(entry);
-          if (entry.compressed)
-            full_path += ".zst";
-          if (exists(full_path))
-            remove(full_path);
-          if (!exists(full_path.parent_path()))
-            create_directories(full_path.parent_path());
-          job->stream.open(full_path, std::ios::out | std::ios::binary);
+          tree.open_download(*job);
           curl_easy_setopt(job->init.ch, CURLOPT_WRITEFUNCTION, write_fn);
           curl_easy_setopt(job->init.ch, CURLOPT_WRITEDATA, job.get());
+          if (job->is_http) {
+            curl_easy_setopt(job->init.ch, CURLOPT_HEADERFUNCTION, header_fn);
+            curl_easy_setopt(job->init.ch, CURLOPT_HEADERDATA, job.get());
+          }
+          curl_easy_setopt(job->init.ch, CURLOPT_PRIVATE, job.get());
           job->init.link_to_curlm(curlm);
         }
       }
       int still_running = 0;
-      do {
-        auto mc = curl_multi_perform(curlm, &still_running);
-        if (mc == CURLM_OK)
-          mc = curl_multi_wait(curlm, nullptr, 0, 300, nullptr);
-        if (mc != CURLM_OK) {
-          std::string error_str = "Unknown CURLM error: ";
-          error_str += std::to_string(mc);
-          throw std::runtime_error(error_str);
-        }
-        if (downloader_data.force_stop) {
-          for (auto &worker : worker.download_workers) {
-            worker->abort = true;
-          }
-        }
-      } while (still_running > 0);
+      auto mc = curl_multi_perform(curlm, &still_running);
+      if (mc != CURLM_OK)
+        throw std::runtime_error("Unknown CURLM error: " + std::to_string(mc));
       if (downloader_data.force_stop)
-        throw indexed_error(kForceStoppedProcess, "Force stopped downloader process");
+        throw indexed_error(kForceStoppedProcess, "Force stopped downloader process"); // in flight ones are dropped
+      size_t finished_count = 0;
       int msgs_left = 0;
       while (auto msg = curl_multi_info_read(curlm, &msgs_left)) {
         if (msg->msg == CURLMSG_DONE) {
+          ++finished_count;
           auto ch = msg->easy_handle;
           auto error_code = msg->data.result;
           auto dl_worker = tree.find_download_worker(ch);
-          if (dl_worker == download_workers.end()) {
+          if (dl_worker == nullptr) {
             // How this even possible? Dunno what to do
             curl_multi_remove_handle(curlm, ch);
             curl_easy_cleanup(ch);
             continue;
           }
-          auto dl_worker_content = dl_worker->get();
-          auto pending_download_item = tree.find_pending_download_item(dl_worker_content->item);
-          if (pending_download_item == pending_download_items.end()) {
-            // How this even possible? Dunno what to do
-            std::scoped_lock dl_workers_lock(worker.download_workers_mtx);
-            curl_multi_remove_handle(curlm, ch);
-            download_workers.erase(dl_worker);
+          auto pending_download_item = dl_worker->pending_item;
+          auto is_http = dl_worker->is_http;
+          auto resume_offset = dl_worker->resume_offset;
+          if (dl_worker->restart) {
+            L_INFO("Download of {} can't be resumed, starting it over", dl_worker->relative_path);
+            discard_download(*dl_worker);
+            tree.release_download_worker(dl_worker);
+            pending_download_item->downloading = false;
             continue;
           }
-          auto is_http = dl_worker_content->is_http;
 
           std::string error_str;
           deferred_function def_error([&]() {
@@ -621,49 +1864,62 @@ void rm_tree::download_worker(rm_tree &tree, worker_process_data_t *process_data
             break;
           }
 
-          const char *url = nullptr;
-          curl_easy_getinfo(ch, CURLINFO_EFFECTIVE_URL, &url);
+          const char *effective_url = nullptr;
+          curl_easy_getinfo(ch, CURLINFO_EFFECTIVE_URL, &effective_url);
+          std::string url = effective_url != nullptr ? effective_url : "Unknown url"; // the handle dies with the job
 
-          if (error_code == CURLE_OK && is_http && response_code != 200) {
+          auto expected_response_code = resume_offset != 0 ? 206 : 200;
+          if (error_code == CURLE_OK && is_http && response_code != expected_response_code) {
             error_str = "The request was proceeded correctly, but host returned an unknown HTTP code: "
                 + std::to_string(response_code) + ".";
             error_code = CURL_LAST;
           }
-          size_t worker_downloaded_size = dl_worker->get()->downloaded_size;
-          {
-            std::scoped_lock dl_workers_lock(worker.download_workers_mtx);
-            download_workers.erase(dl_worker);
+          size_t worker_downloaded_size = dl_worker->downloaded_size;
+          if (error_code == CURLE_WRITE_ERROR && !dl_worker->error.empty())
+            error_str = "Could not write downloaded content: " + dl_worker->error;
+          auto has_errors = !error_str.empty() || (is_http && response_code != expected_response_code);
+          if (!has_errors) {
+            error_str = tree.commit_download(*dl_worker);
+            if (!error_str.empty())
+              error_str = "Downloaded file is rejected: " + error_str;
+            has_errors = !error_str.empty();
+          } else if (!dl_worker->error.empty()) {
+            discard_download(*dl_worker);
+          } else {
+            suspend_download(*dl_worker); // the next attempt goes on from there
           }
+          curl_off_t first_byte_us = 0; // is 0 for the transfers failed before any response
+          curl_easy_getinfo(ch, CURLINFO_STARTTRANSFER_TIME_T, &first_byte_us);
+          concurrency.on_transfer_finished(worker_downloaded_size, static_cast<double>(first_byte_us) / 1e6, has_errors);
+          tree.release_download_worker(dl_worker);
+          pending_download_item->downloading = false; // failed ones are retried by a later refill
 
-          auto has_errors = !error_str.empty() || (is_http && response_code != 200);
           if (!has_errors) {
-            downloaded_size += worker_downloaded_size;
-            auto fullpath = tree.get_entry_full_path(pending_download_item->value);
-            auto compressed = pending_download_item->value.compressed;
-            if (compressed) {
-              L_INFO("File {} is compressed, decompressing...", pending_download_item->value.relative_path.string());
-              std::filesystem::path compressed_filename = fullpath.string() + ".zst";
-              common::decompress_file(compressed_filename, fullpath);
-              remove(compressed_filename);
-              L_INFO("File {} is decompressed successfully", pending_download_item->value.relative_path.string());
-            }
-            L_INFO("File {} is downloaded successfully", pending_download_item->value.relative_path.string());
+            downloaded_size += resume_offset + worker_downloaded_size;
+            L_INFO("File {} is downloaded and verified successfully", tree.items.get_path(pending_download_item->id));
             pending_download_items.erase(pending_download_item);
             --worker.pending_download_files_count;
           } else {
             ++worker.current_cdn_errors_count;
             ++pending_download_item->errors_count;
             error_str += " Problematic URL path was: ";
-            error_str += url != nullptr ? url : "Unknown url";
+            error_str += url;
             error_str += " Problematic file: ";
-            error_str += pending_download_item->value.relative_path.string();
+            error_str += tree.items.get_path(pending_download_item->id);
 
             if (pending_download_item->errors_count >= kMaxDownloadWorkerErrorsCount) {
               throw std::runtime_error(error_str);
             }
+            // retried once the items queued before it are started, rather than in a tight loop
+            pending_download_items.splice(pending_download_items.end(), pending_download_items, pending_download_item);
           }
         }
       }
+      if (finished_count == 0 && still_running > 0) {
+        mc = curl_multi_wait(curlm, nullptr, 0, kDownloadPollTimeoutMs, nullptr);
+        if (mc != CURLM_OK)
+          throw std::runtime_error("Unknown CURLM error: " + std::to_string(mc));
+      }
     }
     for (auto &dependency : tree.dependencies) {
       download_worker(dependency, &downloader_data);
@@ -690,9 +1946,6 @@ void rm_tree::download_worker(rm_tree &tree, worker_process_data_t *process_data
     L_ERROR("Exception during downloading files: {}", tree.get_worker_error_str());
   }
   L_INFO("Files downloader completed");
-
-  worker.last_state = worker.current_state.load();
-  worker.current_state = worker_mode_t::kNone;
 }
 
 void rm_tree::updates_fetcher_worker(rm_tree &tree, worker_process_data_t *process_data) {
@@ -701,14 +1954,7 @@ void rm_tree::updates_fetcher_worker(rm_tree &tree, worker_process_data_t *proce
 
   L_INFO("Updates fetcher started");
   try {
-    auto data = tree.fetch_url_path_content(common::kResourcesDataFilename);
-    if (fetcher_data.force_stop)
-      throw indexed_error(kForceStoppedProcess, "Force stopped check worker");
-    auto data_json = nlohmann::json::parse(data);
-    tree.items.clear();
-    for (auto &entry : data_json) {
-      tree.items.emplace_back(entry);
-    }
+    tree.update_manifest(fetcher_data.force_stop);
     for (auto &dependency : tree.dependencies) {
       updates_fetcher_worker(dependency, &fetcher_data);
     }
@@ -734,9 +1980,6 @@ void rm_tree::updates_fetcher_worker(rm_tree &tree, worker_process_data_t *proce
     L_ERROR("Exception during fetching files update: {}", tree.get_worker_error_str());
   }
   L_INFO("Updates fetcher completed");
-
-  worker.last_state = worker.current_state.load();
-  worker.current_state = worker_mode_t::kNone;
 }
 
 void rm_tree::check_worker(rm_tree &tree, worker_process_data_t *process_data) {
@@ -748,23 +1991,207 @@ void rm_tree::check_worker(rm_tree &tree, worker_process_data_t *process_data) {
   auto &items = tree.items;
 
   pending_download_items.clear();
+  worker.deep_check_findings.clear();
+  worker.deep_check.reset();
+  std::optional<common::thread_pool> check_pool;
   if (process_data == nullptr) { // only root tree has to do this
     total_check_files_count = tree.get_entries_count();
     checked_files_count = 0;
+    worker.deep_check_data.total_work_amount = 0;
+    worker.deep_check_data.processed_work_amount = 0;
+    auto threads_count = tree.check_threads_count != 0
+        ? tree.check_threads_count
+        : common::thread_pool::get_default_threads_count();
+    if (threads_count > 1)
+      check_pool.emplace(threads_count - 1); // the checking thread runs tasks too while it waits for them
+    checker_data.check_pool = check_pool ? &*check_pool : nullptr;
   }
+  deferred_function scoped_check_pool([&]() {
+    if (process_data == nullptr)
+      checker_data.check_pool = nullptr;
+  });
+  // runs fn(begin, end) for chunks of [0, count), on the check pool if there is one
+  auto for_each_chunk = [&](size_t count, const std::function<void(size_t begin, size_t end)> &fn) {
+    if (checker_data.check_pool == nullptr)
+      fn(0, count);
+    else
+      checker_data.check_pool->parallel_for(count, kCheckEntriesPerTask, fn);
+  };
 
   L_INFO("Files checker started");
+  // changes are taken before anything is looked at, so whatever happens from now on is journaled for the next check
+  auto check_completed = false;
+  rm_change_journal::changes_t changes;
+  if (tree.change_journal != nullptr)
+    changes = tree.change_journal->take(tree.state_name);
+  deferred_function scoped_changes([&]() {
+    if (!check_completed && tree.change_journal != nullptr)
+      tree.change_journal->invalidate(tree.state_name);
+  });
   try {
-    for (auto &item : items) {
-      if (checker_data.force_stop)
-        throw indexed_error(kForceStoppedProcess, "Force stopped check worker");
+    // subtrees whose manifest digest and local files fingerprint match the last successful check are skipped
+    std::optional<int64_t> racy_mtime;
+    verified_directories_t verified_directories;
+    tree.hash_cache.clear();
+    try {
+      racy_mtime = tree.touch_check_stamp() - kRacyModificationSeconds * common::kMtimeTicksPerSecond;
+      auto persisted_changes = rm_change_journal::load_persisted(tree.get_state_path());
+      changes.paths.insert(changes.paths.end(), persisted_changes.paths.begin(), persisted_changes.paths.end());
+      if (!checker_data.full_check) {
+        verified_directories = tree.load_verified_directories();
+        tree.load_hash_cache();
+      }
+    } catch (const std::exception &exc) {
+      L_WARN("Could not access check state, checking every file: {}", exc.what());
+      changes.complete = false;
+    }
+    // with a complete journal only changed files and files without a matching cached hash are looked at
+    auto incremental = changes.complete && racy_mtime.has_value() && !checker_data.full_check;
+    auto changed = tree.get_changed_entries(changes.paths);
+    std::vector<bool> trusted(items.size(), false);
+    if (incremental) {
+      L_INFO("{} paths have changed since the last check", changes.paths.size());
+      for (rm_entry_table::id_t id = 0; id < items.size(); ++id) {
+        auto record = tree.hash_cache.get(items.get_path(id));
+        trusted[id] = !changed[id] && record != nullptr && record->hash_algorithm == items.get_hash_algorithm(id)
+            && record->hash == items.get_hash(id);
+      }
+    }
+
+    // entries are grouped by directory, so each directory is opened (listed on Windows) once for their stats
+    auto get_parent_path = [&](rm_entry_table::id_t id) {
+      auto path = items.get_path(id);
+      auto slash = path.rfind('/');
+      return slash == std::string_view::npos ? std::string_view() : path.substr(0, slash);
+    };
+    std::vector<rm_entry_table::id_t> stat_ids;
+    for (rm_entry_table::id_t id = 0; id < items.size(); ++id) {
+      if (!trusted[id])
+        stat_ids.push_back(id);
+    }
+    std::stable_sort(stat_ids.begin(), stat_ids.end(), [&](auto a, auto b) {
+      return get_parent_path(a) < get_parent_path(b);
+    });
+    std::vector<size_t> directory_begins;
+    for (size_t i = 0; i < stat_ids.size(); ++i) {
+      if (i == 0 || get_parent_path(stat_ids[i]) != get_parent_path(stat_ids[i - 1]))
+        directory_begins.push_back(i);
+    }
+    directory_begins.push_back(stat_ids.size());
+    std::vector<std::optional<common::file_stat_t>> stats(items.size());
+    for_each_chunk(directory_begins.size() - 1, [&](size_t begin, size_t end) {
+      for (auto i = begin; i < end; ++i) {
+        auto parent_path = get_parent_path(stat_ids[directory_begins[i]]);
+        common::directory_snapshot directory(tree.base_path / parent_path);
+        for (auto j = directory_begins[i]; j < directory_begins[i + 1]; ++j) {
+          if (checker_data.force_stop)
+            throw indexed_error(kForceStoppedProcess, "Force stopped check worker");
+          auto id = stat_ids[j];
+          auto name = items.get_path(id).substr(parent_path.empty() ? 0 : parent_path.size() + 1);
+          stats[id] = directory.get(name);
+        }
+      }
+    });
+    auto fingerprints = common::binary_manifest::build_directories(items.size(), [&](size_t id) {
+      return items.get_path(static_cast<rm_entry_table::id_t>(id));
+    }, [&](size_t id) -> uint64_t {
+      auto &stat = stats[id];
+      if (!stat.has_value() || !racy_mtime.has_value() || stat->mtime >= *racy_mtime)
+        return 0; // never matches a real fingerprint, so the directory is checked again next time
+      auto ret = common::binary_manifest::digest_append(common::binary_manifest::kDigestSeed,
+                                                        &stat->size, sizeof(stat->size));
+      ret = common::binary_manifest::digest_append(ret, &stat->file_id, sizeof(stat->file_id));
+      return common::binary_manifest::digest_append(ret, &stat->mtime, sizeof(stat->mtime));
+    });
+    if (fingerprints.size() != items.get_directories_count()) {
+      // can't happen for a sorted table, but never trust a mismatched tree
+      racy_mtime.reset();
+      verified_directories.clear();
+      incremental = false;
+      std::fill(trusted.begin(), trusted.end(), false);
+    }
 
-      if (!tree.is_entry_valid(item))
-        pending_download_items.emplace_back(item);
+    size_t trusted_end = 0;
+    for (size_t i = 0; i < items.get_directories_count() && !verified_directories.empty() && !incremental; ++i) {
+      auto directory = items.get_directory(i);
+      if (directory.first_entry < trusted_end)
+        continue; // pre-order: inside an already trusted subtree
+      auto verified = verified_directories.find(std::string(directory.relative_path));
+      if (verified == verified_directories.end() || verified->second.digest != directory.digest
+          || verified->second.fingerprint != fingerprints[i].digest)
+        continue;
+      trusted_end = directory.first_entry + directory.entries_count;
+      std::fill(trusted.begin() + directory.first_entry, trusted.begin() + static_cast<ptrdiff_t>(trusted_end), true);
+      L_VERBOSE(1, "Directory '{}' is unchanged since the last check, skipping it", directory.relative_path);
+    }
+    for (rm_entry_table::id_t id = 0; id < items.size() && !incremental; ++id) {
+      if (changed[id])
+        trusted[id] = false; // journaled changes may have kept the stat
+    }
+    if (std::find(trusted.begin(), trusted.end(), false) == trusted.end() && !items.empty())
+      L_INFO("Nothing has changed since the last check");
+
+    // the stat pass: whatever it can't tell about is left to the hashing tier
+    std::vector<bool> invalid(items.size(), false);
+    std::vector<common::read_item_t> read_items;
+    for (rm_entry_table::id_t id = 0; id < items.size(); ++id) {
+      auto trusted_mtime = changed[id] ? std::optional<int64_t>() : racy_mtime;
+      auto valid = trusted[id] ? true : tree.is_entry_valid_by_stat(id, stats[id], trusted_mtime);
+      if (!valid.has_value())
+        read_items.push_back({id, tree.get_entry_full_path(id), stats[id]->file_id});
+      else
+        invalid[id] = !*valid;
       ++checked_files_count;
     }
-    for (auto &dependency : tree.dependencies) {
-      check_worker(dependency, &checker_data);
+    for (rm_entry_table::id_t id = 0; id < items.size(); ++id) {
+      if (invalid[id])
+        pending_download_items.emplace_back(id);
+    }
+    rm_hash_cache checked_hashes; // rebuilt from scratch, so files that left the manifest leave the cache too
+    std::vector<bool> unread(items.size(), true);
+    for (auto &item : read_items) {
+      unread[item.index] = false;
+    }
+    for (rm_entry_table::id_t id = 0; id < items.size(); ++id) {
+      auto &stat = stats[id];
+      if (trusted[id]) {
+        if (auto record = tree.hash_cache.get(items.get_path(id)); record != nullptr)
+          checked_hashes.set(items.get_path(id), *record);
+      } else if (!invalid[id] && unread[id] && racy_mtime.has_value() && stat->mtime < *racy_mtime) {
+        // racily modified files are never recorded, a change in the same mtime tick would go unnoticed
+        checked_hashes.set(items.get_path(id), {*stat, items.get_hash_algorithm(id), items.get_hash(id)});
+      }
+    }
+    if (racy_mtime.has_value())
+      tree.hash_cache = std::move(checked_hashes);
+
+    std::vector<uint64_t> fingerprint_digests;
+    for (auto &fingerprint : fingerprints) {
+      fingerprint_digests.push_back(fingerprint.digest);
+    }
+    if (read_items.empty()) {
+      tree.finish_check(invalid, fingerprint_digests, racy_mtime, incremental);
+    } else {
+      // files are read in the order of their place on the disk
+      [[maybe_unused]] auto order = common::sort_for_reading(read_items, kCheckReadOrder);
+      L_INFO("{} files are left to hash in background", read_items.size());
+      L_VERBOSE(1, "Reading them in order {}", static_cast<int>(order));
+      tree.worker.deep_check = deep_check_t{std::move(read_items), std::move(stats), std::move(changed),
+                                            std::move(invalid), std::move(fingerprint_digests), racy_mtime,
+                                            incremental};
+    }
+    check_completed = true; // the hashing tier invalidates the journal itself if it doesn't complete
+    // dependencies are independent of each other, so they are checked side by side
+    if (checker_data.check_pool != nullptr) {
+      checker_data.check_pool->parallel_for(tree.dependencies.size(), 1, [&](size_t begin, size_t end) {
+        for (auto i = begin; i < end; ++i) {
+          check_worker(tree.dependencies[i], &checker_data);
+        }
+      });
+    } else {
+      for (auto &dependency : tree.dependencies) {
+        check_worker(dependency, &checker_data);
+      }
     }
   } catch (const std::system_error &fail) {
     if (process_data != nullptr)
@@ -790,8 +2217,149 @@ void rm_tree::check_worker(rm_tree &tree, worker_process_data_t *process_data) {
   worker.pending_download_files_count = pending_download_items.size();
   L_INFO("Files checker completed");
 
-  worker.last_state = worker.current_state.load();
-  worker.current_state = worker_mode_t::kNone;
+  // the hashing tier starts once the stat pass of every tree is done
+  if (process_data == nullptr) {
+    std::vector<rm_tree *> trees{&tree};
+    for (auto &dependency : tree.dependencies) {
+      trees.push_back(&dependency);
+    }
+    uint64_t deep_check_files_count = 0;
+    for (auto checked_tree : trees) {
+      auto &deep_check = checked_tree->worker.deep_check;
+      if (!deep_check.has_value())
+        continue;
+      if (!tree.has_worker_error()) {
+        deep_check_files_count += deep_check->read_items.size();
+        continue;
+      }
+      deep_check.reset();
+      if (checked_tree->change_journal != nullptr)
+        checked_tree->change_journal->invalidate(checked_tree->state_name);
+    }
+    if (deep_check_files_count != 0) {
+      tree.deep_checker_release();
+      worker.deep_check_data.force_stop = false;
+      worker.deep_check_data.total_work_amount = deep_check_files_count;
+      worker.deep_checking = true; // before the check is over, so the tree never looks idle in between
+      worker.deep_checker = new std::thread(deep_check_worker, std::ref(tree), nullptr, nullptr);
+    }
+  }
+}
+
+// Runs the fetcher, the checker and the downloader one after another in one run. The download starts once the
+// stat pass of the check is done and goes on along with its hashing tier, which feeds it corrupt files.
+void rm_tree::sync_worker(rm_tree &tree, worker_process_data_t *process_data) {
+  auto &worker = tree.worker;
+
+  L_INFO("Sync started");
+  updates_fetcher_worker(tree, process_data);
+  if (!tree.has_worker_error()) {
+    worker.current_state = worker_mode_t::kChecking;
+    check_worker(tree, process_data);
+  }
+  if (!tree.has_worker_error() && (tree.get_pending_download_files_count() > 0 || tree.deep_checking())) {
+    worker.current_state = worker_mode_t::kDownloading;
+    download_worker(tree, process_data);
+  }
+  worker.syncing = false;
+  L_INFO("Sync completed");
+}
+
+void rm_tree::deep_check_worker(rm_tree &tree, worker_process_data_t *process_data, common::thread_pool *hash_pool) {
+  auto &worker = tree.worker;
+  auto &deep_check_data = process_data != nullptr ? *process_data : worker.deep_check_data;
+  auto &hashed_files_count = deep_check_data.processed_work_amount;
+
+  std::optional<common::thread_pool> pool;
+  if (process_data == nullptr) { // only root tree has to do this
+    common::lower_current_thread_priority();
+    auto threads_count = tree.check_threads_count != 0
+        ? tree.check_threads_count
+        : common::thread_pool::get_default_threads_count();
+    if (threads_count > 1)
+      pool.emplace(threads_count - 1, true);
+    hash_pool = pool ? &*pool : nullptr;
+  }
+
+  if (worker.deep_check.has_value()) {
+    L_INFO("Files hashing started");
+    auto &deep_check = *worker.deep_check;
+    auto &read_items = deep_check.read_items;
+    auto &stats = deep_check.stats;
+    auto &racy_mtime = deep_check.racy_mtime;
+    auto completed = false;
+    try {
+      // the next few files are hinted to the OS while one is hashed. Files are opened by path here, the directories
+      // of the stat pass are closed by now
+      std::atomic_size_t hinted_count = 0;
+      auto hint_reads = [&](size_t end) {
+        end = std::min(end, read_items.size());
+        for (auto next = hinted_count.load(); next < end;) {
+          if (!hinted_count.compare_exchange_weak(next, next + 1))
+            continue; // next is reloaded
+          auto &item = read_items[next++];
+          auto size = stats[item.index]->size;
+          if (common::is_full_hash_check(item.path, size))
+            common::hint_file_read(item.path, size); // sampled files prefetch their windows themselves
+        }
+      };
+      // every chunk collects its invalid entries, so the tasks share only the findings and the hash cache
+      std::vector<std::vector<rm_entry_table::id_t>> invalid_ids((read_items.size() + kCheckEntriesPerTask - 1)
+                                                                 / kCheckEntriesPerTask);
+      auto hash_files = [&](size_t begin, size_t end) {
+        auto &chunk_invalid_ids = invalid_ids[begin / kCheckEntriesPerTask];
+        for (auto i = begin; i < end; ++i) {
+          if (deep_check_data.force_stop)
+            throw indexed_error(kForceStoppedProcess, "Force stopped files hashing");
+          hint_reads(i + 1 + kCheckReadaheadFilesCount);
+          auto id = static_cast<rm_entry_table::id_t>(read_items[i].index);
+          auto &stat = *stats[id];
+          if (!tree.is_entry_content_valid(id, stat, hash_pool)) {
+            chunk_invalid_ids.push_back(id);
+            std::scoped_lock lock(worker.deep_check_mtx);
+            worker.deep_check_findings.push_back(id);
+            ++worker.pending_download_files_count;
+          } else if (racy_mtime.has_value() && stat.mtime < *racy_mtime) {
+            std::scoped_lock lock(worker.deep_check_mtx);
+            tree.hash_cache.set(tree.items.get_path(id),
+                                {stat, tree.items.get_hash_algorithm(id), tree.items.get_hash(id)});
+          }
+          ++hashed_files_count;
+        }
+      };
+      if (hash_pool != nullptr)
+        hash_pool->parallel_for(read_items.size(), kCheckEntriesPerTask, hash_files);
+      else
+        hash_files(0, read_items.size());
+      for (auto &chunk_invalid_ids : invalid_ids) {
+        for (auto id : chunk_invalid_ids) {
+          deep_check.invalid[id] = true;
+        }
+      }
+      completed = true;
+    } catch (const std::exception &exc) {
+      L_ERROR("Exception during hashing files: {}", exc.what());
+    }
+
+    std::scoped_lock lock(worker.deep_check_mtx);
+    if (completed) {
+      tree.finish_check(deep_check.invalid, deep_check.fingerprints, racy_mtime, deep_check.incremental);
+    } else {
+      if (racy_mtime.has_value())
+        tree.save_hash_cache(); // what is recorded is still right
+      if (tree.change_journal != nullptr)
+        tree.change_journal->invalidate(tree.state_name);
+    }
+    worker.deep_check.reset();
+    L_INFO("Files hashing completed");
+  }
+
+  if (process_data == nullptr) {
+    for (auto &dependency : tree.dependencies) {
+      deep_check_worker(dependency, &deep_check_data, hash_pool);
+    }
+    worker.deep_checking = false;
+  }
 }
 
 void rm_tree::remove_modifications_worker(rm_tree &tree, worker_process_data_t *process_data) {
@@ -800,8 +2368,6 @@ void rm_tree::remove_modifications_worker(rm_tree &tree, worker_process_data_t *
   auto &total_check_files_count = checker_data.total_work_amount;
   auto &checked_files_count = checker_data.processed_work_amount;
 
-  auto items = tree.get_all_entries();
-
   std::function<void(const std::filesystem::path &dir, const bool counting)> process_directory;
   process_directory = [&](const std::filesystem::path &dir, const bool counting) {
     for (auto &this_path : std::filesystem::directory_iterator{dir}) {
@@ -809,16 +2375,17 @@ void rm_tree::remove_modifications_worker(rm_tree &tree, worker_process_data_t *
         throw indexed_error(kForceStoppedProcess, "Force stopped modifications remover");
 
       if (is_directory(this_path)) {
+        if (dir == tree.base_path && this_path.path().filename() == common::kStateDirectoryName)
+          continue; // client state is not a part of any tree
         L_VERBOSE(1, "Processing directory: {}; counting: {}", this_path.path().string(), counting);
         process_directory(this_path, counting);
       } else if (is_regular_file(this_path)) {
         L_VERBOSE(1, "Processing file: {}; counting: {}", this_path.path().string(), counting);
         if (!counting) {
-          if (!std::any_of(items.cbegin(), items.cend(), [&](const rm_entry &entry) {
-            return tree.get_entry_full_path(entry) == this_path;
-          })) {
+          auto relative_path = this_path.path().lexically_relative(tree.base_path).generic_string();
+          // stopped downloads are resumed from where they were left
+          if (!tree.has_entry(relative_path) && !tree.is_partial_download(relative_path))
             remove(this_path);
-          }
           ++checked_files_count;
         } else {
           ++total_check_files_count;
@@ -837,6 +2404,7 @@ void rm_tree::remove_modifications_worker(rm_tree &tree, worker_process_data_t *
     }
     L_INFO("Modifications remover: total items count: {}", total_check_files_count.load());
 
+    tree.build_path_index();
     process_directory(tree.base_path, false);
   } catch (const std::system_error &fail) {
     if (process_data != nullptr)
@@ -861,7 +2429,4 @@ void rm_tree::remove_modifications_worker(rm_tree &tree, worker_process_data_t *
   }
 
   L_INFO("Modifications remover completed");
-
-  worker.last_state = worker.current_state.load();
-  worker.current_state = worker_mode_t::kNone;
 }
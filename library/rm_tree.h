@@ -22,21 +22,33 @@
 
 #pragma once
 
+#include <list>
 #include <utility>
 
 #include "rm_cdn.h"
-#include "rm_entry.h"
+#include "rm_entry_table.h"
+#include "rm_path_index.h"
+#include "rm_hash_cache.h"
+#include "rm_change_journal.h"
+#include "rm_concurrency_controller.h"
 #include "resources_manager.h"
 #include "indexed_error.hpp"
+#include <file_stat.hpp>
+#include <common.hpp>
 
 class rm_tree {
   std::vector<rm_cdn> cdns; // all cdns related to this project
-  std::vector<rm_entry> items; // all items of this tree. ACHTUNG! do not add items with same names
+  rm_entry_table items; // all items of this tree. ACHTUNG! do not add items with same names
+  rm_path_index items_index; // rebuilt by every operation that looks items up by path
+  rm_hash_cache hash_cache; // hashes of verified local files, loaded by the workers that use it
+  std::shared_ptr<rm_change_journal> change_journal; // shared by the root and its dependencies while watching
   std::vector<rm_tree> dependencies; // dependant trees, like moonloader, cleo and etc. only root project can have dependencies
   std::filesystem::path base_path; // absolute path to download. only root knows this property
+  std::string state_name = "root"; // subdirectory of this tree in the client state directory
+  size_t check_threads_count = 0; // only root's one is used, see check_worker
+  size_t min_download_jobs_count = kMinParallelJobsCount; // same for the download concurrency bounds
+  size_t max_download_jobs_count = kMaxParallelJobsCount;
 
-  using items_const_iterator = decltype(items)::const_iterator;
-  using items_iterator = decltype(items)::iterator;
   using cdns_const_iterator = decltype(cdns)::const_iterator;
   using cdns_iterator = decltype(cdns)::iterator;
 
@@ -53,22 +65,106 @@ class rm_tree {
     std::atomic_uint64_t total_work_amount = 0;
     std::atomic_uint64_t processed_work_amount = 0;
     std::atomic_bool force_stop = false;
+    bool full_check = false; // hash every file, whatever the check state says
+    common::thread_pool *check_pool = nullptr; // created by the root check and shared with its dependencies
+    rm_concurrency_controller *download_concurrency = nullptr; // created by the root download, shared likewise
+    std::atomic_size_t download_jobs_limit = 0; // last limit of parallel downloads, for progress reports
+  };
+
+  struct fetch_validators_t {
+    std::string etag;
+    std::string last_modified;
+
+    bool empty() const { return etag.empty() && last_modified.empty(); }
+    bool operator==(const fetch_validators_t &other) const = default;
+  };
+
+  struct pending_download_item_t {
+    rm_entry_table::id_t id;
+    size_t errors_count = 0;
+    bool downloading = false; // a job is on it
+
+    inline explicit pending_download_item_t(rm_entry_table::id_t id) : id(id) {};
   };
 
   struct download_worker_job_t {
     bool is_http;
-    rm_entry item;
+    std::list<pending_download_item_t>::iterator pending_item;
+    cdns_const_iterator cdn;
+    std::string relative_path;
+    std::filesystem::path part_path; // renamed over the entry once its content is verified
+    std::filesystem::path info_path; // what part_path is a part of, so a stopped download can be resumed
+    std::filesystem::path received_path; // compressed entries only: received bytes, replayed to resume
     std::ofstream stream;
+    std::ofstream received_stream;
+    uint64_t resume_offset = 0; // bytes of the transfer kept from a previous attempt, the rest is asked with Range
+    fetch_validators_t resume_validators; // of the previous attempt, sent as If-Range
+    fetch_validators_t validators; // of this response
+    std::optional<uint64_t> content_range_start; // of this response
+    nlohmann::json partial_info; // new downloads only, saved to info_path once the response is accepted
+    std::function<void()> start_over; // drops what a previous attempt has left, the entry is received from its start
+    bool response_checked = false;
+    bool response_accepted = false;
+    bool restart = false; // the range can't be resumed, download the whole entry again
+    std::optional<common::stream_decompressor> decompressor; // compressed entries are decompressed on the fly
+    std::optional<common::file_hasher> download_hasher; // received bytes of compressed entries
+    std::optional<common::file_hasher> hasher; // bytes written to part_path
+    std::string error; // the write callback can't throw through curl
     rm_cdn::easy_init_t init;
     std::atomic_uint64_t downloaded_size;
-    bool abort = false;
   };
 
-  struct pending_download_item_t {
-    rm_entry value;
-    size_t errors_count = 0;
+  struct fetch_sink_t {
+    std::function<void()> reset; // called before every attempt, so partially received data can be dropped
+    std::function<void(uint64_t size)> reserve; // optional, called once the content length is known
+    std::function<void(const char *data, size_t size)> write;
+  };
 
-    inline explicit pending_download_item_t(rm_entry entry) : value(std::move(entry)) {};
+  struct fetch_options_t {
+    bool allow_missing = false; // report kMissing instead of throwing when the CDN has no such file
+    fetch_validators_t conditional; // sent as If-None-Match / If-Modified-Since, HTTP CDNs only
+  };
+
+  enum class fetch_status_t {
+    kFetched,
+    kMissing,
+    kNotModified
+  };
+
+  struct manifest_cache_info_t {
+    std::string variant_path;
+    fetch_validators_t validators;
+    uint64_t manifest_size = 0; // size of the cached binary manifest
+    uint64_t version = 0; // published manifest version, 0 if the CDN doesn't publish versions
+
+    bool operator==(const manifest_cache_info_t &other) const = default;
+  };
+
+  struct verified_directory_t {
+    uint64_t digest; // manifest digest of the subtree
+    uint64_t fingerprint; // sizes and modification times of the local files of the subtree
+  };
+  using verified_directories_t = std::unordered_map<std::string, verified_directory_t>;
+
+  struct manifest_variant_t {
+    std::string path;
+    bool binary;
+    bool compressed;
+    bool optional; // may be missing on CDN, the next variant is tried then
+    bool sharded = false; // path is an index of binary manifest shards
+  };
+
+  std::optional<manifest_cache_info_t> loaded_manifest; // where current items came from, if they are cached
+
+  // Hashing tier of a check: files its stat pass couldn't tell about, hashed in background
+  struct deep_check_t {
+    std::vector<common::read_item_t> read_items; // in reading order
+    std::vector<std::optional<common::file_stat_t>> stats;
+    std::vector<bool> changed; // journaled changes, never trusted by mtime
+    std::vector<bool> invalid; // found by the stat pass
+    std::vector<uint64_t> fingerprints; // of directories, a complete check records the verified ones
+    std::optional<int64_t> racy_mtime;
+    bool incremental = false;
   };
 
   struct {
@@ -85,14 +181,22 @@ class rm_tree {
         std::exception
       >> worker_error;
     std::thread *self = nullptr;
+    std::atomic_bool syncing = false; // the fetcher, the checker and the downloader run one after another
 
     worker_process_data_t process_data;
 
-    std::vector<pending_download_item_t> pending_download_items;
+    std::list<pending_download_item_t> pending_download_items; // download jobs keep iterators to their items
     std::atomic_size_t pending_download_files_count;
 
     std::mutex download_workers_mtx;
     std::vector<std::unique_ptr<download_worker_job_t>> download_workers;
+
+    std::optional<deep_check_t> deep_check; // left by a check for the hashing tier, which resets it once done
+    std::mutex deep_check_mtx; // guards deep_check_findings and hash_cache while the hashing tier runs
+    std::vector<rm_entry_table::id_t> deep_check_findings; // invalid entries not moved to the pending ones yet
+    std::thread *deep_checker = nullptr; // root only, hashes for the root and its dependencies
+    std::atomic_bool deep_checking = false;
+    worker_process_data_t deep_check_data; // progress of the hashing tier, in files
   } worker;
 public:
   explicit rm_tree(std::filesystem::path base_path);
@@ -114,12 +218,33 @@ public:
   bool downloading() const;
   bool downloaded() const;
   error_code_t stop_download();
+  error_code_t set_download_concurrency(size_t min_count, size_t max_count);
+  size_t get_download_concurrency() const;
 
   // Checker
-  error_code_t check();
+  error_code_t check(bool full = false); // full checks ignore cached hashes and verified directories
   bool checking() const;
   bool checked() const;
   error_code_t stop_check();
+  error_code_t set_check_threads_count(size_t count); // 0 to use a thread per hardware thread
+
+  // Hashing tier of a check. A check reports what stats tell about files right away and leaves the files only their
+  // content can tell about to a background low priority hashing tier. Files it finds to be corrupt are added to
+  // the pending ones; a download started meanwhile picks them up and doesn't finish before the tier does.
+  bool deep_checking() const;
+  uint64_t get_deep_check_total_work_amount() const;
+  uint64_t get_deep_check_completed_work_amount() const;
+
+  // Pipeline: fetch, check and download in one run, downloading pending files while the check is still hashing.
+  // fetching(), checking() and downloading() tell the current phase.
+  error_code_t sync();
+  bool syncing() const;
+  error_code_t stop_sync();
+
+  // Change watcher, lets checks look only at the files changed since the previous check
+  error_code_t start_watching();
+  bool watching() const;
+  error_code_t stop_watching();
 
   // Modifications remover
   error_code_t remove_modifications();
@@ -144,36 +269,123 @@ private:
   using worker_t = void(rm_tree &tree, worker_process_data_t *process_data);
 
   // Helpers
-  bool is_working() const;
-  std::filesystem::path get_entry_full_path(const rm_entry &entry) const;
+  bool is_working() const; // a worker or the hashing tier of a check is running
+  std::filesystem::path get_entry_full_path(rm_entry_table::id_t id) const;
   void summon_worker(worker_t worker_fn);
   void worker_release();
+  void deep_checker_release();
 
   cdns_const_iterator get_current_cdn(uint64_t offset = 0);
-  std::string fetch_url_path_content(const std::string &path);
+  std::optional<std::string> fetch_url_path_content(const std::string &path, bool allow_missing = false);
+  fetch_status_t fetch_url_path(const std::string &path,
+                                const fetch_sink_t &sink,
+                                const fetch_options_t &options,
+                                fetch_validators_t *validators = nullptr);
+  fetch_status_t fetch_compressed_url_path(const std::string &path,
+                                           const fetch_sink_t &content_sink,
+                                           const fetch_options_t &options,
+                                           fetch_validators_t *validators = nullptr);
+  void fetch_url_paths(const std::vector<std::string> &paths,
+                       const std::function<void(size_t index, std::string &&content)> &on_fetched,
+                       const std::atomic_bool &force_stop);
+  static error_code_t get_curl_error(CURLcode error_code, std::string &error_str);
+  static bool is_missing_file_response(CURLcode error_code, bool is_http, long response_code);
+  std::filesystem::path get_state_path() const;
+
+  // Fetcher helpers
+  static std::vector<manifest_variant_t> get_manifest_variants();
+  void update_manifest(const std::atomic_bool &force_stop);
+  fetch_status_t fetch_manifest(const manifest_variant_t &variant,
+                                const fetch_validators_t &conditional,
+                                fetch_validators_t &validators,
+                                const std::atomic_bool &force_stop);
+  fetch_status_t fetch_sharded_manifest(const manifest_variant_t &variant,
+                                        const fetch_validators_t &conditional,
+                                        fetch_validators_t &validators,
+                                        const std::atomic_bool &force_stop);
+  std::string fetch_manifest_dictionary();
+  uint64_t fetch_manifest_version();
+  bool update_manifest_with_deltas(manifest_cache_info_t info, uint64_t version, const std::atomic_bool &force_stop);
+  void apply_manifest_delta(const nlohmann::json &delta);
+  std::optional<manifest_cache_info_t> load_manifest_cache_info() const;
+  bool load_cached_manifest(const manifest_cache_info_t &info);
+  void save_manifest_cache(manifest_cache_info_t &info) const;
+  void store_manifest_cache(manifest_cache_info_t info);
 
   // Download helpers
-  auto find_download_worker(CURL *easy_handler);
-  auto find_pending_download_item(const rm_entry &entry);
+  download_worker_job_t *find_download_worker(CURL *easy_handler) const;
+  void release_download_worker(const download_worker_job_t *job);
+  void open_download(download_worker_job_t &job); // resumes what a previous attempt left when it can
+  bool resume_download(download_worker_job_t &job, const nlohmann::json &partial_info);
+  static bool accept_download_response(download_worker_job_t &job);
+  static void receive_download_content(download_worker_job_t &job, const char *data, size_t size);
+  std::string commit_download(download_worker_job_t &job); // returns an error if the content is not the expected one
+  static void suspend_download(download_worker_job_t &job); // keeps what was received for the next attempt
+  static void discard_download(download_worker_job_t &job);
+  // "Key: value" response header line into the lowercase key and the trimmed value
+  static std::optional<std::pair<std::string, std::string_view>> parse_header_line(std::string_view line);
+  void load_hash_cache();
+  void save_hash_cache() const;
 
   // Checker helpers
-  bool is_entry_valid(const rm_entry &entry) const;
+  std::vector<bool> get_changed_entries(const std::vector<std::string> &paths) const;
+  // std::nullopt when only reading the file can tell
+  std::optional<bool> is_entry_valid_by_stat(rm_entry_table::id_t id,
+                                             const std::optional<common::file_stat_t> &stat,
+                                             const std::optional<int64_t> &racy_mtime) const;
+  bool is_entry_content_valid(rm_entry_table::id_t id,
+                              const common::file_stat_t &stat,
+                              common::thread_pool *hash_pool = nullptr) const;
+  void finish_check(const std::vector<bool> &invalid,
+                    const std::vector<uint64_t> &fingerprints,
+                    const std::optional<int64_t> &racy_mtime,
+                    bool incremental);
+  void take_deep_check_findings(worker_process_data_t *downloader_data = nullptr);
+  int64_t touch_check_stamp() const;
+  verified_directories_t load_verified_directories() const;
+  void save_verified_directories(const verified_directories_t &directories) const;
   size_t get_entries_count(bool include_dependencies = true) const;
   uint64_t get_pending_items_download_size(bool include_dependencies = true) const;
 
   // Modifications remover helpers
-  std::vector<rm_entry> get_all_entries(bool include_dependencies = true) const;
+  void build_path_index(bool include_dependencies = true);
+  bool has_entry(std::string_view relative_path, bool include_dependencies = true) const;
+  bool is_partial_download(std::string_view relative_path) const; // resume state of an entry, see open_download
 
   // Workers
   static void download_worker(rm_tree &tree, worker_process_data_t *process_data = nullptr);
   static void updates_fetcher_worker(rm_tree &tree, worker_process_data_t *process_data = nullptr);
   static void check_worker(rm_tree &tree, worker_process_data_t *process_data = nullptr);
+  static void sync_worker(rm_tree &tree, worker_process_data_t *process_data = nullptr);
+  static void deep_check_worker(rm_tree &tree, worker_process_data_t *process_data = nullptr,
+                                common::thread_pool *hash_pool = nullptr);
   static void remove_modifications_worker(rm_tree &tree, worker_process_data_t *process_data = nullptr);
 
+  // Fetcher data
+  static constexpr const char *kCachedManifestFilename = "manifest.bin";
+  static constexpr const char *kCachedManifestInfoFilename = "manifest.json";
+  static constexpr uint64_t kMaxManifestDeltaChainLength = 8; // longer chains are slower than the whole manifest
+  static constexpr size_t kParallelFetchesCount = 8;
+  static constexpr size_t kMaxFetchFailsCount = 3;
+
   // Check worker data
+  static constexpr size_t kCheckEntriesPerTask = 32; // small enough to balance hashing of files of different sizes
+  static constexpr size_t kCheckReadaheadFilesCount = 8; // files to read hinted to the OS ahead of reading them
+  static constexpr common::read_order_t kCheckReadOrder = common::read_order_t::kPhysical;
+  static constexpr auto kDeepCheckPollInterval = std::chrono::milliseconds(100); // of downloads waiting for findings
+  static constexpr const char *kVerifiedDirectoriesFilename = "verified.json";
+  static constexpr const char *kCheckStampFilename = "check.stamp";
+  static constexpr const char *kHashCacheFilename = "hashes.json";
+  static constexpr int64_t kRacyModificationSeconds = 2; // files modified that recently are never trusted by mtime
   static constexpr size_t kMaxCdnErrorsCount = 10;
 
   // Download worker data
-  static constexpr size_t kParallelJobsCount = 5;
+  static constexpr const char *kPartialDownloadSuffix = ".part";
+  static constexpr const char *kPartialDownloadInfoSuffix = ".part.json";
+  static constexpr const char *kPartialDownloadReceivedSuffix = ".part.zst";
+  static constexpr size_t kParallelJobsCount = 5; // to start with
+  static constexpr size_t kMinParallelJobsCount = 1;
+  static constexpr size_t kMaxParallelJobsCount = 32;
   static constexpr size_t kMaxDownloadWorkerErrorsCount = 15;
+  static constexpr int kDownloadPollTimeoutMs = 300; // force stop and deep check findings are seen this often
 };
@@ -0,0 +1,169 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <filesystem>
+#include <limits>
+#include <system_error>
+#include <utility>
+
+#if WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace common {
+// Read-only memory mapping of a whole file or a range of it. Empty files are "mapped" as a null pointer with zero size.
+class mapped_file {
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+
+  void release() {
+#if WIN32
+    if (data_ != nullptr)
+      UnmapViewOfFile(data_);
+#else
+    if (data_ != nullptr)
+      munmap(const_cast<uint8_t *>(data_), size_);
+#endif
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  static size_t get_mapped_size(uint64_t file_size, uint64_t offset, size_t length) {
+    if (offset >= file_size)
+      return 0;
+    return static_cast<size_t>(std::min<uint64_t>(file_size - offset, length));
+  }
+public:
+  mapped_file() = default;
+
+  // Throws std::system_error if the file can't be opened or mapped
+  explicit mapped_file(const std::filesystem::path &path) : mapped_file(path, 0, SIZE_MAX) {}
+
+  // Maps at most `length` bytes starting at `offset`, which must be a multiple of get_granularity().
+  // The range is clipped to the end of the file, ranges past the end are mapped as empty.
+  mapped_file(const std::filesystem::path &path, uint64_t offset, size_t length) {
+#if WIN32
+    auto file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), "Could not open file");
+    LARGE_INTEGER file_sz{};
+    if (!GetFileSizeEx(file, &file_sz)) {
+      auto error = GetLastError();
+      CloseHandle(file);
+      throw std::system_error(static_cast<int>(error), std::system_category(), "Could not get file size");
+    }
+    auto mapped_size = get_mapped_size(static_cast<uint64_t>(file_sz.QuadPart), offset, length);
+    if (mapped_size > 0) {
+      auto mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (mapping == nullptr) {
+        auto error = GetLastError();
+        CloseHandle(file);
+        throw std::system_error(static_cast<int>(error), std::system_category(), "Could not map file");
+      }
+      data_ = reinterpret_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, static_cast<DWORD>(offset >> 32),
+                                                              static_cast<DWORD>(offset), mapped_size));
+      auto error = GetLastError();
+      CloseHandle(mapping); // the view keeps the mapping alive
+      CloseHandle(file);
+      if (data_ == nullptr)
+        throw std::system_error(static_cast<int>(error), std::system_category(), "Could not map file view");
+      size_ = mapped_size;
+    } else {
+      CloseHandle(file);
+    }
+#else
+    if (offset > static_cast<uint64_t>(std::numeric_limits<off_t>::max()))
+      throw std::system_error(EOVERFLOW, std::generic_category(), "Could not map file");
+    auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(), "Could not open file");
+    struct stat file_stat{};
+    if (fstat(fd, &file_stat) != 0) {
+      auto error = errno;
+      ::close(fd);
+      throw std::system_error(error, std::generic_category(), "Could not get file size");
+    }
+    auto mapped_size = get_mapped_size(static_cast<uint64_t>(file_stat.st_size), offset, length);
+    if (mapped_size > 0) {
+      auto ptr = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(offset));
+      auto error = errno;
+      ::close(fd); // the mapping keeps the file alive
+      if (ptr == MAP_FAILED)
+        throw std::system_error(error, std::generic_category(), "Could not map file");
+      data_ = reinterpret_cast<const uint8_t *>(ptr);
+      size_ = mapped_size;
+    } else {
+      ::close(fd);
+    }
+#endif
+  }
+
+  // Alignment of mapping offsets
+  static uint64_t get_granularity() {
+#if WIN32
+    SYSTEM_INFO info{};
+    GetSystemInfo(&info);
+    return info.dwAllocationGranularity;
+#else
+    return static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#endif
+  }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  mapped_file(mapped_file &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+  mapped_file &operator=(mapped_file &&other) noexcept {
+    if (this != &other) {
+      release();
+      data_ = std::exchange(other.data_, nullptr);
+      size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+  }
+
+  ~mapped_file() {
+    release();
+  }
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+};
+}
@@ -0,0 +1,132 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+#include "file_reader.hpp"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#elif !WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace common {
+enum class read_order_t {
+  kTable, // as given
+  kDirectory, // files of a directory next to each other
+  kInode, // by inode number, most filesystems allocate them near their directory and in creation order
+  kPhysical // by the disk offset of the first extent (FIEMAP), Linux only
+};
+
+// Hinted bytes of every file to read, the kernel's own readahead takes over once reading starts
+constexpr uint64_t kReadaheadSize = 2 * 1024 * 1024;
+
+struct read_item_t {
+  size_t index; // in the caller's list
+  std::filesystem::path path;
+  uint64_t file_id = 0;
+};
+
+// Disk offset of the first byte of a file, std::nullopt if the filesystem doesn't report one
+inline std::optional<uint64_t> get_file_physical_offset(const std::filesystem::path &path) {
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+  auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return std::nullopt;
+  alignas(fiemap) uint8_t buffer[sizeof(fiemap) + sizeof(fiemap_extent)]{};
+  auto map = reinterpret_cast<fiemap *>(buffer);
+  map->fm_length = FIEMAP_MAX_OFFSET;
+  map->fm_extent_count = 1;
+  auto ret = ::ioctl(fd, FS_IOC_FIEMAP, map);
+  ::close(fd);
+  if (ret != 0 || map->fm_mapped_extents == 0 || (map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN) != 0)
+    return std::nullopt;
+  return map->fm_extents[0].fe_physical;
+#else
+  (void) path;
+  return std::nullopt;
+#endif
+}
+
+// Sorts files for reading them one after another with as few disk seeks as possible.
+// Returns the order actually used: kPhysical falls back to kInode if the filesystem reports no extents, kInode
+// falls back to kDirectory without inode numbers (Windows).
+inline read_order_t sort_for_reading(std::vector<read_item_t> &files, read_order_t order) {
+  if (order == read_order_t::kPhysical) {
+    std::vector<std::pair<uint64_t, read_item_t>> keyed;
+    keyed.reserve(files.size());
+    auto mapped = false;
+    for (auto &file : files) {
+      auto offset = get_file_physical_offset(file.path);
+      mapped = mapped || offset.has_value();
+      keyed.emplace_back(offset.value_or(UINT64_MAX), std::move(file)); // empty files have no extents, last
+    }
+    if (mapped) {
+      std::stable_sort(keyed.begin(), keyed.end(), [](auto &a, auto &b) { return a.first < b.first; });
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+      files[i] = std::move(keyed[i].second);
+    }
+    if (mapped)
+      return order;
+    order = read_order_t::kInode;
+  }
+  if (order == read_order_t::kInode) {
+    if (std::any_of(files.begin(), files.end(), [](auto &file) { return file.file_id != 0; })) {
+      std::stable_sort(files.begin(), files.end(), [](auto &a, auto &b) { return a.file_id < b.file_id; });
+      return order;
+    }
+    order = read_order_t::kDirectory;
+  }
+  if (order == read_order_t::kDirectory) {
+    std::stable_sort(files.begin(), files.end(), [](auto &a, auto &b) {
+      return a.path.parent_path().native() < b.path.parent_path().native();
+    });
+  }
+  return order;
+}
+
+// Asks the OS to start reading the beginning of a file which is going to be read soon
+inline void hint_file_read(const std::filesystem::path &path, uint64_t size) {
+#if !WIN32 && defined(POSIX_FADV_WILLNEED)
+  auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  advise_file_range(fd, 0, std::min(size, kReadaheadSize), POSIX_FADV_WILLNEED);
+  ::close(fd);
+#else
+  (void) path;
+  (void) size;
+#endif
+}
+}
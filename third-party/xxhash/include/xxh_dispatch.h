@@ -0,0 +1,31 @@
+/*
+ * Runtime-dispatched XXH3 entry points. The widest vector unit supported by the running CPU is picked on the
+ * first call, so one binary runs AVX2 code where available and falls back to the portable build elsewhere.
+ * All variants produce identical hashes. States are shared with the portable XXH3_* functions, so
+ * XXH3_64bits_reset and XXH3_64bits_digest are used as usual and only updates go through the dispatcher.
+ */
+#ifndef XXH_DISPATCH_H
+#define XXH_DISPATCH_H
+
+#ifndef XXH_STATIC_LINKING_ONLY
+#  define XXH_STATIC_LINKING_ONLY
+#endif
+#include "xxhash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+XXH64_hash_t XXH3_64bits_dispatch(const void *input, size_t length);
+XXH_errorcode XXH3_64bits_update_dispatch(XXH3_state_t *state, const void *input, size_t length);
+XXH128_hash_t XXH3_128bits_dispatch(const void *input, size_t length);
+XXH_errorcode XXH3_128bits_update_dispatch(XXH3_state_t *state, const void *input, size_t length);
+
+/* "avx2", "sse2", "neon" or "scalar" */
+const char *XXH3_dispatch_target(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* XXH_DISPATCH_H */
@@ -0,0 +1,9 @@
+/*
+ * XXH3 built for AVX2 under a private namespace. Compiled with AVX2 enabled, so nothing here may be called
+ * before xxh_dispatch.cpp has checked the CPU.
+ */
+#define XXH_VECTOR 2 /* XXH_AVX2 */
+#define XXH_NAMESPACE xxh_avx2_
+#define XXH_STATIC_LINKING_ONLY
+#define XXH_IMPLEMENTATION
+#include "xxhash.h"
@@ -0,0 +1,108 @@
+// Picks the XXH3 build for the running CPU once, then forwards every call to it.
+// Only x86 has something to choose from: SSE2 is the baseline of every x86 target we build for, AVX2 is not.
+
+#include "xxh_dispatch.h"
+
+#if defined(XXH_DISPATCH_AVX2)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+extern "C" {
+XXH64_hash_t xxh_avx2_XXH3_64bits(const void *input, size_t length);
+XXH_errorcode xxh_avx2_XXH3_64bits_update(XXH3_state_t *state, const void *input, size_t length);
+XXH128_hash_t xxh_avx2_XXH3_128bits(const void *input, size_t length);
+XXH_errorcode xxh_avx2_XXH3_128bits_update(XXH3_state_t *state, const void *input, size_t length);
+}
+#endif
+
+namespace {
+struct dispatch_table_t {
+  const char *target;
+  XXH64_hash_t (*hash64)(const void *input, size_t length);
+  XXH_errorcode (*update64)(XXH3_state_t *state, const void *input, size_t length);
+  XXH128_hash_t (*hash128)(const void *input, size_t length);
+  XXH_errorcode (*update128)(XXH3_state_t *state, const void *input, size_t length);
+};
+
+const char *get_portable_target() {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM) || defined(_M_ARM64)
+  return "neon";
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP == 2)
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+#if defined(XXH_DISPATCH_AVX2)
+// AVX2 needs both the CPU feature and the OS saving YMM registers on context switches
+bool has_avx2() {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+  __cpuid(info, 1);
+  constexpr int osxsave_avx = (1 << 27) | (1 << 28);
+  if ((info[2] & osxsave_avx) != osxsave_avx || (_xgetbv(0) & 0x6) != 0x6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid_max(0, nullptr) < 7)
+    return false;
+  __cpuid(1, eax, ebx, ecx, edx);
+  constexpr unsigned int osxsave_avx = (1u << 27) | (1u << 28);
+  if ((ecx & osxsave_avx) != osxsave_avx)
+    return false;
+  unsigned int xcr0, xcr0_high;
+  __asm__ volatile("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+  if ((xcr0 & 0x6) != 0x6)
+    return false;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & (1u << 5)) != 0;
+#endif
+}
+#endif
+
+dispatch_table_t select_dispatch_table() {
+#if defined(XXH_DISPATCH_AVX2)
+  if (has_avx2()) {
+    return {"avx2", xxh_avx2_XXH3_64bits, xxh_avx2_XXH3_64bits_update,
+            xxh_avx2_XXH3_128bits, xxh_avx2_XXH3_128bits_update};
+  }
+#endif
+  return {get_portable_target(), XXH3_64bits, XXH3_64bits_update, XXH3_128bits, XXH3_128bits_update};
+}
+
+const dispatch_table_t &get_dispatch_table() {
+  static const dispatch_table_t table = select_dispatch_table();
+  return table;
+}
+}
+
+extern "C" {
+XXH64_hash_t XXH3_64bits_dispatch(const void *input, size_t length) {
+  return get_dispatch_table().hash64(input, length);
+}
+
+XXH_errorcode XXH3_64bits_update_dispatch(XXH3_state_t *state, const void *input, size_t length) {
+  return get_dispatch_table().update64(state, input, length);
+}
+
+XXH128_hash_t XXH3_128bits_dispatch(const void *input, size_t length) {
+  return get_dispatch_table().hash128(input, length);
+}
+
+XXH_errorcode XXH3_128bits_update_dispatch(XXH3_state_t *state, const void *input, size_t length) {
+  return get_dispatch_table().update128(state, input, length);
+}
+
+const char *XXH3_dispatch_target(void) {
+  return get_dispatch_table().target;
+}
+}
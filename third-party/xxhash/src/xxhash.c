@@ -0,0 +1,7 @@
+/*
+ * Portable xxHash build: every XXH* function, with XXH3 vectorized for the compile-time target
+ * (SSE2 on x86-64 and MSVC x86, NEON on ARM).
+ */
+#define XXH_STATIC_LINKING_ONLY
+#define XXH_IMPLEMENTATION
+#include "xxhash.h"
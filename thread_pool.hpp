@@ -0,0 +1,243 @@
+// MIT License
+
+// Copyright (c) 2023 Northn
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#if WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+namespace common {
+// Lets the calling thread yield CPU and, where the OS supports it, disk time to everything else
+inline void lower_current_thread_priority() {
+#if WIN32
+  SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN); // lowers I/O priority too
+#elif defined(__linux__)
+  auto tid = static_cast<id_t>(syscall(SYS_gettid));
+  setpriority(PRIO_PROCESS, tid, 10); // nice values are per thread on Linux
+#if defined(SYS_ioprio_set)
+  constexpr int kIoprioWhoProcess = 1;
+  constexpr int kIoprioBestEffortLowest = (2 << 13) | 7; // not the idle class, which starves during downloads
+  syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, kIoprioBestEffortLowest);
+#endif
+#endif
+}
+
+// Work-stealing pool: every thread has its own queue of tasks. Tasks submitted from a pool thread go to its own
+// queue, which keeps nested work on the thread that made it; tasks submitted from other threads are spread
+// round-robin. Idle threads steal from the other queues. Every queue is run oldest first, so tasks reading files
+// start in about the order they were submitted in.
+// Threads that wait for a task's result through wait() run queued tasks meanwhile, so tasks may submit and wait
+// for subtasks without exhausting the pool.
+class thread_pool {
+  using task_t = std::function<void()>;
+
+  struct queue_t {
+    std::mutex mtx;
+    std::deque<task_t> tasks;
+  };
+
+  std::vector<std::unique_ptr<queue_t>> queues; // one per thread
+  std::vector<std::thread> threads;
+  std::atomic_size_t next_queue = 0;
+  std::atomic_size_t queued_tasks_count = 0;
+  std::mutex sleep_mtx;
+  std::condition_variable sleep_cv;
+  bool stopping = false;
+
+  static thread_pool *&current_pool() {
+    static thread_local thread_pool *pool = nullptr;
+    return pool;
+  }
+
+  static size_t &current_index() {
+    static thread_local size_t index = 0;
+    return index;
+  }
+
+  std::optional<size_t> get_own_queue() const {
+    if (current_pool() != this)
+      return std::nullopt;
+    return current_index();
+  }
+
+  bool pop_task(task_t &task) {
+    auto own_queue = get_own_queue();
+    if (own_queue.has_value()) {
+      auto &queue = *queues[*own_queue];
+      std::scoped_lock lock(queue.mtx);
+      if (!queue.tasks.empty()) {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        --queued_tasks_count;
+        return true;
+      }
+    }
+    auto first = own_queue.has_value() ? *own_queue + 1 : 0;
+    for (size_t i = 0; i < queues.size(); ++i) {
+      auto &queue = *queues[(first + i) % queues.size()];
+      std::scoped_lock lock(queue.mtx);
+      if (!queue.tasks.empty()) {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        --queued_tasks_count;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool run_pending_task() {
+    task_t task;
+    if (!pop_task(task))
+      return false;
+    task();
+    return true;
+  }
+
+  void push_task(task_t task) {
+    auto index = get_own_queue().value_or(next_queue++ % queues.size());
+    {
+      std::scoped_lock lock(queues[index]->mtx);
+      queues[index]->tasks.push_back(std::move(task));
+    }
+    {
+      std::scoped_lock lock(sleep_mtx); // a thread about to sleep either sees the task or gets the notification
+      ++queued_tasks_count;
+    }
+    sleep_cv.notify_one();
+  }
+
+  void thread_loop(size_t index, bool low_priority) {
+    current_pool() = this;
+    current_index() = index;
+    if (low_priority)
+      lower_current_thread_priority();
+    while (true) {
+      if (run_pending_task())
+        continue;
+      std::unique_lock lock(sleep_mtx);
+      if (stopping && queued_tasks_count == 0)
+        return;
+      sleep_cv.wait(lock, [this]() { return stopping || queued_tasks_count != 0; });
+    }
+  }
+public:
+  static size_t get_default_threads_count() {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  explicit thread_pool(size_t threads_count = get_default_threads_count(), bool low_priority = false) {
+    threads_count = std::max<size_t>(1, threads_count);
+    for (size_t i = 0; i < threads_count; ++i) {
+      queues.push_back(std::make_unique<queue_t>());
+    }
+    threads.reserve(threads_count);
+    for (size_t i = 0; i < threads_count; ++i) {
+      threads.emplace_back(&thread_pool::thread_loop, this, i, low_priority);
+    }
+  }
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  // Runs the tasks that are already queued, then joins
+  ~thread_pool() {
+    {
+      std::scoped_lock lock(sleep_mtx);
+      stopping = true;
+    }
+    sleep_cv.notify_all();
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+
+  size_t size() const { return threads.size(); }
+
+  template <typename Fn>
+  std::future<std::invoke_result_t<Fn>> submit(Fn fn) {
+    auto task = std::make_shared<std::packaged_task<std::invoke_result_t<Fn>()>>(std::move(fn));
+    auto ret = task->get_future();
+    push_task([task]() { (*task)(); });
+    return ret;
+  }
+
+  // future.get() that keeps the calling thread busy with queued tasks
+  template <typename T>
+  T wait(std::future<T> &future) {
+    while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      if (!run_pending_task())
+        future.wait_for(std::chrono::milliseconds(1));
+    }
+    return future.get();
+  }
+
+  // Calls fn(begin, end) for consecutive ranges of at most `chunk_size` out of [0, count) as separate tasks and
+  // waits for all of them. The first exception is rethrown once every task is done, as the tasks may reference
+  // the caller's frame.
+  template <typename Fn>
+  void parallel_for(size_t count, size_t chunk_size, Fn fn) {
+    chunk_size = std::max<size_t>(1, chunk_size);
+    std::vector<std::future<void>> tasks;
+    tasks.reserve((count + chunk_size - 1) / chunk_size);
+    for (size_t begin = 0; begin < count; begin += chunk_size) {
+      auto end = std::min(begin + chunk_size, count);
+      tasks.push_back(submit([&fn, begin, end]() { fn(begin, end); }));
+    }
+    std::exception_ptr error;
+    for (auto &task : tasks) {
+      try {
+        wait(task);
+      } catch (...) {
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+}